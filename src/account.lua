@@ -30,6 +30,7 @@ Account._mt.__call = function (self, arg)
     _check_optional(arg.oauth2, 'string')
     _check_optional(arg.port, 'number')
     _check_optional(arg.ssl, 'string')
+    _check_optional(arg.connections, 'number')
 
     local object = {}
 
@@ -44,16 +45,11 @@ Account._mt.__call = function (self, arg)
     object._account.session = nil
     object._account.selected = nil
     object._account.readonly = nil
+    object._account.connections = arg.connections or 1
+    object._account.pool = {}
     object._string = object._account.username .. '@' .. object._account.server
 
-    for key, value in pairs(Account) do
-        if type(value) == 'function' then object[key] = value end
-    end
-
-    object._mt = {}
-    object._mt.__index = object._attach_mailbox
-    object._mt.__gc = object._logout_user
-    setmetatable(object, object._mt)
+    setmetatable(object, Account._object_mt)
 
     table.insert(_imap, object)
 
@@ -62,9 +58,14 @@ end
 
 
 function Account._check_connection(self)
-    if not self._account.session then
-        self._login_user(self)
-    end
+    local session
+    repeat
+        if not self._account.session then
+            self._login_user(self)
+        end
+        session = self._account.session
+        ifcore.wait(session)
+    until self._account.session == session
 end
 
 function Account._check_result(self, request, result)
@@ -82,14 +83,15 @@ function Account._login_user(self)
             self._account.password = get_password('Enter password for ' ..
                                                   self._string .. ': ')
     end
-    if type(self._account.password) == 'string' then
-        self._account.password = string.gsub(self._account.password, '"', '\\"')
+    local password = self._account.password
+    if type(password) == 'string' then
+        password = string.gsub(password, '"', '\\"')
     end
 
     if self._account.session then return true end
     local r, s = ifcore.login(self._account.server, self._account.port,
                               self._account.ssl, self._account.username,
-                              self._account.password, self._account.oauth2)
+                              password, self._account.oauth2)
     self._check_result(self, 'login', r)
     if r == false then
         error('authentication of ' .. self._string .. ' failed.', 0)
@@ -105,6 +107,19 @@ end
 
 function Account._logout_user(self)
     self._check_connection(self)
+    local pool = {}
+    local p = true
+    for _, connection in ipairs(self._account.pool) do
+        local r = ifcore.logout(connection.session)
+        if r == nil then
+            p = nil
+        elseif r == false then
+            if p then p = false end
+            table.insert(pool, connection)
+        end
+    end
+    self._account.pool = pool
+
     local r = ifcore.logout(self._account.session)
     self._check_result(self, 'logout', r)
     if r == false then return false end
@@ -113,10 +128,49 @@ function Account._logout_user(self)
     self._account.selected = nil
     self._account.readonly = nil
 
+    self._check_result(self, 'logout', p)
+    if p == false then return false end
+
     return true
 end
 
 
+-- The state of a connection, which is moved between the account and its pool
+-- of idle connections.
+Account._connection_state = { 'session', 'selected', 'readonly', 'uidvalidity',
+                              'modseq' }
+
+function Account._swap_connection(self, index)
+    local idle = {}
+    for _, k in ipairs(Account._connection_state) do
+        idle[k] = self._account[k]
+        self._account[k] = nil
+    end
+    if index then
+        for k, v in pairs(table.remove(self._account.pool, index)) do
+            self._account[k] = v
+        end
+    end
+    if idle.session then table.insert(self._account.pool, 1, idle) end
+end
+
+function Account._route_connection(self, mailbox)
+    local account = self._account
+    if account.connections <= 1 or account.selected == mailbox then return end
+
+    for i, connection in ipairs(account.pool) do
+        if connection.selected == mailbox then
+            return self._swap_connection(self, i)
+        end
+    end
+    if account.selected == nil then return end
+    if #account.pool + 1 < account.connections then
+        return self._swap_connection(self, nil)
+    end
+    return self._swap_connection(self, #account.pool)
+end
+
+
 function Account._attach_mailbox(self, mailbox)
     self[mailbox] = Mailbox(self, mailbox)
     return self[mailbox]
@@ -277,5 +331,16 @@ end
 Account.login = Account._login_user
 Account.logout = Account._logout_user
 
+-- All the accounts share one metatable, that looks up their methods in the
+-- class, and attaches mailboxes for the rest of the keys.
+Account._object_mt = {}
+
+Account._object_mt.__index = function (self, key)
+    local method = rawget(Account, key)
+    if type(method) == 'function' then return method end
+    return Account._attach_mailbox(self, key)
+end
+Account._object_mt.__gc = Account._logout_user
+
 Account._mt.__index = function () end
 Account._mt.__newindex = function () end
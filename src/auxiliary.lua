@@ -23,6 +23,11 @@ function get_password(prompt)
 end
 
 
+function cache_statistics()
+    return _cache.hits, _cache.misses, _cache.evictions, _cache.size
+end
+
+
 function pipe_to(command, data)
     _check_required(command, 'string')
     _check_required(data, 'string')
@@ -53,7 +58,9 @@ end
 
 function become_daemon(interval, commands, nochdir, noclose)
     _check_required(interval, 'number')
-    _check_required(commands, 'function')
+    if type(commands) ~= 'table' then
+        _check_required(commands, 'function')
+    end
     _check_optional(nochdir, 'boolean')
     _check_optional(noclose, 'boolean')
 
@@ -61,12 +68,123 @@ function become_daemon(interval, commands, nochdir, noclose)
     if noclose == nil then noclose = false end
     ifsys.daemon(nochdir, noclose)
     repeat
-        commands()
+        if type(commands) == 'table' then
+            run_concurrently(commands)
+        else
+            commands()
+        end
+        _sync_persistent()
         collectgarbage()
     until ifsys.sleep(interval) ~= 0
 end
 
 
+function run_concurrently(commands, workers)
+    _check_required(commands, 'table')
+    _check_optional(workers, 'number')
+
+    for _, account in pairs(_imap) do
+        if account._account.session or #account._account.pool > 0 then
+            pcall(account._logout_user, account)
+        end
+    end
+    _close_persistent()
+
+    local results = {}
+    local running = {}
+    local count = 0
+    for key, command in pairs(commands) do
+        _check_required(command, 'function')
+
+        while workers ~= nil and count >= workers do
+            local pid, status = ifsys.wait()
+            if pid == nil then break end
+            if running[pid] ~= nil then
+                results[running[pid]] = (status == 0)
+                running[pid] = nil
+                count = count - 1
+            end
+        end
+
+        local pid
+        if workers == nil or count < workers then pid = ifsys.fork() end
+        if pid == 0 then
+            local r, e = pcall(command)
+            if not r then io.stderr:write(tostring(e) .. '\n') end
+            _sync_persistent()
+            for _, account in pairs(_imap) do
+                if account._account.session or #account._account.pool > 0 then
+                    pcall(account._logout_user, account)
+                end
+            end
+            os.exit(r and 0 or 1)
+        elseif pid == nil then
+            results[key] = false
+        else
+            running[pid] = key
+            count = count + 1
+        end
+    end
+
+    while count > 0 do
+        local pid, status = ifsys.wait()
+        if pid == nil then break end
+        if running[pid] ~= nil then
+            results[running[pid]] = (status == 0)
+            running[pid] = nil
+            count = count - 1
+        end
+    end
+
+    return results
+end
+
+
+function run_cooperatively(commands)
+    _check_required(commands, 'table')
+
+    local waiting = {}
+    for key, command in pairs(commands) do
+        _check_required(command, 'function')
+        waiting[key] = { thread = ifcore.coroutine(command) }
+    end
+
+    local results = {}
+    while next(waiting) ~= nil do
+        local sessions = {}
+        local runnable = false
+        for _, w in pairs(waiting) do
+            if w.session then
+                table.insert(sessions, w.session)
+            else
+                runnable = true
+            end
+        end
+
+        local ready = {}
+        if #sessions > 0 then ready = ifcore.poll(sessions, not runnable) end
+
+        for key, w in pairs(waiting) do
+            if w.session == nil or ready[w.session] then
+                local r, s = coroutine.resume(w.thread)
+                if not r then
+                    io.stderr:write(tostring(s) .. '\n')
+                    results[key] = false
+                    waiting[key] = nil
+                elseif coroutine.status(w.thread) == 'dead' then
+                    results[key] = true
+                    waiting[key] = nil
+                else
+                    w.session = type(s) == 'userdata' and s or nil
+                end
+            end
+        end
+    end
+
+    return results
+end
+
+
 function recover(commands, retries)
     _check_required(commands, 'function')
     _check_optional(retries, 'number')
@@ -58,3 +58,21 @@ buffer_check(buffer *buf, size_t n)
 		buf->data = (char *)xrealloc(buf->data, buf->size + 1);
 	}
 }
+
+
+/*
+ * Release the memory of a buffer that has grown beyond the specified size; the
+ * data it stored are discarded.
+ */
+void
+buffer_shrink(buffer *buf, size_t n)
+{
+
+	if (buf->size <= n)
+		return;
+
+	buf->size = n;
+	buf->data = (char *)xrealloc(buf->data, buf->size + 1);
+	*buf->data = '\0';
+	buf->len = 0;
+}
@@ -18,6 +18,7 @@ void buffer_init(buffer *buf, size_t n);
 void buffer_free(buffer *buf);
 void buffer_reset(buffer *buf);
 void buffer_check(buffer *buf, size_t n);
+void buffer_shrink(buffer *buf, size_t n);
 
 
 #endif				/* BUFFER_H */
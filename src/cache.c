@@ -0,0 +1,708 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include "imapfilter.h"
+
+
+#define CACHE_MAGIC	0x31434649	/* Identifies the cache files. */
+#define CACHE_DIR	"cache"		/* Directory of the cache files. */
+#define CACHE_META	"imapfilter.cache"	/* Metatable of caches. */
+
+
+/* Header of the data and index files of a cache. */
+typedef struct cacheheader {
+	uint32_t magic;		/* Identifier of cache files. */
+	uint32_t uidvalidity;	/* UIDVALIDITY of the mailbox. */
+	uint64_t count;		/* Number of entries in the index. */
+} cacheheader;
+
+/* Entry of the index of a cache, which is sorted by UID and item. */
+typedef struct cacheentry {
+	uint32_t uid;		/* UID of the message. */
+	uint32_t item;		/* Hash of the name of the data item. */
+	uint64_t offset;	/* Position of the record in the data file. */
+	uint32_t len;		/* Length of the record. */
+	uint32_t unused;	/* Padding. */
+} cacheentry;
+
+/* Persistent cache of the data items of the messages of a mailbox. */
+typedef struct cache {
+	int fd;			/* Data file, where records are appended. */
+	char *index;		/* Pathname of the index file. */
+	int writable;		/* Lock of the data file was acquired. */
+	uint32_t uidvalidity;	/* UIDVALIDITY of the mailbox. */
+	char *data;		/* Mapped data file. */
+	size_t datalen;		/* Length of the mapped data file. */
+	off_t end;		/* End of the data file. */
+	void *map;		/* Mapped index file. */
+	size_t maplen;		/* Length of the mapped index file. */
+	cacheentry *entries;	/* Entries of the mapped index file. */
+	size_t len;		/* Number of entries in the index file. */
+	struct {		/* Entries added since the index was written. */
+		cacheentry *entries;	/* Added entries. */
+		size_t len;	/* Number of added entries. */
+		size_t size;	/* Size of the table. */
+		int sorted;	/* Table is sorted. */
+	} added;
+} cache;
+
+
+static int ifcache_open(lua_State *lua);
+static int ifcache_get(lua_State *lua);
+static int ifcache_put(lua_State *lua);
+static int ifcache_flush(lua_State *lua);
+static int ifcache_close(lua_State *lua);
+
+uint32_t cache_hash(const char *s, size_t n);
+char *cache_path(const char *server, const char *user, const char *mbox,
+    const char *ext);
+cache *cache_open(const char *server, const char *user, const char *mbox,
+    uint32_t uidvalidity);
+int cache_reset(cache *c);
+void cache_map(cache *c);
+void cache_unmap(cache *c);
+const cacheentry *cache_find(const cacheentry *e, size_t n, uint32_t uid,
+    uint32_t item);
+int cache_compare(const void *a, const void *b);
+char *cache_get(cache *c, uint32_t uid, const char *item, size_t *len);
+int cache_put(cache *c, uint32_t uid, const char *item, const char *value,
+    size_t len);
+int cache_flush(cache *c);
+void cache_close(cache *c);
+
+/* Lua imapfilter library of persistent cache functions. */
+static const luaL_Reg ifcachelib[] = {
+	{ "open", ifcache_open },
+	{ "get", ifcache_get },
+	{ "put", ifcache_put },
+	{ "flush", ifcache_flush },
+	{ "close", ifcache_close },
+	{ NULL, NULL }
+};
+
+
+/*
+ * FNV-1a hash of the specified data.
+ */
+uint32_t
+cache_hash(const char *s, size_t n)
+{
+	uint32_t h = 2166136261U;
+
+	while (n--) {
+		h ^= (unsigned char)(*s++);
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+
+/*
+ * Pathname of the cache file of a mailbox, inside the cache directory of the
+ * program's home directory, which is created if it does not exist.
+ */
+char *
+cache_path(const char *server, const char *user, const char *mbox,
+    const char *ext)
+{
+	char *d, *p;
+	char n[sizeof("/0123456789abcdef.") + 8];
+	const char *k[3];
+	uint64_t h;
+	int i;
+
+	d = get_filepath(CACHE_DIR);
+	if (!exists_dir(d) && mkdir(d, S_IRUSR | S_IWUSR | S_IXUSR) == -1 &&
+	    errno != EEXIST) {
+		error("could not create directory %s; %s\n", d,
+		    strerror(errno));
+		xfree(d);
+		return NULL;
+	}
+
+	k[0] = server;
+	k[1] = user;
+	k[2] = mbox;
+	h = 14695981039346656037ULL;
+	for (i = 0; i < 3; i++) {
+		do {
+			h ^= (unsigned char)(*k[i]);
+			h *= 1099511628211ULL;
+		} while (*k[i]++ != '\0');
+	}
+
+	snprintf(n, sizeof(n), "/%016llx.%s", (unsigned long long)(h), ext);
+
+	p = (char *)xmalloc((strlen(d) + strlen(n) + 1) * sizeof(char));
+	strcpy(p, d);
+	strcat(p, n);
+	xfree(d);
+
+	return p;
+}
+
+
+/*
+ * Open the cache of a mailbox.  The cache is emptied if it belongs to a
+ * different UIDVALIDITY of the mailbox.  If another process already uses the
+ * cache, it is opened only for reading.
+ */
+cache *
+cache_open(const char *server, const char *user, const char *mbox,
+    uint32_t uidvalidity)
+{
+	cache *c;
+	char *p;
+	cacheheader h;
+
+	if ((p = cache_path(server, user, mbox, "dat")) == NULL)
+		return NULL;
+
+	c = (cache *)xmalloc(sizeof(cache));
+	memset(c, 0, sizeof(cache));
+	c->uidvalidity = uidvalidity;
+
+	if ((c->fd = open(p, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) == -1) {
+		error("could not open cache file %s; %s\n", p,
+		    strerror(errno));
+		xfree(p);
+		xfree(c);
+		return NULL;
+	}
+	fcntl(c->fd, F_SETFD, FD_CLOEXEC);
+	xfree(p);
+
+	if ((c->index = cache_path(server, user, mbox, "idx")) == NULL) {
+		cache_close(c);
+		return NULL;
+	}
+	c->writable = (flock(c->fd, LOCK_EX | LOCK_NB) == 0);
+
+	if (pread(c->fd, &h, sizeof(h), 0) != sizeof(h) ||
+	    h.magic != CACHE_MAGIC || h.uidvalidity != uidvalidity) {
+		if (!c->writable || cache_reset(c) == -1) {
+			cache_close(c);
+			return NULL;
+		}
+	}
+
+	cache_map(c);
+
+	return c;
+}
+
+
+/*
+ * Empty the cache, and start it for the current UIDVALIDITY.
+ */
+int
+cache_reset(cache *c)
+{
+	cacheheader h;
+
+	memset(&h, 0, sizeof(h));
+	h.magic = CACHE_MAGIC;
+	h.uidvalidity = c->uidvalidity;
+
+	unlink(c->index);
+
+	if (ftruncate(c->fd, 0) == -1 ||
+	    pwrite(c->fd, &h, sizeof(h), 0) != sizeof(h)) {
+		error("could not reset cache; %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Map the data and index files of the cache to memory.  An index that does
+ * not match the data file is ignored.
+ */
+void
+cache_map(cache *c)
+{
+	int fd;
+	struct stat st;
+	cacheheader *h;
+	void *m;
+
+	if (fstat(c->fd, &st) == -1)
+		return;
+	c->end = st.st_size;
+
+	if (st.st_size > (off_t)(sizeof(cacheheader)) &&
+	    (m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, c->fd, 0)) !=
+	    MAP_FAILED) {
+		c->data = (char *)(m);
+		c->datalen = st.st_size;
+	}
+
+	if ((fd = open(c->index, O_RDONLY)) == -1)
+		return;
+
+	if (fstat(fd, &st) == -1 ||
+	    st.st_size < (off_t)(sizeof(cacheheader)) ||
+	    (m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) ==
+	    MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	close(fd);
+
+	h = (cacheheader *)(m);
+	if (h->magic != CACHE_MAGIC || h->uidvalidity != c->uidvalidity ||
+	    (size_t)(st.st_size) != sizeof(cacheheader) + h->count *
+	    sizeof(cacheentry)) {
+		munmap(m, st.st_size);
+		return;
+	}
+
+	c->map = m;
+	c->maplen = st.st_size;
+	c->entries = (cacheentry *)((char *)(m) + sizeof(cacheheader));
+	c->len = h->count;
+}
+
+
+/*
+ * Unmap the data and index files of the cache.
+ */
+void
+cache_unmap(cache *c)
+{
+
+	if (c->data != NULL)
+		munmap(c->data, c->datalen);
+	c->data = NULL;
+	c->datalen = 0;
+
+	if (c->map != NULL)
+		munmap(c->map, c->maplen);
+	c->map = NULL;
+	c->maplen = 0;
+	c->entries = NULL;
+	c->len = 0;
+}
+
+
+/*
+ * Compare two index entries, ordering them by UID, item and position.
+ */
+int
+cache_compare(const void *a, const void *b)
+{
+	const cacheentry *x = a, *y = b;
+
+	if (x->uid != y->uid)
+		return (x->uid < y->uid ? -1 : 1);
+	if (x->item != y->item)
+		return (x->item < y->item ? -1 : 1);
+	if (x->offset != y->offset)
+		return (x->offset < y->offset ? -1 : 1);
+
+	return 0;
+}
+
+
+/*
+ * Binary search of sorted index entries, for the last entry of a UID and
+ * item.
+ */
+const cacheentry *
+cache_find(const cacheentry *e, size_t n, uint32_t uid, uint32_t item)
+{
+	size_t l, h, m;
+
+	l = 0;
+	h = n;
+	while (l < h) {
+		m = l + (h - l) / 2;
+		if (e[m].uid < uid || (e[m].uid == uid && e[m].item <= item))
+			l = m + 1;
+		else
+			h = m;
+	}
+
+	if (l > 0 && e[l - 1].uid == uid && e[l - 1].item == item)
+		return &e[l - 1];
+
+	return NULL;
+}
+
+
+/*
+ * Get the value of a data item of a message from the cache.  The returned
+ * memory must be freed by the caller.
+ */
+char *
+cache_get(cache *c, uint32_t uid, const char *item, size_t *len)
+{
+	const cacheentry *e;
+	char *r;
+	size_t n;
+	uint32_t h;
+
+	h = cache_hash(item, strlen(item));
+	n = strlen(item) + 1;
+
+	if (!c->added.sorted) {
+		qsort(c->added.entries, c->added.len, sizeof(cacheentry),
+		    cache_compare);
+		c->added.sorted = 1;
+	}
+
+	if ((e = cache_find(c->added.entries, c->added.len, uid, h)) == NULL &&
+	    (e = cache_find(c->entries, c->len, uid, h)) == NULL)
+		return NULL;
+
+	if (e->len < n || e->offset + e->len > (uint64_t)(c->end))
+		return NULL;
+
+	r = (char *)xmalloc(e->len + 1);
+	if (e->offset + e->len <= c->datalen)
+		memcpy(r, c->data + e->offset, e->len);
+	else if (pread(c->fd, r, e->len, e->offset) != (ssize_t)(e->len)) {
+		xfree(r);
+		return NULL;
+	}
+
+	if (memcmp(r, item, n) != 0) {
+		xfree(r);
+		return NULL;
+	}
+
+	*len = e->len - n;
+	memmove(r, r + n, *len);
+
+	return r;
+}
+
+
+/*
+ * Store the value of a data item of a message in the cache.
+ */
+int
+cache_put(cache *c, uint32_t uid, const char *item, const char *value,
+    size_t len)
+{
+	cacheentry *e;
+	size_t n;
+
+	if (!c->writable)
+		return -1;
+
+	n = strlen(item) + 1;
+
+	if (pwrite(c->fd, item, n, c->end) != (ssize_t)(n) ||
+	    pwrite(c->fd, value, len, c->end + n) != (ssize_t)(len)) {
+		error("could not write to cache; %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (c->added.len == c->added.size) {
+		c->added.size = (c->added.size ? c->added.size * 2 : 64);
+		c->added.entries = (cacheentry *)xrealloc(c->added.entries,
+		    c->added.size * sizeof(cacheentry));
+	}
+
+	e = &c->added.entries[c->added.len++];
+	e->uid = uid;
+	e->item = cache_hash(item, strlen(item));
+	e->offset = c->end;
+	e->len = n + len;
+	e->unused = 0;
+
+	c->end += n + len;
+	c->added.sorted = 0;
+
+	return 0;
+}
+
+
+/*
+ * Write the index of the cache, merging the entries added since it was last
+ * written; the new index replaces the old one atomically.
+ */
+int
+cache_flush(cache *c)
+{
+	FILE *fp;
+	char *t;
+	cacheheader h;
+	size_t i, j, n;
+	const cacheentry *e;
+
+	if (!c->writable || c->added.len == 0)
+		return 0;
+
+	if (!c->added.sorted) {
+		qsort(c->added.entries, c->added.len, sizeof(cacheentry),
+		    cache_compare);
+		c->added.sorted = 1;
+	}
+
+	t = (char *)xmalloc(strlen(c->index) + strlen(".tmp") + 1);
+	strcpy(t, c->index);
+	strcat(t, ".tmp");
+
+	if ((fp = fopen(t, "w")) == NULL) {
+		error("could not write cache index %s; %s\n", t,
+		    strerror(errno));
+		xfree(t);
+		return -1;
+	}
+
+	memset(&h, 0, sizeof(h));
+	h.magic = CACHE_MAGIC;
+	h.uidvalidity = c->uidvalidity;
+	fwrite(&h, sizeof(h), 1, fp);
+
+	i = j = n = 0;
+	while (i < c->len || j < c->added.len) {
+		if (j == c->added.len || (i < c->len &&
+		    (c->entries[i].uid < c->added.entries[j].uid ||
+		    (c->entries[i].uid == c->added.entries[j].uid &&
+		    c->entries[i].item < c->added.entries[j].item)))) {
+			e = &c->entries[i++];
+		} else {
+			if (i < c->len &&
+			    c->entries[i].uid == c->added.entries[j].uid &&
+			    c->entries[i].item == c->added.entries[j].item)
+				i++;
+			while (j + 1 < c->added.len &&
+			    c->added.entries[j + 1].uid ==
+			    c->added.entries[j].uid &&
+			    c->added.entries[j + 1].item ==
+			    c->added.entries[j].item)
+				j++;
+			e = &c->added.entries[j++];
+		}
+		fwrite(e, sizeof(cacheentry), 1, fp);
+		n++;
+	}
+
+	h.count = n;
+	if (fseek(fp, 0L, SEEK_SET) == -1 || fwrite(&h, sizeof(h), 1, fp) != 1 ||
+	    fclose(fp) == EOF || rename(t, c->index) == -1) {
+		error("could not write cache index %s; %s\n", t,
+		    strerror(errno));
+		unlink(t);
+		xfree(t);
+		return -1;
+	}
+	xfree(t);
+
+	c->added.len = 0;
+	cache_unmap(c);
+	cache_map(c);
+
+	return 0;
+}
+
+
+/*
+ * Write the index of the cache, and release its resources.
+ */
+void
+cache_close(cache *c)
+{
+
+	cache_flush(c);
+	cache_unmap(c);
+
+	if (c->fd != -1)
+		close(c->fd);
+
+	if (c->added.entries != NULL)
+		xfree(c->added.entries);
+	if (c->index != NULL)
+		xfree(c->index);
+	xfree(c);
+}
+
+
+/*
+ * Lua implementation of the cache open function.
+ */
+static int
+ifcache_open(lua_State *lua)
+{
+	cache **c;
+
+	if (lua_gettop(lua) != 4)
+		luaL_error(lua, "wrong number of arguments");
+	luaL_checktype(lua, 1, LUA_TSTRING);
+	luaL_checktype(lua, 2, LUA_TSTRING);
+	luaL_checktype(lua, 3, LUA_TSTRING);
+	luaL_checktype(lua, 4, LUA_TNUMBER);
+
+#if LUA_VERSION_NUM < 504
+	c = (cache **)(lua_newuserdata(lua, sizeof(cache *)));
+#else
+	c = (cache **)(lua_newuserdatauv(lua, sizeof(cache *), 1));
+#endif
+	luaL_getmetatable(lua, CACHE_META);
+	lua_setmetatable(lua, -2);
+
+	*c = cache_open(lua_tostring(lua, 1), lua_tostring(lua, 2),
+	    lua_tostring(lua, 3), (uint32_t)(lua_tonumber(lua, 4)));
+
+	if (*c == NULL) {
+		lua_pop(lua, 5);
+		return 0;
+	}
+
+	lua_insert(lua, 1);
+	lua_pop(lua, 4);
+
+	return 1;
+}
+
+
+/*
+ * Lua implementation of the cache get function.
+ */
+static int
+ifcache_get(lua_State *lua)
+{
+	cache *c;
+	char *v;
+	size_t n;
+
+	if (lua_gettop(lua) != 3)
+		luaL_error(lua, "wrong number of arguments");
+	c = *(cache **)(luaL_checkudata(lua, 1, CACHE_META));
+	luaL_checktype(lua, 2, LUA_TNUMBER);
+	luaL_checktype(lua, 3, LUA_TSTRING);
+
+	if (c == NULL)
+		luaL_error(lua, "attempt to use a closed cache");
+
+	v = cache_get(c, (uint32_t)(lua_tonumber(lua, 2)), lua_tostring(lua,
+	    3), &n);
+
+	lua_pop(lua, 3);
+
+	if (v == NULL)
+		return 0;
+
+	lua_pushlstring(lua, v, n);
+	xfree(v);
+
+	return 1;
+}
+
+
+/*
+ * Lua implementation of the cache put function.
+ */
+static int
+ifcache_put(lua_State *lua)
+{
+	cache *c;
+	size_t n;
+	const char *v;
+
+	if (lua_gettop(lua) != 4)
+		luaL_error(lua, "wrong number of arguments");
+	c = *(cache **)(luaL_checkudata(lua, 1, CACHE_META));
+	luaL_checktype(lua, 2, LUA_TNUMBER);
+	luaL_checktype(lua, 3, LUA_TSTRING);
+	luaL_checktype(lua, 4, LUA_TSTRING);
+
+	if (c == NULL)
+		luaL_error(lua, "attempt to use a closed cache");
+
+	v = lua_tolstring(lua, 4, &n);
+	lua_pushboolean(lua, cache_put(c, (uint32_t)(lua_tonumber(lua, 2)),
+	    lua_tostring(lua, 3), v, n) == 0);
+
+	lua_insert(lua, 1);
+	lua_pop(lua, 4);
+
+	return 1;
+}
+
+
+/*
+ * Lua implementation of the cache flush function.
+ */
+static int
+ifcache_flush(lua_State *lua)
+{
+	cache *c;
+
+	if (lua_gettop(lua) != 1)
+		luaL_error(lua, "wrong number of arguments");
+	c = *(cache **)(luaL_checkudata(lua, 1, CACHE_META));
+
+	if (c != NULL)
+		cache_flush(c);
+
+	lua_pop(lua, 1);
+
+	return 0;
+}
+
+
+/*
+ * Lua implementation of the cache close function; also called when a cache
+ * is garbage collected.
+ */
+static int
+ifcache_close(lua_State *lua)
+{
+	cache **c;
+
+	if (lua_gettop(lua) != 1)
+		luaL_error(lua, "wrong number of arguments");
+	c = (cache **)(luaL_checkudata(lua, 1, CACHE_META));
+
+	if (*c != NULL) {
+		cache_close(*c);
+		*c = NULL;
+	}
+
+	lua_pop(lua, 1);
+
+	return 0;
+}
+
+
+/*
+ * Open imapfilter library of persistent cache functions.
+ */
+LUALIB_API int
+luaopen_ifcache(lua_State *lua)
+{
+
+	luaL_newmetatable(lua, CACHE_META);
+	lua_pushcfunction(lua, ifcache_close);
+	lua_setfield(lua, -2, "__gc");
+	lua_pop(lua, 1);
+
+#if LUA_VERSION_NUM < 502
+	luaL_register(lua, "ifcache", ifcachelib);
+#else
+	luaL_newlib(lua, ifcachelib);
+	lua_setglobal(lua, "ifcache");
+#endif
+
+	return 1;
+}
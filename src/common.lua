@@ -34,57 +34,52 @@ function _check_optional(arg, argtype)
 end
 
 
-function _extract_mailboxes(messages)
+function _extract_uids(messages)
+    if messages._type == 'set' then return messages._uidsets(messages) end
+
     local t = {}
     for _, v in ipairs(messages) do
-        b = table.unpack(v)
-        t[b] = true
+        local b, m = table.unpack(v)
+        if not t[b] then t[b] = {} end
+        table.insert(t[b], m)
     end
+    for b, u in pairs(t) do t[b] = ifset.new(u) end
     return t
 end
 
-function _extract_messages(mailbox, messages)
+function _extract_mailboxes(messages)
     local t = {}
-    for _, v in ipairs(messages) do
-        b, m = table.unpack(v)
-        if mailbox == b then table.insert(t, m) end
-    end
+    local q = messages._type == 'set' and rawget(messages, '_queries')
+    for b in pairs(q or _extract_uids(messages)) do t[b] = true end
     return t
 end
 
+function _extract_messages(mailbox, messages)
+    local u = _extract_uids(messages)[mailbox]
+    if u == nil then return {} end
+    return ifset.uids(u)
+end
+
 
 function _make_range(messages)
     for _, m in ipairs(messages) do
         if type(m) ~= 'number' then return messages end
     end
 
-    table.sort(messages)
+    return ifset.ranges(ifset.new(messages), options.range)
+end
 
-    local t = {}
-    local a, z
-    for _, m in ipairs(messages) do
-        if a == nil or z == nil then
-            a = m
-            z = m
-        else
-            if m == z + 1 and m - a <= options.range then
-                z = m
-            else
-                if a == z then
-                    table.insert(t, tostring(a))
-                else
-                    table.insert(t, a .. ':' .. z)
-                end
-                a = m
-                z = m
-            end
-        end
-    end
+function _make_chunks(messages)
+    local m = _make_range(messages)
+    local n = #m
+    local l = n
+    if options.limit > 0 then l = options.limit end
 
-    if a == z then
-        table.insert(t, tostring(a))
-    else
-        table.insert(t, a .. ':' .. z)
+    local t = {}
+    for i = 1, n, l do
+        local j = i + l - 1
+        if n < j then j = n end
+        table.insert(t, table.concat(m, ',', i, j))
     end
 
     return t
@@ -137,6 +132,18 @@ function _make_query(criteria, messages)
 end
 
 
+function _make_expression(query)
+    if type(query) == 'string' then return '(' .. query .. ')' end
+
+    if query[1] == 'not' then return 'NOT ' .. _make_expression(query[2]) end
+
+    local a = _make_expression(query[2])
+    local b = _make_expression(query[3])
+    if query[1] == 'or' then return 'OR ' .. a .. ' ' .. b end
+    return '(' .. a .. ' ' .. b .. ')'
+end
+
+
 function _parse_structure(b)
     local bs = _parse_body(b)
     if not bs then error(b.i .. ':' .. b.s) end
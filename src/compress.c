@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "imapfilter.h"
+#include "session.h"
+
+
+#define COMPRESS_BUF	16384	/* Size of the buffers of compressed data. */
+
+
+/* Compression layer of a connection, as negotiated with COMPRESS DEFLATE. */
+struct compress {
+	z_stream in;		/* Decompression of the received data. */
+	z_stream out;		/* Compression of the sent data. */
+	int pending;		/* Decompressed data may still be pending. */
+	unsigned char ibuf[COMPRESS_BUF];	/* Compressed data received. */
+	unsigned char obuf[COMPRESS_BUF];	/* Compressed data to send. */
+	unsigned long long inraw;	/* Bytes received from the server. */
+	unsigned long long indata;	/* Bytes after decompression. */
+	unsigned long long outraw;	/* Bytes sent to the server. */
+	unsigned long long outdata;	/* Bytes before compression. */
+};
+
+
+/*
+ * Start compressing the data of the connection, right after the server has
+ * accepted the COMPRESS DEFLATE command; raw deflate streams are used in both
+ * directions.
+ */
+int
+compress_start(session *ssn)
+{
+	struct compress *c;
+
+	c = (struct compress *)xmalloc(sizeof(struct compress));
+	memset(c, 0, sizeof(struct compress));
+
+	if (inflateInit2(&c->in, -15) != Z_OK) {
+		error("initializing decompression; %s\n", c->in.msg ?
+		    c->in.msg : "unknown error");
+		xfree(c);
+		return -1;
+	}
+	if (deflateInit2(&c->out, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK) {
+		error("initializing compression; %s\n", c->out.msg ?
+		    c->out.msg : "unknown error");
+		inflateEnd(&c->in);
+		xfree(c);
+		return -1;
+	}
+
+	ssn->compress = c;
+
+	return 0;
+}
+
+
+/*
+ * Stop compressing the data of the connection and report how much was saved.
+ */
+void
+compress_stop(session *ssn)
+{
+	struct compress *c;
+
+	if ((c = ssn->compress) == NULL)
+		return;
+
+	verbose("compression (%d): received %llu bytes as %llu, sent %llu "
+	    "bytes as %llu\n", ssn->socket, c->indata, c->inraw, c->outdata,
+	    c->outraw);
+
+	inflateEnd(&c->in);
+	deflateEnd(&c->out);
+	xfree(c);
+
+	ssn->compress = NULL;
+}
+
+
+/*
+ * Read compressed data from the connection and decompress them.  Data still
+ * held by the decompressor are returned first, without touching the socket.
+ * On failure the connection is closed, as with the socket functions.
+ */
+ssize_t
+compress_read(session *ssn, char *buf, size_t len, long timeout,
+    int timeoutfail, int *interrupt)
+{
+	int z;
+	ssize_t n;
+	struct compress *c;
+
+	c = ssn->compress;
+
+	for (;;) {
+		if (c->in.avail_in > 0 || c->pending) {
+			c->in.next_out = (unsigned char *)buf;
+			c->in.avail_out = len;
+
+			z = inflate(&c->in, Z_SYNC_FLUSH);
+			if (z != Z_OK && z != Z_BUF_ERROR) {
+				error("decompressing data; %s\n", c->in.msg ?
+				    c->in.msg : "stream error");
+				close_connection(ssn);
+				return -1;
+			}
+
+			c->pending = (c->in.avail_out == 0);
+
+			n = len - c->in.avail_out;
+			if (n > 0) {
+				c->indata += n;
+				buf[n] = '\0';
+				return n;
+			}
+		}
+
+		n = socket_transport_read(ssn, (char *)c->ibuf,
+		    sizeof(c->ibuf) - 1, timeout, timeoutfail, interrupt);
+		if (n <= 0)
+			return n;
+
+		c->inraw += n;
+		c->in.next_in = c->ibuf;
+		c->in.avail_in = n;
+	}
+}
+
+
+/*
+ * Compress data and write them to the connection, flushing the compressor so
+ * that the server gets the whole of the data at once.
+ */
+ssize_t
+compress_write(session *ssn, const char *buf, size_t len)
+{
+	size_t n;
+	struct compress *c;
+
+	c = ssn->compress;
+
+	c->out.next_in = (unsigned char *)buf;
+	c->out.avail_in = len;
+
+	do {
+		c->out.next_out = c->obuf;
+		c->out.avail_out = sizeof(c->obuf);
+
+		if (deflate(&c->out, Z_SYNC_FLUSH) == Z_STREAM_ERROR) {
+			error("compressing data; %s\n", c->out.msg ?
+			    c->out.msg : "stream error");
+			close_connection(ssn);
+			return -1;
+		}
+
+		n = sizeof(c->obuf) - c->out.avail_out;
+		if (n > 0) {
+			if (socket_transport_write(ssn, (char *)c->obuf, n) ==
+			    -1)
+				return -1;
+			c->outraw += n;
+		}
+	} while (c->out.avail_out == 0);
+
+	c->outdata += len;
+
+	return len;
+}
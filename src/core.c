@@ -1,4 +1,7 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -6,6 +9,20 @@
 
 #include "imapfilter.h"
 #include "session.h"
+#include "buffer.h"
+#include "fetch.h"
+#include "list.h"
+
+
+#define COROUTINES	"ifcore_coroutines"	/* Registry table of the
+						 * coroutines whose commands
+						 * are suspended. */
+#define OWNERS		"ifcore_owners"		/* Registry table of the
+						 * coroutines that suspended
+						 * a command of each session. */
+
+
+extern list *sessions;
 
 
 static int ifcore_noop(lua_State *lua);
@@ -13,9 +30,11 @@ static int ifcore_login(lua_State *lua);
 static int ifcore_logout(lua_State *lua);
 static int ifcore_status(lua_State *lua);
 static int ifcore_select(lua_State *lua);
+static int ifcore_changes(lua_State *lua);
 static int ifcore_close(lua_State *lua);
 static int ifcore_expunge(lua_State *lua);
 static int ifcore_search(lua_State *lua);
+static int ifcore_count(lua_State *lua);
 static int ifcore_list(lua_State *lua);
 static int ifcore_lsub(lua_State *lua);
 static int ifcore_fetchfast(lua_State *lua);
@@ -27,15 +46,40 @@ static int ifcore_fetchtext(lua_State *lua);
 static int ifcore_fetchfields(lua_State *lua);
 static int ifcore_fetchstructure(lua_State *lua);
 static int ifcore_fetchpart(lua_State *lua);
+static int ifcore_fetchstream(lua_State *lua);
+static int ifcore_transfer(lua_State *lua);
+static int ifcore_relay(lua_State *lua);
 static int ifcore_store(lua_State *lua);
 static int ifcore_copy(lua_State *lua);
+static int ifcore_move(lua_State *lua);
 static int ifcore_append(lua_State *lua);
+static int ifcore_multiappend(lua_State *lua);
 static int ifcore_create(lua_State *lua);
 static int ifcore_delete(lua_State *lua);
 static int ifcore_rename(lua_State *lua);
 static int ifcore_subscribe(lua_State *lua);
 static int ifcore_unsubscribe(lua_State *lua);
 static int ifcore_idle(lua_State *lua);
+static int ifcore_coroutine(lua_State *lua);
+static int ifcore_poll(lua_State *lua);
+static int ifcore_wait(lua_State *lua);
+
+static const char **get_mesgs(lua_State *lua, int index);
+static int write_function(void *arg, const char *data, size_t len);
+static int core_call(lua_State *lua);
+#if LUA_VERSION_NUM >= 503
+static int core_resume(lua_State *lua, int status, lua_KContext ctx);
+#endif
+static int suspend_coroutine(lua_State *lua);
+#if LUA_VERSION_NUM >= 503
+static lua_State *suspend_owner(lua_State *lua, session *s);
+#endif
+static void suspend_allow(lua_State *lua, session *s);
+static int suspend_function(lua_State *lua, session *s);
+static size_t relay_window(const relayitem *ri, size_t first, size_t n,
+    size_t budget, char *set, size_t size);
+static void push_changes(lua_State *lua, unsigned long long modseq,
+    const char *vanished, fetchlist *fl);
 
 
 /* Lua imapfilter core library functions. */
@@ -44,6 +88,7 @@ static const luaL_Reg ifcorelib[] = {
 	{ "logout", ifcore_logout },
 	{ "login", ifcore_login },
 	{ "select", ifcore_select },
+	{ "changes", ifcore_changes },
 	{ "create", ifcore_create },
 	{ "delete", ifcore_delete },
 	{ "rename", ifcore_rename },
@@ -53,9 +98,11 @@ static const luaL_Reg ifcorelib[] = {
 	{ "lsub", ifcore_lsub },
 	{ "status", ifcore_status },
 	{ "append", ifcore_append },
+	{ "multiappend", ifcore_multiappend },
 	{ "close", ifcore_close },
 	{ "expunge", ifcore_expunge },
 	{ "search", ifcore_search },
+	{ "count", ifcore_count },
 	{ "fetchfast", ifcore_fetchfast },
 	{ "fetchflags", ifcore_fetchflags },
 	{ "fetchdate", ifcore_fetchdate },
@@ -74,9 +121,16 @@ static const luaL_Reg ifcorelib[] = {
 	{ "fetchfields", ifcore_fetchfields },
 	{ "fetchstructure", ifcore_fetchstructure },
 	{ "fetchpart", ifcore_fetchpart },
+	{ "fetchstream", ifcore_fetchstream },
+	{ "transfer", ifcore_transfer },
+	{ "relay", ifcore_relay },
 	{ "store", ifcore_store },
 	{ "copy", ifcore_copy },
+	{ "move", ifcore_move },
 	{ "idle", ifcore_idle },
+	{ "coroutine", ifcore_coroutine },
+	{ "poll", ifcore_poll },
+	{ "wait", ifcore_wait },
 	{ NULL, NULL }
 };
 
@@ -185,6 +239,7 @@ ifcore_status(lua_State *lua)
 {
 	int r;
 	unsigned int exists, recent, unseen, uidnext;
+	session *s;
 
 	exists = recent = unseen = uidnext = -1;
 
@@ -193,8 +248,13 @@ ifcore_status(lua_State *lua)
 	luaL_checktype(lua, 1, LUA_TLIGHTUSERDATA);
 	luaL_checktype(lua, 2, LUA_TSTRING);
 
-	r = request_status((session *)(lua_topointer(lua, 1)),
-	    lua_tostring(lua, 2), &exists, &recent, &unseen, &uidnext);
+	s = (session *)(lua_topointer(lua, 1));
+	suspend_allow(lua, s);
+
+	r = request_status(s, lua_tostring(lua, 2), &exists, &recent, &unseen,
+	    &uidnext);
+	if (r == STATUS_SUSPEND)
+		return suspend_function(lua, s);
 
 	lua_pop(lua, 2);
 
@@ -216,26 +276,115 @@ ifcore_status(lua_State *lua)
  */
 static int
 ifcore_select(lua_State *lua)
+{
+	int r, n;
+	unsigned int v;
+	unsigned long long m;
+	const char *k;
+	char *d;
+	session *s;
+	fetchlist fl;
+
+	n = lua_gettop(lua);
+	if (n != 2 && n != 5)
+		luaL_error(lua, "wrong number of arguments");
+	luaL_checktype(lua, 1, LUA_TLIGHTUSERDATA);
+	luaL_checktype(lua, 2, LUA_TSTRING);
+
+	v = 0;
+	m = 0;
+	k = NULL;
+	if (n == 5) {
+		luaL_checktype(lua, 3, LUA_TNUMBER);
+		luaL_checktype(lua, 4, LUA_TSTRING);
+		luaL_checktype(lua, 5, LUA_TSTRING);
+		v = (unsigned int)(lua_tonumber(lua, 3));
+		m = strtoull(lua_tostring(lua, 4), NULL, 10);
+		k = lua_tostring(lua, 5);
+	}
+
+	s = (session *)(lua_topointer(lua, 1));
+	d = NULL;
+	fetchlist_init(&fl);
+	suspend_allow(lua, s);
+
+	r = request_select(s, lua_tostring(lua, 2), &v, &m, k, &d, &fl);
+	if (r == STATUS_SUSPEND) {
+		fetchlist_free(&fl);
+		return suspend_function(lua, s);
+	}
+
+	lua_pop(lua, n);
+
+	if (r < 0) {
+		if (d != NULL)
+			xfree(d);
+		fetchlist_free(&fl);
+		return 0;
+	}
+
+	lua_pushboolean(lua, (r == STATUS_OK || r == STATUS_READONLY));
+	lua_pushboolean(lua, (r == STATUS_READONLY));
+	lua_pushnumber(lua, (lua_Number) (v));
+
+	if (!s->qresync || m == 0) {
+		if (d != NULL)
+			xfree(d);
+		fetchlist_free(&fl);
+		return 3;
+	}
+
+	push_changes(lua, m, d, &fl);
+
+	if (d != NULL)
+		xfree(d);
+	fetchlist_free(&fl);
+
+	return 6;
+}
+
+
+/*
+ * Core function to get the changes in the selected mailbox since the
+ * specified modification sequence.
+ */
+static int
+ifcore_changes(lua_State *lua)
 {
 	int r;
+	unsigned long long m;
+	char *d;
+	fetchlist fl;
 
 	if (lua_gettop(lua) != 2)
 		luaL_error(lua, "wrong number of arguments");
 	luaL_checktype(lua, 1, LUA_TLIGHTUSERDATA);
 	luaL_checktype(lua, 2, LUA_TSTRING);
 
-	r = request_select((session *)(lua_topointer(lua, 1)),
-	    lua_tostring(lua, 2));
+	m = strtoull(lua_tostring(lua, 2), NULL, 10);
+	d = NULL;
+	fetchlist_init(&fl);
+
+	r = request_changes((session *)(lua_topointer(lua, 1)), &m, &d, &fl);
 
 	lua_pop(lua, 2);
 
-	if (r < 0)
+	if (r < 0) {
+		if (d != NULL)
+			xfree(d);
+		fetchlist_free(&fl);
 		return 0;
+	}
 
-	lua_pushboolean(lua, (r == STATUS_OK || r == STATUS_READONLY));
-	lua_pushboolean(lua, (r == STATUS_READONLY));
+	lua_pushboolean(lua, (r == STATUS_OK));
 
-	return 2;
+	push_changes(lua, m, d, &fl);
+
+	if (d != NULL)
+		xfree(d);
+	fetchlist_free(&fl);
+
+	return 4;
 }
 
 
@@ -376,6 +525,7 @@ ifcore_search(lua_State *lua)
 {
 	int r;
 	char *mesgs;
+	session *s;
 
 	mesgs = NULL;
 
@@ -385,8 +535,13 @@ ifcore_search(lua_State *lua)
 	luaL_checktype(lua, 2, LUA_TSTRING);
 	luaL_checktype(lua, 3, LUA_TSTRING);
 
-	r = request_search((session *)(lua_topointer(lua, 1)),
-	    lua_tostring(lua, 2), lua_tostring(lua, 3), &mesgs);
+	s = (session *)(lua_topointer(lua, 1));
+	suspend_allow(lua, s);
+
+	r = request_search(s, lua_tostring(lua, 2), lua_tostring(lua, 3),
+	    &mesgs);
+	if (r == STATUS_SUSPEND)
+		return suspend_function(lua, s);
 
 	lua_pop(lua, 3);
 
@@ -406,6 +561,52 @@ ifcore_search(lua_State *lua)
 }
 
 
+/*
+ * Core function to count the messages that match the search criteria, and find
+ * the lowest and highest of their UIDs.
+ */
+static int
+ifcore_count(lua_State *lua)
+{
+	int r;
+	unsigned long count, min, max;
+	session *s;
+
+	if (lua_gettop(lua) != 3)
+		luaL_error(lua, "wrong number of arguments");
+	luaL_checktype(lua, 1, LUA_TLIGHTUSERDATA);
+	luaL_checktype(lua, 2, LUA_TSTRING);
+	luaL_checktype(lua, 3, LUA_TSTRING);
+
+	s = (session *)(lua_topointer(lua, 1));
+	suspend_allow(lua, s);
+
+	r = request_searchcount(s, lua_tostring(lua, 2), lua_tostring(lua, 3),
+	    &count, &min, &max);
+	if (r == STATUS_SUSPEND)
+		return suspend_function(lua, s);
+
+	lua_pop(lua, 3);
+
+	if (r < 0)
+		return 0;
+
+	lua_pushboolean(lua, (r == STATUS_OK));
+
+	if (r != STATUS_OK)
+		return 1;
+
+	lua_pushinteger(lua, (lua_Integer)(count));
+	if (count == 0)
+		return 2;
+
+	lua_pushinteger(lua, (lua_Integer)(min));
+	lua_pushinteger(lua, (lua_Integer)(max));
+
+	return 4;
+}
+
+
 /*
  * Core function to fetch message information (flags, date, size).
  */
@@ -413,35 +614,54 @@ static int
 ifcore_fetchfast(lua_State *lua)
 {
 	int r;
-	char *flags, *date, *size;
+	size_t i;
+	fetchlist fl;
+	session *s;
 
-	flags = date = size = NULL;
+	fetchlist_init(&fl);
 
 	if (lua_gettop(lua) != 2)
 		luaL_error(lua, "wrong number of arguments");
 	luaL_checktype(lua, 1, LUA_TLIGHTUSERDATA);
 	luaL_checktype(lua, 2, LUA_TSTRING);
 
-	r = request_fetchfast((session *)(lua_topointer(lua, 1)),
-	    lua_tostring(lua, 2), &flags, &date, &size);
+	s = (session *)(lua_topointer(lua, 1));
+	suspend_allow(lua, s);
+
+	r = request_fetchfast(s, lua_tostring(lua, 2), &fl);
+	if (r == STATUS_SUSPEND) {
+		fetchlist_free(&fl);
+		return suspend_function(lua, s);
+	}
 
 	lua_pop(lua, 2);
 
-	if (r < 0)
+	if (r < 0) {
+		fetchlist_free(&fl);
 		return 0;
+	}
 
 	lua_pushboolean(lua, (r == STATUS_OK));
 
-	if (!flags || !date || !size)
+	if (!fl.len)
 		return 1;
 
-	lua_pushstring(lua, flags);
-	lua_pushstring(lua, date);
-	lua_pushstring(lua, size);
+	lua_newtable(lua);
+	lua_newtable(lua);
+	lua_newtable(lua);
+	for (i = 0; i < fl.len; i++) {
+		if (!fl.items[i].flags || !fl.items[i].date ||
+		    !fl.items[i].size)
+			continue;
+		lua_pushlstring(lua, fl.items[i].flags, fl.items[i].flagslen);
+		lua_rawseti(lua, -4, fl.items[i].uid);
+		lua_pushlstring(lua, fl.items[i].date, fl.items[i].datelen);
+		lua_rawseti(lua, -3, fl.items[i].uid);
+		lua_pushlstring(lua, fl.items[i].size, fl.items[i].sizelen);
+		lua_rawseti(lua, -2, fl.items[i].uid);
+	}
 
-	xfree(flags);
-	xfree(date);
-	xfree(size);
+	fetchlist_free(&fl);
 
 	return 4;
 }
@@ -454,31 +674,47 @@ static int
 ifcore_fetchflags(lua_State *lua)
 {
 	int r;
-	char *flags;
+	size_t i;
+	fetchlist fl;
+	session *s;
 
-	flags = NULL;
+	fetchlist_init(&fl);
 
 	if (lua_gettop(lua) != 2)
 		luaL_error(lua, "wrong number of arguments");
 	luaL_checktype(lua, 1, LUA_TLIGHTUSERDATA);
 	luaL_checktype(lua, 2, LUA_TSTRING);
 
-	r = request_fetchflags((session *)(lua_topointer(lua, 1)),
-	    lua_tostring(lua, 2), &flags);
+	s = (session *)(lua_topointer(lua, 1));
+	suspend_allow(lua, s);
+
+	r = request_fetchflags(s, lua_tostring(lua, 2), &fl);
+	if (r == STATUS_SUSPEND) {
+		fetchlist_free(&fl);
+		return suspend_function(lua, s);
+	}
 
 	lua_pop(lua, 2);
 
-	if (r < 0)
+	if (r < 0) {
+		fetchlist_free(&fl);
 		return 0;
+	}
 
 	lua_pushboolean(lua, (r == STATUS_OK));
 
-	if (!flags)
+	if (!fl.len)
 		return 1;
 
-	lua_pushstring(lua, flags);
+	lua_newtable(lua);
+	for (i = 0; i < fl.len; i++) {
+		if (!fl.items[i].flags)
+			continue;
+		lua_pushlstring(lua, fl.items[i].flags, fl.items[i].flagslen);
+		lua_rawseti(lua, -2, fl.items[i].uid);
+	}
 
-	xfree(flags);
+	fetchlist_free(&fl);
 
 	return 2;
 }
@@ -491,31 +727,47 @@ static int
 ifcore_fetchdate(lua_State *lua)
 {
 	int r;
-	char *date;
+	size_t i;
+	fetchlist fl;
+	session *s;
 
-	date = NULL;
+	fetchlist_init(&fl);
 
 	if (lua_gettop(lua) != 2)
 		luaL_error(lua, "wrong number of arguments");
 	luaL_checktype(lua, 1, LUA_TLIGHTUSERDATA);
 	luaL_checktype(lua, 2, LUA_TSTRING);
 
-	r = request_fetchdate((session *)(lua_topointer(lua, 1)),
-	    lua_tostring(lua, 2), &date);
+	s = (session *)(lua_topointer(lua, 1));
+	suspend_allow(lua, s);
+
+	r = request_fetchdate(s, lua_tostring(lua, 2), &fl);
+	if (r == STATUS_SUSPEND) {
+		fetchlist_free(&fl);
+		return suspend_function(lua, s);
+	}
 
 	lua_pop(lua, 2);
 
-	if (r < 0)
+	if (r < 0) {
+		fetchlist_free(&fl);
 		return 0;
+	}
 
 	lua_pushboolean(lua, (r == STATUS_OK));
 
-	if (!date)
+	if (!fl.len)
 		return 1;
 
-	lua_pushstring(lua, date);
+	lua_newtable(lua);
+	for (i = 0; i < fl.len; i++) {
+		if (!fl.items[i].date)
+			continue;
+		lua_pushlstring(lua, fl.items[i].date, fl.items[i].datelen);
+		lua_rawseti(lua, -2, fl.items[i].uid);
+	}
 
-	xfree(date);
+	fetchlist_free(&fl);
 
 	return 2;
 }
@@ -528,31 +780,47 @@ static int
 ifcore_fetchsize(lua_State *lua)
 {
 	int r;
-	char *size;
+	size_t i;
+	fetchlist fl;
+	session *s;
 
-	size = NULL;
+	fetchlist_init(&fl);
 
 	if (lua_gettop(lua) != 2)
 		luaL_error(lua, "wrong number of arguments");
 	luaL_checktype(lua, 1, LUA_TLIGHTUSERDATA);
 	luaL_checktype(lua, 2, LUA_TSTRING);
 
-	r = request_fetchsize((session *)(lua_topointer(lua, 1)),
-	    lua_tostring(lua, 2), &size);
+	s = (session *)(lua_topointer(lua, 1));
+	suspend_allow(lua, s);
+
+	r = request_fetchsize(s, lua_tostring(lua, 2), &fl);
+	if (r == STATUS_SUSPEND) {
+		fetchlist_free(&fl);
+		return suspend_function(lua, s);
+	}
 
 	lua_pop(lua, 2);
 
-	if (r < 0)
+	if (r < 0) {
+		fetchlist_free(&fl);
 		return 0;
+	}
 
 	lua_pushboolean(lua, (r == STATUS_OK));
 
-	if (!size)
+	if (!fl.len)
 		return 1;
 
-	lua_pushstring(lua, size);
+	lua_newtable(lua);
+	for (i = 0; i < fl.len; i++) {
+		if (!fl.items[i].size)
+			continue;
+		lua_pushlstring(lua, fl.items[i].size, fl.items[i].sizelen);
+		lua_rawseti(lua, -2, fl.items[i].uid);
+	}
 
-	xfree(size);
+	fetchlist_free(&fl);
 
 	return 2;
 }
@@ -565,29 +833,48 @@ static int
 ifcore_fetchstructure(lua_State *lua)
 {
 	int r;
-	char *structure;
+	size_t i;
+	fetchlist fl;
+	session *s;
 
-	structure = NULL;
+	fetchlist_init(&fl);
 
 	if (lua_gettop(lua) != 2)
 		luaL_error(lua, "wrong number of arguments");
 	luaL_checktype(lua, 1, LUA_TLIGHTUSERDATA);
 	luaL_checktype(lua, 2, LUA_TSTRING);
 
-	r = request_fetchstructure((session *)(lua_topointer(lua, 1)),
-	    lua_tostring(lua, 2), &structure);
+	s = (session *)(lua_topointer(lua, 1));
+	suspend_allow(lua, s);
 
-	lua_pop(lua, 3);
+	r = request_fetchstructure(s, lua_tostring(lua, 2), &fl);
+	if (r == STATUS_SUSPEND) {
+		fetchlist_free(&fl);
+		return suspend_function(lua, s);
+	}
 
-	if (r < 0)
+	lua_pop(lua, 2);
+
+	if (r < 0) {
+		fetchlist_free(&fl);
 		return 0;
+	}
 
 	lua_pushboolean(lua, (r == STATUS_OK));
 
-	if (!structure)
+	if (!fl.len)
 		return 1;
 
-	lua_pushstring(lua, structure);
+	lua_newtable(lua);
+	for (i = 0; i < fl.len; i++) {
+		if (!fl.items[i].structure)
+			continue;
+		lua_pushlstring(lua, fl.items[i].structure,
+		    fl.items[i].structurelen);
+		lua_rawseti(lua, -2, fl.items[i].uid);
+	}
+
+	fetchlist_free(&fl);
 
 	return 2;
 }
@@ -600,31 +887,47 @@ static int
 ifcore_fetchheader(lua_State *lua)
 {
 	int r;
-	char *header;
-	size_t len;
+	size_t i;
+	fetchlist fl;
+	session *s;
 
-	header = NULL;
-	len = 0;
+	fetchlist_init(&fl);
 
 	if (lua_gettop(lua) != 2)
 		luaL_error(lua, "wrong number of arguments");
 	luaL_checktype(lua, 1, LUA_TLIGHTUSERDATA);
 	luaL_checktype(lua, 2, LUA_TSTRING);
 
-	r = request_fetchheader((session *)(lua_topointer(lua, 1)),
-	    lua_tostring(lua, 2), &header, &len);
+	s = (session *)(lua_topointer(lua, 1));
+	suspend_allow(lua, s);
+
+	r = request_fetchheader(s, lua_tostring(lua, 2), &fl);
+	if (r == STATUS_SUSPEND) {
+		fetchlist_free(&fl);
+		return suspend_function(lua, s);
+	}
 
 	lua_pop(lua, 2);
 
-	if (r < 0)
+	if (r < 0) {
+		fetchlist_free(&fl);
 		return 0;
+	}
 
 	lua_pushboolean(lua, (r == STATUS_OK));
 
-	if (!header)
+	if (!fl.len)
 		return 1;
 
-	lua_pushlstring(lua, header, len);
+	lua_newtable(lua);
+	for (i = 0; i < fl.len; i++) {
+		if (!fl.items[i].body)
+			continue;
+		lua_pushlstring(lua, fl.items[i].body, fl.items[i].bodylen);
+		lua_rawseti(lua, -2, fl.items[i].uid);
+	}
+
+	fetchlist_free(&fl);
 
 	return 2;
 }
@@ -637,31 +940,47 @@ static int
 ifcore_fetchtext(lua_State *lua)
 {
 	int r;
-	char *text;
-	size_t len;
+	size_t i;
+	fetchlist fl;
+	session *s;
 
-	text = NULL;
-	len = 0;
+	fetchlist_init(&fl);
 
 	if (lua_gettop(lua) != 2)
 		luaL_error(lua, "wrong number of arguments");
 	luaL_checktype(lua, 1, LUA_TLIGHTUSERDATA);
 	luaL_checktype(lua, 2, LUA_TSTRING);
 
-	r = request_fetchtext((session *)(lua_topointer(lua, 1)),
-	    lua_tostring(lua, 2), &text, &len);
+	s = (session *)(lua_topointer(lua, 1));
+	suspend_allow(lua, s);
+
+	r = request_fetchtext(s, lua_tostring(lua, 2), &fl);
+	if (r == STATUS_SUSPEND) {
+		fetchlist_free(&fl);
+		return suspend_function(lua, s);
+	}
 
 	lua_pop(lua, 2);
 
-	if (r < 0)
+	if (r < 0) {
+		fetchlist_free(&fl);
 		return 0;
+	}
 
 	lua_pushboolean(lua, (r == STATUS_OK));
 
-	if (!text)
+	if (!fl.len)
 		return 1;
 
-	lua_pushlstring(lua, text, len);
+	lua_newtable(lua);
+	for (i = 0; i < fl.len; i++) {
+		if (!fl.items[i].body)
+			continue;
+		lua_pushlstring(lua, fl.items[i].body, fl.items[i].bodylen);
+		lua_rawseti(lua, -2, fl.items[i].uid);
+	}
+
+	fetchlist_free(&fl);
 
 	return 2;
 }
@@ -674,11 +993,11 @@ static int
 ifcore_fetchfields(lua_State *lua)
 {
 	int r;
-	char *fields;
-	size_t len;
+	size_t i;
+	fetchlist fl;
+	session *s;
 
-	fields = NULL;
-	len = 0;
+	fetchlist_init(&fl);
 
 	if (lua_gettop(lua) != 3)
 		luaL_error(lua, "wrong number of arguments");
@@ -686,20 +1005,37 @@ ifcore_fetchfields(lua_State *lua)
 	luaL_checktype(lua, 2, LUA_TSTRING);
 	luaL_checktype(lua, 3, LUA_TSTRING);
 
-	r = request_fetchfields((session *)(lua_topointer(lua, 1)),
-	    lua_tostring(lua, 2), lua_tostring(lua, 3), &fields, &len);
+	s = (session *)(lua_topointer(lua, 1));
+	suspend_allow(lua, s);
+
+	r = request_fetchfields(s, lua_tostring(lua, 2), lua_tostring(lua, 3),
+	    &fl);
+	if (r == STATUS_SUSPEND) {
+		fetchlist_free(&fl);
+		return suspend_function(lua, s);
+	}
 
 	lua_pop(lua, 3);
 
-	if (r < 0)
+	if (r < 0) {
+		fetchlist_free(&fl);
 		return 0;
+	}
 
 	lua_pushboolean(lua, (r == STATUS_OK));
 
-	if (!fields)
+	if (!fl.len)
 		return 1;
 
-	lua_pushlstring(lua, fields, len);
+	lua_newtable(lua);
+	for (i = 0; i < fl.len; i++) {
+		if (!fl.items[i].body)
+			continue;
+		lua_pushlstring(lua, fl.items[i].body, fl.items[i].bodylen);
+		lua_rawseti(lua, -2, fl.items[i].uid);
+	}
+
+	fetchlist_free(&fl);
 
 	return 2;
 }
@@ -712,11 +1048,10 @@ static int
 ifcore_fetchpart(lua_State *lua)
 {
 	int r;
-	char *part;
-	size_t len;
+	fetchlist fl;
+	session *s;
 
-	part = NULL;
-	len = 0;
+	fetchlist_init(&fl);
 
 	if (lua_gettop(lua) != 3)
 		luaL_error(lua, "wrong number of arguments");
@@ -724,25 +1059,395 @@ ifcore_fetchpart(lua_State *lua)
 	luaL_checktype(lua, 2, LUA_TSTRING);
 	luaL_checktype(lua, 3, LUA_TSTRING);
 
-	r = request_fetchpart((session *)(lua_topointer(lua, 1)),
-	    lua_tostring(lua, 2), lua_tostring(lua, 3), &part, &len);
+	s = (session *)(lua_topointer(lua, 1));
+	suspend_allow(lua, s);
+
+	r = request_fetchpart(s, lua_tostring(lua, 2), lua_tostring(lua, 3),
+	    &fl);
+	if (r == STATUS_SUSPEND) {
+		fetchlist_free(&fl);
+		return suspend_function(lua, s);
+	}
 
 	lua_pop(lua, 3);
 
+	if (r < 0) {
+		fetchlist_free(&fl);
+		return 0;
+	}
+
+	lua_pushboolean(lua, (r == STATUS_OK));
+
+	if (!fl.len || !fl.items[0].body) {
+		fetchlist_free(&fl);
+		return 1;
+	}
+
+	lua_pushlstring(lua, fl.items[0].body, fl.items[0].bodylen);
+
+	fetchlist_free(&fl);
+
+	return 2;
+}
+
+
+/*
+ * Core function to fetch message specific part, and write it to a file, an
+ * open file handle or a function, as it is received.
+ */
+static int
+ifcore_fetchstream(lua_State *lua)
+{
+	int r;
+	FILE *fp;
+	fetchlist fl;
+	fetchsink sk;
+
+	if (lua_gettop(lua) != 4)
+		luaL_error(lua, "wrong number of arguments");
+	luaL_checktype(lua, 1, LUA_TLIGHTUSERDATA);
+	luaL_checktype(lua, 2, LUA_TSTRING);
+	luaL_checktype(lua, 3, LUA_TSTRING);
+
+	fp = NULL;
+	if (lua_type(lua, 4) == LUA_TFUNCTION)
+		fetchsink_init(&sk, write_function, lua);
+	else if (lua_type(lua, 4) == LUA_TSTRING) {
+		if ((fp = fopen(lua_tostring(lua, 4), "w")) == NULL)
+			luaL_error(lua, "cannot open file %s",
+			    lua_tostring(lua, 4));
+		fetchsink_init(&sk, fetchsink_file, fp);
+	} else {
+		FILE **f = (FILE **)(luaL_checkudata(lua, 4, LUA_FILEHANDLE));
+
+		if (*f == NULL)
+			luaL_error(lua, "attempt to use a closed file");
+		fetchsink_init(&sk, fetchsink_file, *f);
+	}
+
+	fetchlist_init(&fl);
+	fl.sink = &sk;
+
+	r = request_fetchpart((session *)(lua_topointer(lua, 1)),
+	    lua_tostring(lua, 2), lua_tostring(lua, 3), &fl);
+
+	if (r >= 0 && sk.len == 0 && fl.len && fl.items[0].body &&
+	    fl.items[0].bodylen > 0 && !sk.error) {
+		if (sk.write(sk.arg, fl.items[0].body, fl.items[0].bodylen) ==
+		    -1)
+			sk.error = 1;
+		sk.len = fl.items[0].bodylen;
+	}
+	fetchlist_free(&fl);
+
+	if (fp != NULL && fclose(fp) == EOF)
+		sk.error = 1;
+
+	if (sk.error) {
+		if (lua_type(lua, 4) == LUA_TFUNCTION)
+			lua_error(lua);
+		luaL_error(lua, "writing of fetched data failed");
+	}
+
+	lua_pop(lua, 4);
+
 	if (r < 0)
 		return 0;
 
 	lua_pushboolean(lua, (r == STATUS_OK));
+	lua_pushnumber(lua, (lua_Number) (sk.len));
 
-	if (!part)
+	return 2;
+}
+
+
+/*
+ * Core function to copy a message from a mailbox to a mailbox of another
+ * account, keeping the message in a temporary file instead of memory.
+ */
+static int
+ifcore_transfer(lua_State *lua)
+{
+	int r;
+	FILE *fp;
+	fetchlist fl;
+	fetchsink sk;
+
+	if (lua_gettop(lua) != 6)
+		luaL_error(lua, "wrong number of arguments");
+	luaL_checktype(lua, 1, LUA_TLIGHTUSERDATA);
+	luaL_checktype(lua, 2, LUA_TSTRING);
+	luaL_checktype(lua, 3, LUA_TLIGHTUSERDATA);
+	luaL_checktype(lua, 4, LUA_TSTRING);
+	if (lua_type(lua, 5) != LUA_TNIL)
+		luaL_checktype(lua, 5, LUA_TSTRING);
+	if (lua_type(lua, 6) != LUA_TNIL)
+		luaL_checktype(lua, 6, LUA_TSTRING);
+
+	if ((fp = tmpfile()) == NULL)
+		luaL_error(lua, "cannot create temporary file");
+
+	fetchsink_init(&sk, fetchsink_file, fp);
+	fetchlist_init(&fl);
+	fl.sink = &sk;
+
+	r = request_fetchpart((session *)(lua_topointer(lua, 1)),
+	    lua_tostring(lua, 2), "", &fl);
+
+	if (r >= 0 && sk.len == 0 && fl.len && fl.items[0].body &&
+	    fl.items[0].bodylen > 0 && !sk.error) {
+		if (sk.write(sk.arg, fl.items[0].body, fl.items[0].bodylen) ==
+		    -1)
+			sk.error = 1;
+		sk.len = fl.items[0].bodylen;
+	}
+	fetchlist_free(&fl);
+
+	if (sk.error || fflush(fp) == EOF) {
+		fclose(fp);
+		luaL_error(lua, "writing to temporary file failed");
+	}
+
+	if (r != STATUS_OK) {
+		fclose(fp);
+		lua_pop(lua, 6);
+		if (r < 0)
+			return 0;
+		lua_pushboolean(lua, (r == STATUS_OK));
 		return 1;
+	}
 
-	lua_pushlstring(lua, part, len);
+	r = request_append_file((session *)(lua_topointer(lua, 3)),
+	    lua_tostring(lua, 4), NULL, fp, sk.len,
+	    lua_type(lua, 5) == LUA_TSTRING ? lua_tostring(lua, 5) : NULL,
+	    lua_type(lua, 6) == LUA_TSTRING ? lua_tostring(lua, 6) : NULL);
+
+	fclose(fp);
+
+	lua_pop(lua, 6);
+
+	lua_pushboolean(lua, 1);
+	if (r < 0)
+		lua_pushnil(lua);
+	else
+		lua_pushboolean(lua, (r == STATUS_OK));
 
 	return 2;
 }
 
 
+/*
+ * Find where the window of messages that starts at the first one ends, so
+ * that the messages fit in the budget, and build the UID set of the window,
+ * collapsing consecutive UIDs to ranges and ending the window early if the
+ * set grows too long.
+ */
+static size_t
+relay_window(const relayitem *ri, size_t first, size_t n, size_t budget,
+    char *set, size_t size)
+{
+	size_t i, j, len, total;
+
+	len = total = 0;
+	set[0] = '\0';
+	for (i = first; i < n; i = j + 1) {
+		if (len + 2 * 11 + 2 >= size)
+			break;
+		if (i > first && total + ri[i].size > budget)
+			break;
+
+		total += ri[i].size;
+		for (j = i; j + 1 < n && ri[j + 1].uid == ri[j].uid + 1 &&
+		    total + ri[j + 1].size <= budget; j++)
+			total += ri[j + 1].size;
+
+		if (j == i)
+			len += snprintf(set + len, size - len, "%s%u",
+			    len ? "," : "", ri[i].uid);
+		else
+			len += snprintf(set + len, size - len, "%s%u:%u",
+			    len ? "," : "", ri[i].uid, ri[j].uid);
+	}
+
+	return i;
+}
+
+
+/*
+ * Core function to copy messages between two accounts, by fetching them from
+ * the source and appending them to the destination.  The messages are relayed
+ * in windows that fit in the specified number of bytes; while one window is
+ * appended, the next one is already being fetched, and the data of the
+ * messages never leave the C side.  Each message is given as a table of its
+ * UID, its size, and its flags and date, which may be nil, sorted by UID.
+ */
+static int
+ifcore_relay(lua_State *lua)
+{
+	int rs, rd, t;
+	char set[1024];
+	size_t i, j, k, n, w, first, last, next, budget, size, count, bytes;
+	relayitem *ri;
+	appenditem *a;
+	fetchlist fl;
+	buffer rb;
+	session *src, *dst;
+	struct timespec start, end;
+
+	if (lua_gettop(lua) != 5)
+		luaL_error(lua, "wrong number of arguments");
+	luaL_checktype(lua, 1, LUA_TLIGHTUSERDATA);
+	luaL_checktype(lua, 2, LUA_TLIGHTUSERDATA);
+	luaL_checktype(lua, 3, LUA_TSTRING);
+	luaL_checktype(lua, 4, LUA_TTABLE);
+	luaL_checktype(lua, 5, LUA_TNUMBER);
+
+	src = (session *)(lua_topointer(lua, 1));
+	dst = (session *)(lua_topointer(lua, 2));
+	budget = (lua_tonumber(lua, 5) > 0 ? (size_t)lua_tonumber(lua, 5) : 0);
+
+#if LUA_VERSION_NUM < 502
+	n = lua_objlen(lua, 4);
+#else
+	n = lua_rawlen(lua, 4);
+#endif
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(lua, 4, i + 1);
+		if (lua_type(lua, -1) != LUA_TTABLE)
+			luaL_error(lua, "message %d is not a table", (int)(i + 1));
+		lua_rawgeti(lua, -1, 1);
+		lua_rawgeti(lua, -2, 2);
+		if (lua_type(lua, -2) != LUA_TNUMBER ||
+		    lua_type(lua, -1) != LUA_TNUMBER)
+			luaL_error(lua, "message %d has no UID or size",
+			    (int)(i + 1));
+		lua_pop(lua, 3);
+	}
+
+	ri = (relayitem *)xmalloc((n + 1) * sizeof(relayitem));
+	a = (appenditem *)xmalloc((n + 1) * sizeof(appenditem));
+
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(lua, 4, i + 1);
+
+		lua_rawgeti(lua, -1, 1);
+		ri[i].uid = (unsigned int)lua_tonumber(lua, -1);
+		lua_pop(lua, 1);
+
+		lua_rawgeti(lua, -1, 2);
+		ri[i].size = (size_t)lua_tonumber(lua, -1);
+		lua_pop(lua, 1);
+
+		lua_rawgeti(lua, -1, 3);
+		ri[i].flags = (lua_type(lua, -1) == LUA_TSTRING ?
+		    lua_tostring(lua, -1) : NULL);
+		lua_pop(lua, 1);
+
+		lua_rawgeti(lua, -1, 4);
+		ri[i].date = (lua_type(lua, -1) == LUA_TSTRING ?
+		    lua_tostring(lua, -1) : NULL);
+		lua_pop(lua, 2);
+	}
+
+	buffer_init(&rb, INPUT_BUF);
+	fetchlist_init(&fl);
+
+	rs = rd = STATUS_OK;
+	count = bytes = 0;
+	last = 0;
+	t = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (n > 0) {
+		last = relay_window(ri, 0, n, budget, set, sizeof(set));
+		if ((t = request_fetchahead(src, set)) < 0)
+			rs = t;
+	}
+
+	for (first = 0; t >= 0; first = last, last = next) {
+		rs = request_fetchcollect(src, t, &fl);
+		t = -1;
+		if (rs != STATUS_OK)
+			break;
+
+		/* Copy the messages out of the input buffer. */
+		size = 0;
+		for (i = 0; i < fl.len; i++)
+			if (fl.items[i].body)
+				size += fl.items[i].bodylen;
+		buffer_reset(&rb);
+		buffer_check(&rb, size + 1);
+
+		w = 0;
+		for (i = first, k = 0; i < last; i++) {
+			for (j = 0; j < fl.len; j++, k = (k + 1) % fl.len)
+				if (fl.items[k].uid == ri[i].uid)
+					break;
+			if (j == fl.len || !fl.items[k].body)
+				continue;
+
+			a[w].mesg = rb.data + rb.len;
+			a[w].len = fl.items[k].bodylen;
+			a[w].flags = ri[i].flags;
+			a[w].date = ri[i].date;
+			memcpy(rb.data + rb.len, fl.items[k].body,
+			    fl.items[k].bodylen);
+			rb.len += fl.items[k].bodylen;
+			w++;
+		}
+		fetchlist_free(&fl);
+		fetchlist_init(&fl);
+
+		/* Fetch the next window while this one is appended. */
+		next = n;
+		if (last < n) {
+			next = relay_window(ri, last, n, budget, set,
+			    sizeof(set));
+			if ((t = request_fetchahead(src, set)) < 0) {
+				rs = t;
+				break;
+			}
+		}
+
+		if (w > 0 && (rd = request_multiappend(dst,
+		    lua_tostring(lua, 3), a, w)) != STATUS_OK)
+			break;
+
+		count += w;
+		bytes += rb.len;
+	}
+
+	/* Collect the fetch that was sent ahead of a failed append. */
+	if (t >= 0)
+		request_fetchcollect(src, t, &fl);
+	fetchlist_free(&fl);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	buffer_free(&rb);
+	xfree(a);
+	xfree(ri);
+
+	lua_pop(lua, 5);
+
+	if (rs < 0)
+		lua_pushnil(lua);
+	else
+		lua_pushboolean(lua, (rs == STATUS_OK));
+	if (rd < 0)
+		lua_pushnil(lua);
+	else
+		lua_pushboolean(lua, (rd == STATUS_OK));
+	lua_pushinteger(lua, (lua_Integer)(count));
+	lua_pushinteger(lua, (lua_Integer)(bytes));
+	lua_pushnumber(lua, (lua_Number)(end.tv_sec - start.tv_sec) +
+	    (lua_Number)(end.tv_nsec - start.tv_nsec) / 1000000000);
+
+	return 5;
+}
+
+
 /*
  * Core function to change message flags.
  */
@@ -750,17 +1455,19 @@ static int
 ifcore_store(lua_State *lua)
 {
 	int r;
+	const char **m;
 
 	if (lua_gettop(lua) != 4)
 		luaL_error(lua, "wrong number of arguments");
 	luaL_checktype(lua, 1, LUA_TLIGHTUSERDATA);
-	luaL_checktype(lua, 2, LUA_TSTRING);
+	luaL_checktype(lua, 2, LUA_TTABLE);
 	luaL_checktype(lua, 3, LUA_TSTRING);
 	luaL_checktype(lua, 4, LUA_TSTRING);
 
-	r = request_store((session *)(lua_topointer(lua, 1)),
-	    lua_tostring(lua, 2), lua_tostring(lua, 3),
-	    lua_tostring(lua, 4));
+	m = get_mesgs(lua, 2);
+	r = request_store((session *)(lua_topointer(lua, 1)), m,
+	    lua_tostring(lua, 3), lua_tostring(lua, 4));
+	xfree(m);
 
 	lua_pop(lua, 4);
 
@@ -780,15 +1487,49 @@ static int
 ifcore_copy(lua_State *lua)
 {
 	int r;
+	const char **m;
 
 	if (lua_gettop(lua) != 3)
 		luaL_error(lua, "wrong number of arguments");
 	luaL_checktype(lua, 1, LUA_TLIGHTUSERDATA);
-	luaL_checktype(lua, 2, LUA_TSTRING);
+	luaL_checktype(lua, 2, LUA_TTABLE);
 	luaL_checktype(lua, 3, LUA_TSTRING);
 
-	r = request_copy((session *)(lua_topointer(lua, 1)),
-	    lua_tostring(lua, 2), lua_tostring(lua, 3));
+	m = get_mesgs(lua, 2);
+	r = request_copy((session *)(lua_topointer(lua, 1)), m,
+	    lua_tostring(lua, 3));
+	xfree(m);
+
+	lua_pop(lua, 3);
+
+	if (r < 0)
+		return 0;
+
+	lua_pushboolean(lua, (r == STATUS_OK));
+
+	return 1;
+}
+
+
+/*
+ * Core function to move messages.
+ */
+static int
+ifcore_move(lua_State *lua)
+{
+	int r;
+	const char **m;
+
+	if (lua_gettop(lua) != 3)
+		luaL_error(lua, "wrong number of arguments");
+	luaL_checktype(lua, 1, LUA_TLIGHTUSERDATA);
+	luaL_checktype(lua, 2, LUA_TTABLE);
+	luaL_checktype(lua, 3, LUA_TSTRING);
+
+	m = get_mesgs(lua, 2);
+	r = request_move((session *)(lua_topointer(lua, 1)), m,
+	    lua_tostring(lua, 3));
+	xfree(m);
 
 	lua_pop(lua, 3);
 
@@ -841,6 +1582,75 @@ ifcore_append(lua_State *lua)
 }
 
 
+/*
+ * Core function to append many messages to a mailbox at once.  Each message
+ * is given as a table of the message, and its flags and date, which may be
+ * nil.
+ */
+static int
+ifcore_multiappend(lua_State *lua)
+{
+	int r;
+	size_t i, n;
+	appenditem *a;
+
+	if (lua_gettop(lua) != 3)
+		luaL_error(lua, "wrong number of arguments");
+	luaL_checktype(lua, 1, LUA_TLIGHTUSERDATA);
+	luaL_checktype(lua, 2, LUA_TSTRING);
+	luaL_checktype(lua, 3, LUA_TTABLE);
+
+#if LUA_VERSION_NUM < 502
+	n = lua_objlen(lua, 3);
+#else
+	n = lua_rawlen(lua, 3);
+#endif
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(lua, 3, i + 1);
+		if (lua_type(lua, -1) != LUA_TTABLE)
+			luaL_error(lua, "message %d is not a table", (int)(i + 1));
+		lua_rawgeti(lua, -1, 1);
+		if (lua_type(lua, -1) != LUA_TSTRING)
+			luaL_error(lua, "message %d has no data", (int)(i + 1));
+		lua_pop(lua, 2);
+	}
+
+	a = (appenditem *)xmalloc((n + 1) * sizeof(appenditem));
+
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(lua, 3, i + 1);
+
+		lua_rawgeti(lua, -1, 1);
+		a[i].mesg = lua_tolstring(lua, -1, &a[i].len);
+		lua_pop(lua, 1);
+
+		lua_rawgeti(lua, -1, 2);
+		a[i].flags = (lua_type(lua, -1) == LUA_TSTRING ?
+		    lua_tostring(lua, -1) : NULL);
+		lua_pop(lua, 1);
+
+		lua_rawgeti(lua, -1, 3);
+		a[i].date = (lua_type(lua, -1) == LUA_TSTRING ?
+		    lua_tostring(lua, -1) : NULL);
+		lua_pop(lua, 2);
+	}
+
+	r = request_multiappend((session *)(lua_topointer(lua, 1)),
+	    lua_tostring(lua, 2), a, n);
+
+	xfree(a);
+
+	lua_pop(lua, 3);
+
+	if (r < 0)
+		return 0;
+
+	lua_pushboolean(lua, (r == STATUS_OK));
+
+	return 1;
+}
+
+
 /*
  * Core function to create a mailbox.
  */
@@ -1017,18 +1827,401 @@ ifcore_idle(lua_State *lua)
 
 
 /*
- * Open imapfilter core library.
+ * Core function to create a coroutine for a function, whose commands are
+ * suspended while the server has not yet responded, instead of waiting for
+ * the response; the coroutine then yields the session that it waits for.
  */
-LUALIB_API int
-luaopen_ifcore(lua_State *lua)
+static int
+ifcore_coroutine(lua_State *lua)
+{
+	lua_State *t;
+
+	if (lua_gettop(lua) != 1)
+		luaL_error(lua, "wrong number of arguments");
+	luaL_checktype(lua, 1, LUA_TFUNCTION);
+
+	t = lua_newthread(lua);
+	lua_pushvalue(lua, 1);
+	lua_xmove(lua, t, 1);
+
+	lua_getfield(lua, LUA_REGISTRYINDEX, COROUTINES);
+	lua_pushvalue(lua, -2);
+	lua_pushboolean(lua, 1);
+	lua_rawset(lua, -3);
+	lua_pop(lua, 1);
+
+	lua_remove(lua, 1);
+
+	return 1;
+}
+
+
+/*
+ * Core function to wait until any of the sessions that suspended coroutines
+ * wait for is ready, ie. the server has sent more data, or the session is no
+ * longer used by a suspended command.  Returns a table with the sessions that
+ * are ready as keys.  If the timeout period expires, the commands are no
+ * longer suspended, so that waiting for their responses fails as usual, and
+ * all the sessions are returned.
+ */
+static int
+ifcore_poll(lua_State *lua)
 {
+	int w, r;
+	size_t i, j, k, n;
+	session *s, **ss;
+	list *l;
+
+	if (lua_gettop(lua) != 2)
+		luaL_error(lua, "wrong number of arguments");
+	luaL_checktype(lua, 1, LUA_TTABLE);
+	luaL_checktype(lua, 2, LUA_TBOOLEAN);
 
+	w = lua_toboolean(lua, 2);
 #if LUA_VERSION_NUM < 502
-	luaL_register(lua, "ifcore", ifcorelib);
+	n = lua_objlen(lua, 1);
 #else
-	luaL_newlib(lua, ifcorelib);
-	lua_setglobal(lua, "ifcore");
+	n = lua_rawlen(lua, 1);
+#endif
+
+	ss = (session **)xmalloc((n + 1) * sizeof(session *));
+
+	lua_newtable(lua);
+
+	for (i = j = k = 0; i < n; i++) {
+		lua_rawgeti(lua, 1, i + 1);
+		s = (session *)(lua_touserdata(lua, -1));
+		for (l = sessions; l != NULL && l->data != s; l = l->next);
+		if (s != NULL && l != NULL && s->suspend.tag != 0 &&
+		    s->suspend.held.len == 0 && s->socket != -1) {
+			ss[j++] = s;
+			lua_pop(lua, 1);
+		} else {
+			lua_pushboolean(lua, 1);
+			lua_rawset(lua, -3);
+			k++;
+		}
+	}
+
+	if (j > 0) {
+		r = socket_poll(ss, j, (w && k == 0 ?
+		    (long)(get_option_number("timeout")) : -1));
+		for (i = 0; i < j; i++) {
+			if (r == 1 && !(ss[i]->events & SOCKET_READ))
+				continue;
+			if (r != 1) {
+				if (!w || k > 0)
+					break;
+				ss[i]->suspend.expired = 1;
+			}
+			lua_pushlightuserdata(lua, (void *)(ss[i]));
+			lua_pushboolean(lua, 1);
+			lua_rawset(lua, -3);
+		}
+	}
+
+	xfree(ss);
+
+	return 1;
+}
+
+
+/*
+ * Core function that returns once the session is no longer in use by a
+ * suspended command of another coroutine, or the response of that command has
+ * been set aside, so that the state of the session can be checked before the
+ * next command is sent.
+ */
+static int
+ifcore_wait(lua_State *lua)
+{
+
+	if (lua_gettop(lua) != 1)
+		luaL_error(lua, "wrong number of arguments");
+	luaL_checktype(lua, 1, LUA_TLIGHTUSERDATA);
+
+	lua_pop(lua, 1);
+
+	return 0;
+}
+
+
+/*
+ * Convert a table of message sets to a NULL terminated array.  The strings are
+ * still owned by the table, so it must be kept on the stack while the array is
+ * in use.
+ */
+static const char **
+get_mesgs(lua_State *lua, int index)
+{
+	const char **m;
+	size_t i, n;
+
+#if LUA_VERSION_NUM < 502
+	n = lua_objlen(lua, index);
+#else
+	n = lua_rawlen(lua, index);
 #endif
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(lua, index, i);
+		if (lua_type(lua, -1) != LUA_TSTRING)
+			luaL_error(lua, "table of strings expected");
+		lua_pop(lua, 1);
+	}
+
+	m = (const char **)xmalloc((n + 1) * sizeof(const char *));
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(lua, index, i + 1);
+		m[i] = lua_tostring(lua, -1);
+		lua_pop(lua, 1);
+	}
+	m[n] = NULL;
+
+	return m;
+}
+
+
+/*
+ * Writer of fetched data that passes them, a piece at a time, to the function
+ * at the top of the stack; any error is left on the stack.
+ */
+static int
+write_function(void *arg, const char *data, size_t len)
+{
+	lua_State *lua = (lua_State *)(arg);
+
+	lua_pushvalue(lua, -1);
+	lua_pushlstring(lua, data, len);
+	if (lua_pcall(lua, 1, 0, 0))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Call a core function, but suspend the coroutine calling it while any of the
+ * sessions that it uses is in use by a suspended command of another coroutine.
+ * Callers that cannot be suspended wait for the response of that command
+ * instead, and it is set aside for when the command is repeated.  Sessions
+ * that no longer exist fail the call, as if their connection was lost.
+ */
+static int
+core_call(lua_State *lua)
+{
+	int i, n;
+	session *s;
+	list *l;
+#if LUA_VERSION_NUM >= 503
+	lua_State *t;
+#endif
+
+	n = lua_gettop(lua);
+	for (i = 1; i <= n; i++) {
+		if (lua_type(lua, i) != LUA_TLIGHTUSERDATA)
+			continue;
+		s = (session *)(lua_touserdata(lua, i));
+		for (l = sessions; l != NULL && l->data != s; l = l->next);
+		if (l == NULL) {
+			lua_settop(lua, 0);
+			return 0;
+		}
+#if LUA_VERSION_NUM >= 503
+		s->suspend.repeat = 0;
+		if (s->suspend.tag == 0)
+			continue;
+		if ((t = suspend_owner(lua, s)) == lua) {
+			s->suspend.repeat = 1;
+			continue;
+		}
+		if (t != NULL && s->suspend.held.len > 0)
+			continue;
+		if (t != NULL && suspend_coroutine(lua))
+			return suspend_function(lua, s);
+		if ((t == NULL ? response_discard(s) : response_hold(s)) < 0) {
+			session_destroy(s);
+			lua_settop(lua, 0);
+			return 0;
+		}
+#endif
+	}
+
+	return ifcorelib[lua_tointeger(lua, lua_upvalueindex(1))].func(lua);
+}
+
+
+#if LUA_VERSION_NUM >= 503
+/*
+ * Call again a core function whose coroutine was suspended and resumed.
+ */
+static int
+core_resume(lua_State *lua, int status, lua_KContext ctx)
+{
+
+	(void)status;
+	(void)ctx;
+
+	return core_call(lua);
+}
+#endif
+
+
+/*
+ * Check if the running coroutine is one of those whose commands are suspended.
+ */
+static int
+suspend_coroutine(lua_State *lua)
+{
+#if LUA_VERSION_NUM >= 503
+	int r;
+
+	if (!lua_isyieldable(lua))
+		return 0;
+
+	lua_getfield(lua, LUA_REGISTRYINDEX, COROUTINES);
+	lua_pushthread(lua);
+	lua_rawget(lua, -2);
+	r = lua_toboolean(lua, -1);
+	lua_pop(lua, 2);
+
+	return r;
+#else
+	(void)lua;
+
+	return 0;
+#endif
+}
+
+
+#if LUA_VERSION_NUM >= 503
+/*
+ * Get the coroutine that suspended the command of the session, if it can
+ * still be resumed to repeat it.
+ */
+static lua_State *
+suspend_owner(lua_State *lua, session *s)
+{
+	lua_State *t;
+
+	lua_getfield(lua, LUA_REGISTRYINDEX, OWNERS);
+	lua_pushlightuserdata(lua, (void *)(s));
+	lua_rawget(lua, -2);
+	t = lua_tothread(lua, -1);
+	lua_pop(lua, 2);
+
+	if (t != NULL && t != lua && lua_status(t) != LUA_YIELD)
+		return NULL;
+
+	return t;
+}
+#endif
+
+
+/*
+ * Let the next command sent through the session be suspended, instead of
+ * waiting for the response, if the running coroutine allows it and the timeout
+ * period has not already expired while waiting.  While the response of
+ * another coroutine's command is set aside, nothing else can be suspended.
+ */
+static void
+suspend_allow(lua_State *lua, session *s)
+{
+
+	if (s->suspend.tag != 0 && !s->suspend.repeat) {
+		s->suspend.allow = 0;
+		return;
+	}
+
+	s->suspend.allow = (!s->suspend.expired && suspend_coroutine(lua));
+	s->suspend.expired = 0;
+
+	if (s->suspend.allow) {
+		lua_getfield(lua, LUA_REGISTRYINDEX, OWNERS);
+		lua_pushlightuserdata(lua, (void *)(s));
+		lua_pushthread(lua);
+		lua_rawset(lua, -3);
+		lua_pop(lua, 1);
+	}
+}
+
+
+/*
+ * Suspend the coroutine of a core function, yielding the session it waits for;
+ * the function is called again with the same arguments once it is resumed.
+ */
+static int
+suspend_function(lua_State *lua, session *s)
+{
+#if LUA_VERSION_NUM >= 503
+	lua_pushlightuserdata(lua, (void *)(s));
+
+	return lua_yieldk(lua, 1, 0, core_resume);
+#else
+	(void)s;
+
+	return luaL_error(lua, "commands cannot be suspended");
+#endif
+}
+
+
+/*
+ * Open imapfilter core library.
+ */
+LUALIB_API int
+luaopen_ifcore(lua_State *lua)
+{
+	int i;
+
+	lua_newtable(lua);
+	lua_newtable(lua);
+	lua_pushstring(lua, "k");
+	lua_setfield(lua, -2, "__mode");
+	lua_setmetatable(lua, -2);
+	lua_setfield(lua, LUA_REGISTRYINDEX, COROUTINES);
+
+	lua_newtable(lua);
+	lua_newtable(lua);
+	lua_pushstring(lua, "v");
+	lua_setfield(lua, -2, "__mode");
+	lua_setmetatable(lua, -2);
+	lua_setfield(lua, LUA_REGISTRYINDEX, OWNERS);
+
+	lua_newtable(lua);
+	for (i = 0; ifcorelib[i].name != NULL; i++) {
+		lua_pushinteger(lua, (lua_Integer)(i));
+		lua_pushcclosure(lua, core_call, 1);
+		lua_setfield(lua, -2, ifcorelib[i].name);
+	}
+	lua_setglobal(lua, "ifcore");
 
 	return 1;
 }
+
+
+/*
+ * Push to the stack the modification sequence, as a string since it may not
+ * fit in a number, the expunged messages, and a table with the flags of the
+ * changed messages indexed by their UID.
+ */
+static void
+push_changes(lua_State *lua, unsigned long long modseq, const char *vanished,
+    fetchlist *fl)
+{
+	size_t i;
+	char m[24];
+
+	snprintf(m, sizeof(m), "%llu", modseq);
+	lua_pushstring(lua, m);
+
+	if (vanished != NULL)
+		lua_pushstring(lua, vanished);
+	else
+		lua_pushnil(lua);
+
+	lua_newtable(lua);
+	for (i = 0; i < fl->len; i++) {
+		if (!fl->items[i].flags)
+			continue;
+		lua_pushlstring(lua, fl->items[i].flags, fl->items[i].flagslen);
+		lua_rawseti(lua, -2, fl->items[i].uid);
+	}
+}
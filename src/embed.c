@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+
+static int write_bytes(lua_State *lua, const void *p, size_t sz, void *ud);
+
+
+/*
+ * Compile the Lua modules given as arguments, and write their bytecode to the
+ * standard output as C arrays, to be embedded in the executable.  The modules
+ * are compiled by the same Lua library the program is linked with, so that the
+ * format of the bytecode always matches.
+ */
+int
+main(int argc, char *argv[])
+{
+	lua_State *lua;
+	size_t col;
+	int i;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: embed module ...\n");
+		exit(1);
+	}
+
+	lua = luaL_newstate();
+
+	printf("#include <stdio.h>\n\n#include \"imapfilter.h\"\n\n\n");
+
+	for (i = 1; i < argc; i++) {
+		if (luaL_loadfile(lua, argv[i])) {
+			fprintf(stderr, "embed: %s\n", lua_tostring(lua, -1));
+			exit(1);
+		}
+
+		printf("static const unsigned char module%d[] = {", i);
+		col = 0;
+#if LUA_VERSION_NUM < 503
+		lua_dump(lua, write_bytes, &col);
+#else
+		lua_dump(lua, write_bytes, &col, 0);
+#endif
+		printf("\n};\n\n");
+
+		lua_pop(lua, 1);
+	}
+
+	printf("const module modules[] = {\n");
+	for (i = 1; i < argc; i++)
+		printf("\t{ \"%s\", module%d, sizeof(module%d) },\n", argv[i],
+		    i, i);
+	printf("\t{ NULL, NULL, 0 }\n};\n");
+
+	lua_close(lua);
+
+	if (fflush(stdout) == EOF) {
+		perror("embed");
+		exit(1);
+	}
+
+	return 0;
+}
+
+
+/*
+ * Write a chunk of the bytecode as elements of a C array.
+ */
+static int
+write_bytes(lua_State *lua, const void *p, size_t sz, void *ud)
+{
+	const unsigned char *c;
+	size_t *col;
+
+	(void)lua;
+
+	c = (const unsigned char *)(p);
+	col = (size_t *)(ud);
+
+	while (sz-- > 0)
+		printf("%s0x%02x,", (*col)++ % 12 == 0 ? "\n\t" : " ", *c++);
+
+	return 0;
+}
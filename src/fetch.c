@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "imapfilter.h"
+#include "fetch.h"
+
+
+/*
+ * Initialize list of fetched message data items.
+ */
+void
+fetchlist_init(fetchlist *fl)
+{
+
+	fl->items = NULL;
+	fl->len = 0;
+	fl->size = 0;
+	fl->sink = NULL;
+}
+
+
+/*
+ * Free allocated memory of list of fetched message data items.
+ */
+void
+fetchlist_free(fetchlist *fl)
+{
+
+	if (!fl->items)
+		return;
+
+	xfree(fl->items);
+	fl->items = NULL;
+	fl->len = fl->size = 0;
+}
+
+
+/*
+ * Get the data items of the message with the specified UID, adding a new entry
+ * to the list if there isn't one already.
+ */
+fetchitem *
+fetchlist_add(fetchlist *fl, unsigned int uid)
+{
+	fetchitem *fi;
+
+	if (fl->len > 0 && fl->items[fl->len - 1].uid == uid)
+		return &fl->items[fl->len - 1];
+
+	if (fl->len == fl->size) {
+		fl->size = (fl->size ? fl->size * 2 : 64);
+		fl->items = (fetchitem *)xrealloc(fl->items, fl->size *
+		    sizeof(fetchitem));
+	}
+
+	fi = &fl->items[fl->len++];
+	memset(fi, 0, sizeof(fetchitem));
+	fi->uid = uid;
+
+	return fi;
+}
+
+
+/*
+ * Initialize destination of streamed literals.
+ */
+void
+fetchsink_init(fetchsink *sk, int (*write)(void *arg, const char *data,
+    size_t len), void *arg)
+{
+
+	sk->write = write;
+	sk->arg = arg;
+	sk->len = 0;
+	sk->left = 0;
+	sk->error = 0;
+}
+
+
+/*
+ * Writer of streamed literals to a file stream.
+ */
+int
+fetchsink_file(void *arg, const char *data, size_t len)
+{
+
+	if (fwrite(data, sizeof(char), len, (FILE *)(arg)) != len)
+		return -1;
+
+	return 0;
+}
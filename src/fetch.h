@@ -0,0 +1,53 @@
+#ifndef FETCH_H
+#define FETCH_H
+
+
+#include <stdio.h>
+
+
+/* Data items of a message, as returned by the server in a FETCH response;
+ * they point inside the input buffer and are not NULL terminated. */
+typedef struct fetchitem {
+	unsigned int uid;	/* Unique identifier of the message. */
+	unsigned long long modseq;	/* MODSEQ data item. */
+	const char *flags;	/* FLAGS data item. */
+	size_t flagslen;	/* Length of FLAGS data item. */
+	const char *date;	/* INTERNALDATE data item. */
+	size_t datelen;		/* Length of INTERNALDATE data item. */
+	const char *size;	/* RFC822.SIZE data item. */
+	size_t sizelen;		/* Length of RFC822.SIZE data item. */
+	const char *structure;	/* BODYSTRUCTURE data item. */
+	size_t structurelen;	/* Length of BODYSTRUCTURE data item. */
+	const char *body;	/* BODY[<section>] data item. */
+	size_t bodylen;		/* Length of BODY[<section>] data item. */
+} fetchitem;
+
+/* Destination of FETCH literals that are not to be kept in memory. */
+typedef struct fetchsink {
+	int (*write)(void *arg, const char *data, size_t len);	/* Writer. */
+	void *arg;		/* Argument passed to the writer. */
+	size_t len;		/* Number of bytes written. */
+	size_t left;		/* Bytes of the current literal still to come. */
+	int error;		/* Writer has failed. */
+} fetchsink;
+
+/* Data items of all the messages of a FETCH command. */
+typedef struct fetchlist {
+	fetchitem *items;	/* Data items of each message. */
+	size_t len;		/* Number of messages. */
+	size_t size;		/* Maximum number of messages. */
+	fetchsink *sink;	/* Destination of literals, if they are not to
+				 * be kept in memory. */
+} fetchlist;
+
+
+/*	fetch.c		*/
+void fetchlist_init(fetchlist *fl);
+void fetchlist_free(fetchlist *fl);
+fetchitem *fetchlist_add(fetchlist *fl, unsigned int uid);
+void fetchsink_init(fetchsink *sk, int (*write)(void *arg, const char *data,
+    size_t len), void *arg);
+int fetchsink_file(void *arg, const char *data, size_t len);
+
+
+#endif				/* FETCH_H */
@@ -16,11 +16,9 @@
 #include "version.h"
 #include "buffer.h"
 #include "pathnames.h"
-#include "regexp.h"
 
 
 extern buffer ibuf, obuf, nbuf, cbuf;
-extern regexp responses[];
 #if OPENSSL_VERSION_NUMBER >= 0x1010000fL
 extern SSL_CTX *sslctx;
 #else
@@ -133,8 +131,6 @@ main(int argc, char *argv[])
 	buffer_init(&nbuf, NAMESPACE_BUF);
 	buffer_init(&cbuf, CONVERSION_BUF);
 
-	regexp_compile(responses);
-
 	SSL_library_init();
 	SSL_load_error_strings();
 #if OPENSSL_VERSION_NUMBER >= 0x1010000fL
@@ -227,8 +223,6 @@ main(int argc, char *argv[])
 #endif
 	ERR_free_strings();
 
-	regexp_free(responses);
-
 	buffer_free(&ibuf);
 	buffer_free(&obuf);
 	buffer_free(&nbuf);
@@ -12,6 +12,7 @@
 #include <openssl/ssl.h>
 
 #include "session.h"
+#include "fetch.h"
 
 
 /* Fatal error exit codes. */
@@ -35,8 +36,18 @@
 #define CAPABILITY_XOAUTH2		0x10
 #define CAPABILITY_ENABLE		0x20
 #define CAPABILITY_UTF8			0x40
+#define CAPABILITY_CONDSTORE		0x80
+#define CAPABILITY_QRESYNC		0x100
+#define CAPABILITY_MOVE			0x200
+#define CAPABILITY_UIDPLUS		0x400
+#define CAPABILITY_COMPRESS		0x800
+#define CAPABILITY_LITERALPLUS		0x1000
+#define CAPABILITY_LITERALMINUS		0x2000
+#define CAPABILITY_MULTIAPPEND		0x4000
+#define CAPABILITY_ESEARCH		0x8000
 
 /* Status responses and response codes. */
+#define STATUS_SUSPEND			-3
 #define STATUS_BYE			-2
 #define STATUS_ERROR			-1
 #define STATUS_NONE			0
@@ -53,6 +64,11 @@
 
 #define STATUS_DRYRUN			STATUS_OK
 
+/* Readiness of the socket of a session for input and output. */
+#define SOCKET_NONE			0x00
+#define SOCKET_READ			0x01
+#define SOCKET_WRITE			0x02
+
 /* Initial size for buffers. */
 #define INPUT_BUF			4096
 #define OUTPUT_BUF			1024
@@ -77,16 +93,49 @@ typedef struct options {
 	char *truststore;       /* CA TrustStore. */
 } options;
 
+/* Message to be appended to a mailbox. */
+typedef struct appenditem {
+	const char *mesg;	/* Message. */
+	size_t len;		/* Length of the message. */
+	const char *flags;	/* Flags of the message, or NULL. */
+	const char *date;	/* Internal date of the message, or NULL. */
+} appenditem;
+
+/* Message to be relayed from one mailbox to another. */
+typedef struct relayitem {
+	unsigned int uid;	/* Unique identifier of the message. */
+	size_t size;		/* Size of the message. */
+	const char *flags;	/* Flags of the message, or NULL. */
+	const char *date;	/* Internal date of the message, or NULL. */
+} relayitem;
+
 /* Environment variables. */
 typedef struct environment {
 	char *home;		/* Program's home directory. */
 	long pathmax;		/* Maximum pathname. */
 } environment;
 
+/* Lua module precompiled and embedded in the executable. */
+typedef struct module {
+	const char *name;	/* Name of the module's file. */
+	const unsigned char *data;	/* Bytecode of the module. */
+	size_t size;		/* Size of the bytecode. */
+} module;
+
 
 /*	cert.c		*/
 int get_cert(session *ssn);
 
+/*	cache.c		*/
+LUALIB_API int luaopen_ifcache(lua_State *lua);
+
+/*	compress.c	*/
+int compress_start(session *ssn);
+void compress_stop(session *ssn);
+ssize_t compress_read(session *ssn, char *buf, size_t len, long timeout,
+    int timeoutfail, int *interrupt);
+ssize_t compress_write(session *ssn, const char *buf, size_t len);
+
 /*	core.c		*/
 LUALIB_API int luaopen_ifcore(lua_State *lua);
 
@@ -150,7 +199,11 @@ int request_login(session **ssnptr, const char *server, const char *port, const
 int request_logout(session *ssn);
 int request_status(session *ssn, const char *mbox, unsigned int *exist,
     unsigned int *recent, unsigned int *unseen, unsigned int *uidnext);
-int request_select(session *ssn, const char *mbox);
+int request_select(session *ssn, const char *mbox, unsigned int
+    *uidvalidity, unsigned long long *modseq, const char *known, char
+    **vanished, fetchlist *fl);
+int request_changes(session *ssn, unsigned long long *modseq, char
+    **vanished, fetchlist *fl);
 int request_close(session *ssn);
 int request_expunge(session *ssn);
 int request_list(session *ssn, const char *refer, const char *name, char
@@ -159,25 +212,31 @@ int request_lsub(session *ssn, const char *refer, const char *name, char
     **mboxs, char **folders);
 int request_search(session *ssn, const char *criteria, const char *charset,
     char **mesgs);
-int request_fetchfast(session *ssn, const char *mesg, char **flags, char
-    **date, char **size);
-int request_fetchflags(session *ssn, const char *mesg, char **flags);
-int request_fetchdate(session *ssn, const char *mesg, char **date);
-int request_fetchsize(session *ssn, const char *mesg, char **size);
-int request_fetchstructure(session *ssn, const char *mesg, char **structure);
-int request_fetchheader(session *ssn, const char *mesg, char **header, size_t
-    *len);
-int request_fetchtext(session *ssn, const char *mesg, char **text, size_t
-    *len);
+int request_searchcount(session *ssn, const char *criteria, const char
+    *charset, unsigned long *count, unsigned long *min, unsigned long *max);
+int request_fetchfast(session *ssn, const char *mesg, fetchlist *fl);
+int request_fetchflags(session *ssn, const char *mesg, fetchlist *fl);
+int request_fetchdate(session *ssn, const char *mesg, fetchlist *fl);
+int request_fetchsize(session *ssn, const char *mesg, fetchlist *fl);
+int request_fetchstructure(session *ssn, const char *mesg, fetchlist *fl);
+int request_fetchheader(session *ssn, const char *mesg, fetchlist *fl);
+int request_fetchtext(session *ssn, const char *mesg, fetchlist *fl);
 int request_fetchfields(session *ssn, const char *mesg, const char
-    *headerfields, char **fields, size_t *len);
+    *headerfields, fetchlist *fl);
 int request_fetchpart(session *ssn, const char *mesg, const char *bodypart,
-    char **part, size_t *len);
-int request_store(session *ssn, const char *mesg, const char *mode, const char
-    *flags);
-int request_copy(session *ssn, const char *mesg, const char *mbox);
+    fetchlist *fl);
+int request_fetchahead(session *ssn, const char *mesg);
+int request_fetchcollect(session *ssn, int tag, fetchlist *fl);
+int request_store(session *ssn, const char **mesgs, const char *mode, const
+    char *flags);
+int request_copy(session *ssn, const char **mesgs, const char *mbox);
+int request_move(session *ssn, const char **mesgs, const char *mbox);
 int request_append(session *ssn, const char *mbox, const char *mesg, size_t
     mesglen, const char *flags, const char *date);
+int request_append_file(session *ssn, const char *mbox, const char *mesg,
+    FILE *fp, size_t mesglen, const char *flags, const char *date);
+int request_multiappend(session *ssn, const char *mbox, const appenditem
+    *items, size_t n);
 int request_create(session *ssn, const char *mbox);
 int request_delete(session *ssn, const char *mbox);
 int request_rename(session *ssn, const char *oldmbox, const char *newmbox);
@@ -186,6 +245,9 @@ int request_unsubscribe(session *ssn, const char *mbox);
 int request_idle(session *ssn, char **event);
 
 /*	response.c	*/
+int response_ready(session *ssn, int tag);
+int response_hold(session *ssn);
+int response_discard(session *ssn);
 int response_generic(session *ssn, int tag);
 int response_continuation(session *ssn, int tag);
 int response_greeting(session *ssn);
@@ -196,16 +258,16 @@ int response_status(session *ssn, int tag, unsigned int *exist,
     unsigned int *recent, unsigned int *unseen, unsigned int *uidnext);
 int response_examine(session *ssn, int tag, unsigned int *exist,
     unsigned int *recent);
-int response_select(session *ssn, int tag);
+int response_enable(session *ssn, int tag, unsigned int *enabled);
+int response_select(session *ssn, int tag, unsigned int *uidvalidity,
+    unsigned long long *modseq, char **vanished, fetchlist *fl);
+int response_changes(session *ssn, int tag, unsigned long long *modseq,
+    char **vanished, fetchlist *fl);
 int response_list(session *ssn, int tag, char **mboxs, char **folders);
 int response_search(session *ssn, int tag, char **mesgs);
-int response_fetchfast(session *ssn, int tag, char **flags, char **date,
-    char **size);
-int response_fetchflags(session *ssn, int tag, char **flags);
-int response_fetchdate(session *ssn, int tag, char **date);
-int response_fetchsize(session *ssn, int tag, char **size);
-int response_fetchstructure(session *ssn, int tag, char **structure);
-int response_fetchbody(session *ssn, int tag, char **body, size_t *len);
+int response_searchcount(session *ssn, int tag, unsigned long *count,
+    unsigned long *min, unsigned long *max);
+int response_fetch(session *ssn, int tag, fetchlist *fl);
 int response_idle(session *ssn, int tag, char **event);
 
 /*	signal.c	*/
@@ -221,14 +283,22 @@ int close_connection(session *ssn);
 ssize_t socket_read(session *ssn, char *buf, size_t len, long timeout,
     int timeoutfail, int *interrupt);
 ssize_t socket_write(session *ssn, const char *buf, size_t len);
+ssize_t socket_transport_read(session *ssn, char *buf, size_t len,
+    long timeout, int timeoutfail, int *interrupt);
+ssize_t socket_transport_write(session *ssn, const char *buf, size_t len);
 int open_secure_connection(session *ssn, const char *server,
     const char *sslproto);
 int close_secure_connection(session *ssn);
 ssize_t socket_secure_read(session *ssn, char *buf, size_t len);
 ssize_t socket_secure_write(session *ssn, const char *buf, size_t len);
+int socket_wait(session *ssn, int events, long timeout);
+int socket_poll(session **ssns, size_t n, long timeout);
 
 /*	system.c	*/
 LUALIB_API int luaopen_ifsys(lua_State *lua);
 
+/*	uidset.c	*/
+LUALIB_API int luaopen_ifset(lua_State *lua);
+
 
 #endif				/* IMAPFILTER_H */
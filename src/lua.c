@@ -1,22 +1,70 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
 
 #include "imapfilter.h"
+#include "buffer.h"
 #include "pathnames.h"
 
 
+#define CONFIG_MAGIC	0x43464649	/* Identifies the cached bytecode. */
+
+#if defined(__APPLE__) && !defined(st_mtim)
+#define st_mtim		st_mtimespec	/* Modification time, nanoseconds. */
+#endif
+
+
+/* Header of the cached bytecode of the configuration file. */
+typedef struct configheader {
+	uint32_t magic;		/* Identifier of the cache file. */
+	uint32_t version;	/* Version of Lua that compiled the file. */
+	int64_t mtime;		/* Modification time of the file. */
+	int64_t mtimensec;	/* Nanoseconds of the modification time. */
+	uint64_t size;		/* Size of the file. */
+	uint64_t ino;		/* Inode number of the file. */
+	uint64_t dev;		/* Device that contains the file. */
+	uint64_t pathlen;	/* Length of the pathname of the file. */
+} configheader;
+
+
 extern options opts;
 extern struct sessionhead sessions;
 
 static lua_State *lua;		/* Lua interpreter state. */
 
+#ifdef CONFIG_EMBEDDED_MODULES
+extern const module modules[];	/* Lua modules embedded as bytecode. */
+#else
+static const char *modules[] = {	/* Lua modules, in loading order. */
+	PATHNAME_COMMON,
+	PATHNAME_SET,
+	PATHNAME_REGEX,
+	PATHNAME_ACCOUNT,
+	PATHNAME_MAILBOX,
+	PATHNAME_MESSAGE,
+	PATHNAME_OPTIONS,
+	PATHNAME_AUXILIARY,
+	NULL
+};
+#endif
+
 
 static int traceback_handler(lua_State *lua);
+static int load_config(const char *config);
+static int read_bytecode(const char *cf, const configheader *h,
+    const char *config);
+static void write_bytecode(const char *cf, const configheader *h,
+    const char *config);
+static int write_chunk(lua_State *lua, const void *p, size_t sz, void *ud);
 void init_options(void);
 void interactive_mode(void);
 
@@ -28,6 +76,11 @@ void interactive_mode(void);
 void
 start_lua(void)
 {
+#ifdef CONFIG_EMBEDDED_MODULES
+	const module *m;
+#else
+	const char **m;
+#endif
 
 	lua = luaL_newstate();
 
@@ -36,50 +89,31 @@ start_lua(void)
 	luaopen_ifcore(lua);
 	luaopen_ifsys(lua);
 	luaopen_ifre(lua);
+	luaopen_ifcache(lua);
+	luaopen_ifset(lua);
 
 	lua_settop(lua, 0);
 
 	init_options();
 
-	if (luaL_loadfile(lua, PATHNAME_COMMON) ||
-	    lua_pcall(lua, 0, LUA_MULTRET, 0))
-		fatal(ERROR_CONFIG, "%s\n", lua_tostring(lua, -1));
-
-	if (luaL_loadfile(lua, PATHNAME_SET) ||
-	    lua_pcall(lua, 0, LUA_MULTRET, 0))
-		fatal(ERROR_CONFIG, "%s\n", lua_tostring(lua, -1));
-
-	if (luaL_loadfile(lua, PATHNAME_REGEX) ||
-	    lua_pcall(lua, 0, LUA_MULTRET, 0))
-		fatal(ERROR_CONFIG, "%s\n", lua_tostring(lua, -1));
-
-	if (luaL_loadfile(lua, PATHNAME_ACCOUNT) ||
-	    lua_pcall(lua, 0, LUA_MULTRET, 0))
-		fatal(ERROR_CONFIG, "%s\n", lua_tostring(lua, -1));
-
-	if (luaL_loadfile(lua, PATHNAME_MAILBOX) ||
-	    lua_pcall(lua, 0, LUA_MULTRET, 0))
-		fatal(ERROR_CONFIG, "%s\n", lua_tostring(lua, -1));
-
-	if (luaL_loadfile(lua, PATHNAME_MESSAGE) ||
-	    lua_pcall(lua, 0, LUA_MULTRET, 0))
-		fatal(ERROR_CONFIG, "%s\n", lua_tostring(lua, -1));
-
-	if (luaL_loadfile(lua, PATHNAME_OPTIONS) ||
-	    lua_pcall(lua, 0, LUA_MULTRET, 0))
-		fatal(ERROR_CONFIG, "%s\n", lua_tostring(lua, -1));
-
-	if (luaL_loadfile(lua, PATHNAME_AUXILIARY) ||
-	    lua_pcall(lua, 0, LUA_MULTRET, 0))
-		fatal(ERROR_CONFIG, "%s\n", lua_tostring(lua, -1));
+#ifdef CONFIG_EMBEDDED_MODULES
+	for (m = modules; m->name != NULL; m++)
+		if (luaL_loadbuffer(lua, (const char *)(m->data), m->size,
+		    m->name) || lua_pcall(lua, 0, LUA_MULTRET, 0))
+			fatal(ERROR_CONFIG, "%s\n", lua_tostring(lua, -1));
+#else
+	for (m = modules; *m != NULL; m++)
+		if (luaL_loadfile(lua, *m) || lua_pcall(lua, 0, LUA_MULTRET, 0))
+			fatal(ERROR_CONFIG, "%s\n", lua_tostring(lua, -1));
+#endif
 
 	if (opts.oneline != NULL) {
 		if (luaL_loadbuffer(lua, opts.oneline, strlen(opts.oneline),
 		    "=<command line>") || lua_pcall(lua, 0, LUA_MULTRET, 0))
 			fatal(ERROR_CONFIG, "%s\n", lua_tostring(lua, -1));
 	} else {
-		if (luaL_loadfile(lua, strcmp(opts.config, "-") == 0 ? NULL :
-		    opts.config))
+		if (strcmp(opts.config, "-") == 0 ? luaL_loadfile(lua, NULL) :
+		    load_config(opts.config))
 			fatal(ERROR_CONFIG, "%s\n", lua_tostring(lua, -1));
 		lua_pushcfunction(lua, traceback_handler);
 		lua_insert(lua, 1);
@@ -112,6 +146,152 @@ traceback_handler(lua_State *lua)
 }
 
 
+/*
+ * Load the configuration file.  The bytecode of the file is cached, and it is
+ * loaded instead of the file on the next runs, for as long as the file is the
+ * same, ie. its inode, modification time and size remain the same.
+ */
+static int
+load_config(const char *config)
+{
+	struct stat st;
+	configheader h;
+	char *cf;
+	int r;
+
+	if (stat(config, &st) == -1)
+		return luaL_loadfile(lua, config);
+
+	memset(&h, 0, sizeof(h));
+	h.magic = CONFIG_MAGIC;
+	h.version = LUA_VERSION_NUM;
+	h.mtime = (int64_t)(st.st_mtime);
+	h.mtimensec = (int64_t)(st.st_mtim.tv_nsec);
+	h.size = (uint64_t)(st.st_size);
+	h.ino = (uint64_t)(st.st_ino);
+	h.dev = (uint64_t)(st.st_dev);
+	h.pathlen = strlen(config);
+
+	cf = get_filepath("config.luac");
+
+	if (read_bytecode(cf, &h, config) == 0) {
+		xfree(cf);
+		return 0;
+	}
+
+	/*
+	 * A file modified within the current second could be modified again
+	 * without its modification time changing, so it is not cached yet.
+	 */
+	r = luaL_loadfile(lua, config);
+	if (r == 0 && st.st_mtime < time(NULL))
+		write_bytecode(cf, &h, config);
+
+	xfree(cf);
+
+	return r;
+}
+
+
+/*
+ * Load the cached bytecode of the configuration file, if it was compiled from
+ * the same file by the same version of Lua.
+ */
+static int
+read_bytecode(const char *cf, const configheader *h, const char *config)
+{
+	FILE *fd;
+	configheader c;
+	buffer b;
+	size_t n;
+	int r;
+
+	if ((fd = fopen(cf, "r")) == NULL)
+		return -1;
+
+	r = -1;
+	buffer_init(&b, h->pathlen + 4096);
+
+	if (fread(&c, sizeof(c), 1, fd) != 1 || memcmp(&c, h, sizeof(c)) != 0)
+		goto done;
+	if (fread(b.data, 1, h->pathlen, fd) != h->pathlen ||
+	    memcmp(b.data, config, h->pathlen) != 0)
+		goto done;
+
+	while ((n = fread(b.data + b.len, 1, b.size - b.len, fd)) > 0) {
+		b.len += n;
+		buffer_check(&b, b.len + 4096);
+	}
+	if (ferror(fd) || b.len == 0 || *b.data != *LUA_SIGNATURE)
+		goto done;
+
+	if (luaL_loadbuffer(lua, b.data, b.len, config) == 0)
+		r = 0;
+	else
+		lua_pop(lua, 1);
+done:
+	buffer_free(&b);
+	fclose(fd);
+
+	return r;
+}
+
+
+/*
+ * Cache the bytecode of the configuration file, which was just compiled.  The
+ * cache is written to a temporary file first, and then renamed, so that other
+ * processes never see it partially written.
+ */
+static void
+write_bytecode(const char *cf, const configheader *h, const char *config)
+{
+	FILE *fd;
+	char *tf;
+	int n, r;
+
+	n = strlen(cf) + strlen(".XXXXXX");
+	tf = (char *)xmalloc((n + 1) * sizeof(char));
+	snprintf(tf, n + 1, "%s.XXXXXX", cf);
+
+	if ((n = mkstemp(tf)) == -1) {
+		xfree(tf);
+		return;
+	}
+	if ((fd = fdopen(n, "w")) == NULL) {
+		close(n);
+		unlink(tf);
+		xfree(tf);
+		return;
+	}
+
+	r = (fwrite(h, sizeof(configheader), 1, fd) != 1 ||
+	    fwrite(config, 1, h->pathlen, fd) != h->pathlen);
+#if LUA_VERSION_NUM < 503
+	r = r || lua_dump(lua, write_chunk, fd);
+#else
+	r = r || lua_dump(lua, write_chunk, fd, 0);
+#endif
+
+	if (fclose(fd) == EOF || r || rename(tf, cf) == -1)
+		unlink(tf);
+
+	xfree(tf);
+}
+
+
+/*
+ * Write a chunk of bytecode to the cache file.
+ */
+static int
+write_chunk(lua_State *lua, const void *p, size_t sz, void *ud)
+{
+
+	(void)lua;
+
+	return fwrite(p, 1, sz, (FILE *)(ud)) != sz;
+}
+
+
 /*
  * Stop the Lua interpreter.
  */
@@ -133,11 +313,13 @@ init_options(void)
 	lua_newtable(lua);
 
 	set_table_boolean("certificates", 1);
+	set_table_boolean("compress", 1);
 	set_table_boolean("create", 0);
 	set_table_boolean("expunge", 1);
 	set_table_boolean("hostnames", 1);
 	set_table_number("keepalive", 29);
 	set_table_boolean("namespace", 1);
+	set_table_number("pipeline", 8);
 	set_table_boolean("starttls", 1);
 	set_table_boolean("subscribe", 0);
 	set_table_number("timeout", 60);
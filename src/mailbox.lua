@@ -6,6 +6,128 @@ Mailbox._mt = {}
 setmetatable(Mailbox, Mailbox._mt)
 
 
+_persistent = {}
+
+_persistent_items = { _header = true, _structure = true, _date = true,
+                      _size = true }
+
+_cache = { index = {}, size = 0, hits = 0, misses = 0, evictions = 0 }
+
+_cache.list = {}
+_cache.list.prev = _cache.list
+_cache.list.next = _cache.list
+
+_synchronized = {}
+
+_synchronized_queries = { ANSWERED = { '\\answered', true },
+                          DELETED = { '\\deleted', true },
+                          DRAFT = { '\\draft', true },
+                          FLAGGED = { '\\flagged', true },
+                          SEEN = { '\\seen', true },
+                          UNANSWERED = { '\\answered', false },
+                          UNDELETED = { '\\deleted', false },
+                          UNDRAFT = { '\\draft', false },
+                          UNFLAGGED = { '\\flagged', false },
+                          UNSEEN = { '\\seen', false } }
+
+function _sync_persistent()
+    for _, s in pairs(_synchronized) do
+        if s.dirty and s.cache then
+            local t = { s.modseq }
+            for uid, flags in pairs(s.flags) do
+                table.insert(t, uid .. flags)
+            end
+            ifcache.put(s.cache, 0, '_synchronized', table.concat(t, '\n'))
+            s.dirty = false
+        end
+    end
+    for _, c in pairs(_persistent) do
+        if c.cache then ifcache.flush(c.cache) end
+    end
+end
+
+function _close_persistent()
+    _sync_persistent()
+    for _, c in pairs(_persistent) do
+        if c.cache then ifcache.close(c.cache) end
+    end
+    _persistent = {}
+    _synchronized = {}
+end
+
+
+-- The fetched items of messages are kept in memory across all mailboxes, up
+-- to a budget of bytes, and the least recently used items are evicted first.
+function _cache_sizeof(value)
+    if type(value) == 'string' then return #value end
+    if type(value) ~= 'table' then return 16 end
+    local n = 64
+    for k, v in pairs(value) do
+        n = n + 32 + _cache_sizeof(k) + _cache_sizeof(v)
+    end
+    return n
+end
+
+function _cache_link(entry)
+    entry.prev = _cache.list
+    entry.next = _cache.list.next
+    _cache.list.next.prev = entry
+    _cache.list.next = entry
+end
+
+function _cache_unlink(entry)
+    entry.prev.next = entry.next
+    entry.next.prev = entry.prev
+end
+
+function _cache_remove(entry)
+    _cache_unlink(entry)
+    _cache.size = _cache.size - entry.size
+    local items = _cache.index[entry.mailbox][entry.uid]
+    items[entry.item] = nil
+    if next(items) == nil then _cache.index[entry.mailbox][entry.uid] = nil end
+end
+
+function _cache_get(mailbox, uid, item)
+    if options.cache ~= true then return end
+    local entry = _cache.index[mailbox] and _cache.index[mailbox][uid] and
+                  _cache.index[mailbox][uid][item]
+    if entry == nil then
+        _cache.misses = _cache.misses + 1
+        return
+    end
+    _cache.hits = _cache.hits + 1
+    _cache_unlink(entry)
+    _cache_link(entry)
+    return entry.value
+end
+
+function _cache_put(mailbox, uid, item, value)
+    if options.cache ~= true or value == nil then return end
+    if not _cache.index[mailbox] then _cache.index[mailbox] = {} end
+    if not _cache.index[mailbox][uid] then _cache.index[mailbox][uid] = {} end
+    local items = _cache.index[mailbox][uid]
+    if items[item] then _cache_remove(items[item]) end
+
+    -- The size includes an estimate of the memory of the entry itself.
+    local size = _cache_sizeof(value) + 384
+    if size > options.cachesize then
+        if next(items) == nil then _cache.index[mailbox][uid] = nil end
+        return
+    end
+    local entry = { mailbox = mailbox, uid = uid, item = item, value = value,
+                    size = size }
+    items[item] = entry
+    _cache_link(entry)
+    _cache.size = _cache.size + size
+
+    while _cache.size > options.cachesize do
+        _cache_remove(_cache.list.prev)
+        _cache.evictions = _cache.evictions + 1
+    end
+end
+
+
 Mailbox._mt.__call = function (self, account, mailbox)
     local object = {}
 
@@ -15,22 +137,14 @@ Mailbox._mt.__call = function (self, account, mailbox)
     object._string =  account._account.username .. '@' ..
                       account._account.server .. '/' .. mailbox
 
-    for key, value in pairs(Mailbox) do
-        if type(value) == 'function' then object[key] = value end
-    end
-
-    object._mt = {}
-    object._mt.__index = object._attach_message
-    setmetatable(object, object._mt)
+    setmetatable(object, Mailbox._object_mt)
 
     return object
 end
 
 
 function Mailbox._check_connection(self)
-    if not self._account._account.session then
-        self._account._login_user(self._account)
-    end
+    self._account._check_connection(self._account)
 end
 
 function Mailbox._check_result(self, request, result)
@@ -54,22 +168,52 @@ end
 
 
 function Mailbox._cached_select(self)
+    self._check_connection(self)
+    self._account._route_connection(self._account, self._mailbox)
+    self._check_connection(self)
     if self._account._account.selected == nil or
         self._account._account.selected ~= self._mailbox then
 
-        self._check_connection(self)
-        local r, readonly = ifcore.select(self._account._account.session, self._mailbox)
+        local state = _synchronized[self._string]
+        local r, readonly, uidvalidity, modseq, vanished, changes
+        if state then
+            local known = {}
+            for uid in pairs(state.flags) do table.insert(known, uid) end
+            r, readonly, uidvalidity, modseq, vanished, changes =
+                ifcore.select(self._account._account.session, self._mailbox,
+                              state.uidvalidity, state.modseq,
+                              table.concat(_make_range(known), ','))
+        else
+            r, readonly, uidvalidity, modseq =
+                ifcore.select(self._account._account.session, self._mailbox)
+        end
         self._check_result(self, 'select', r)
         if r == false then return false end
 
         self._account._account.selected = self._mailbox
         self._account._account.readonly = readonly
+        self._account._account.uidvalidity = uidvalidity
+        self._account._account.modseq = modseq
+
+        if state then
+            if modseq == nil or state.uidvalidity ~= uidvalidity then
+                _synchronized[self._string] = nil
+            else
+                self._apply_changes(self, state, modseq, vanished, changes)
+            end
+        end
     end
     return true
 end
 
 function Mailbox._cached_close(self)
     self._check_connection(self)
+    for i, connection in ipairs(self._account._account.pool) do
+        if connection.selected == self._mailbox then
+            self._account._swap_connection(self._account, i)
+            break
+        end
+    end
     if self._account._account.selected == nil then
         return
     end
@@ -81,17 +225,148 @@ function Mailbox._cached_close(self)
 
     self._account._account.selected = nil
     self._account._account.readonly = nil
+    self._account._account.uidvalidity = nil
+    self._account._account.modseq = nil
 
     return true
 end
 
 
-function Mailbox._send_query(self, criteria, messages)
-    _check_optional(criteria, { 'string', 'table' })
-    _check_optional(messages, 'table')
+function Mailbox._apply_changes(self, state, modseq, vanished, changes)
+    if vanished then
+        for first, last in string.gmatch(vanished, '(%d+):?(%d*)') do
+            local a = tonumber(first)
+            local z = tonumber(last) or a
+            if z < a then a, z = z, a end
+            if z - a > 65536 then
+                for uid in pairs(state.flags) do
+                    if uid >= a and uid <= z then state.flags[uid] = nil end
+                end
+            else
+                for uid = a, z do state.flags[uid] = nil end
+            end
+        end
+    end
+    for uid, flags in pairs(changes) do
+        state.flags[uid] = ' ' .. string.lower(flags) .. ' '
+    end
+    if modseq ~= '0' then state.modseq = modseq end
+    state.dirty = true
+end
+
+function Mailbox._synchronize(self)
+    local account = self._account._account
+    if account.modseq == nil then return end
+
+    -- Downloading the flags of all the messages costs more than a search,
+    -- so it is only worth it if the copy is kept on disk for later sessions.
+    local state = _synchronized[self._string]
+    if state == nil then
+        local cache = self._persistent_cache(self)
+        if cache == nil then return end
+        state = { uidvalidity = account.uidvalidity, modseq = '0', flags = {},
+                  cache = cache }
+        local v = ifcache.get(state.cache, 0, '_synchronized')
+        if v then
+            state.modseq = string.match(v, '^%d+')
+            for uid, flags in string.gmatch(v, '\n(%d+)([^\n]*)') do
+                state.flags[tonumber(uid)] = flags
+            end
+        end
+        _synchronized[self._string] = state
+    end
+
+    local initial = state.modseq == '0'
+    local r, modseq, vanished, changes = ifcore.changes(account.session,
+                                                        state.modseq)
+    self._check_result(self, 'fetch', r)
+    if r == false then
+        _synchronized[self._string] = nil
+        return
+    end
+    if initial and modseq == '0' then modseq = account.modseq end
+
+    self._apply_changes(self, state, modseq, vanished, changes)
+
+    return state
+end
+
+function Mailbox._synchronized_query(self, criteria, messages)
+    local flag, set
+    local q = _synchronized_queries[string.upper(criteria)]
+    if q then
+        flag, set = q[1], q[2]
+    else
+        local k, f = string.match(criteria, '^(%a+) (%S+)$')
+        if k == nil then return end
+        k = string.upper(k)
+        if k == 'KEYWORD' then
+            flag, set = f, true
+        elseif k == 'UNKEYWORD' then
+            flag, set = f, false
+        else
+            return
+        end
+    end
 
-    if self._cached_select(self) ~= true then return {} end
+    local state = self._synchronize(self)
+    if state == nil then return end
 
+    flag = ' ' .. string.lower(flag) .. ' '
+    local uids = {}
+    if messages == nil then
+        for uid in pairs(state.flags) do table.insert(uids, uid) end
+    else
+        uids = _extract_messages(self, messages)
+    end
+    table.sort(uids)
+
+    local t = {}
+    for _, uid in ipairs(uids) do
+        local f = state.flags[uid]
+        if f and (string.find(f, flag, 1, true) ~= nil) == set then
+            table.insert(t, uid)
+        end
+    end
+
+    if options.close == true then self._cached_close(self) end
+
+    return t
+end
+
+
+function Mailbox._persistent_cache(self)
+    if options.persist ~= true then return end
+    local uidvalidity = self._account._account.uidvalidity
+    if not uidvalidity or uidvalidity == 0 then return end
+
+    local key = self._account._string .. '/' .. self._mailbox
+    local c = _persistent[key]
+    if c == nil or c.uidvalidity ~= uidvalidity then
+        if c ~= nil then ifcache.close(c.cache) end
+        c = { uidvalidity = uidvalidity,
+              cache = ifcache.open(self._account._account.server,
+                                   self._account._account.username,
+                                   self._mailbox, uidvalidity) }
+        _persistent[key] = c
+    end
+    return c.cache
+end
+
+function Mailbox._persistent_get(self, cache, message, item)
+    if cache == nil or _persistent_items[item] == nil and
+        not string.find(item, '^_fields%.') then return end
+    return ifcache.get(cache, message, item)
+end
+
+function Mailbox._persistent_put(self, cache, message, item, value)
+    if cache == nil or _persistent_items[item] == nil and
+        not string.find(item, '^_fields%.') then return end
+    ifcache.put(cache, message, item, value)
+end
+
+
+function Mailbox._make_search(self, criteria, messages)
     local mesgs
     if messages == nil then
         mesgs = nil
@@ -115,12 +390,29 @@ function Mailbox._send_query(self, criteria, messages)
         query = _make_query(criteria, mesgs)
     end
 
+    local charset
     if type(options.charset) == 'string' then
         charset = options.charset
     else
         charset = ''
     end
 
+    return query, charset
+end
+
+function Mailbox._send_query(self, criteria, messages)
+    _check_optional(criteria, { 'string', 'table' })
+    _check_optional(messages, 'table')
+
+    if self._cached_select(self) ~= true then return Set() end
+
+    if type(criteria) == 'string' then
+        local t = self._synchronized_query(self, criteria, messages)
+        if t then return Set._from({ [self] = ifset.new(t) }) end
+    end
+
+    local query, charset = self._make_search(self, criteria, messages)
+
     self._check_connection(self)
     local r, results = ifcore.search(self._account._account.session, query,
                                      charset)
@@ -128,14 +420,36 @@ function Mailbox._send_query(self, criteria, messages)
     if r == false then return false end
 
     if options.close == true then self._cached_close(self) end
-    if results == nil then return {} end
+    if results == nil then return Set() end
 
-    local t = {}
-    for n in string.gmatch(results, '%d+') do
-        table.insert(t, { self, tonumber(n) })
+    return Set._from({ [self] = ifset.parse(results) })
+end
+
+function Mailbox._count_query(self, criteria, messages)
+    _check_optional(criteria, { 'string', 'table' })
+    _check_optional(messages, 'table')
+
+    if self._cached_select(self) ~= true then return 0 end
+
+    if type(criteria) == 'string' then
+        local t = self._synchronized_query(self, criteria, messages)
+        if t then
+            if #t == 0 then return 0 end
+            return #t, t[1], t[#t]
+        end
     end
 
-    return t
+    local query, charset = self._make_search(self, criteria, messages)
+
+    self._check_connection(self)
+    local r, count, min, max = ifcore.count(self._account._account.session,
+                                            query, charset)
+    self._check_result(self, 'search', r)
+    if r == false then return 0 end
+
+    if options.close == true then self._cached_close(self) end
+
+    return count, min, max
 end
 
 
@@ -147,20 +461,10 @@ function Mailbox._flag_messages(self, mode, flags, messages)
     local f = ''
     if #flags ~= 0 then f = table.concat(flags, ' ') end
 
-    local r = false
-    local m = _make_range(messages)
-    local n = #m
-    local l = n
-    if options.limit > 0 then l = options.limit end
-    for i = 1, n, l do
-        j = i + l - 1
-        if n < j then j = n end
-        self._check_connection(self)
-        r = ifcore.store(self._account._account.session, table.concat(m, ',',
-                         i, j), mode, f)
-        self._check_result(self, 'store', r)
-        if r == false then break end
-    end
+    self._check_connection(self)
+    local r = ifcore.store(self._account._account.session,
+                           _make_chunks(messages), mode, f)
+    self._check_result(self, 'store', r)
 
     if options.close == true then self._cached_close(self) end
 
@@ -175,38 +479,80 @@ function Mailbox._copy_messages(self, dest, messages)
     if self._account._account.session == dest._account._account.session then
         if self._cached_select(self) ~= true then return end
 
-        local m = _make_range(messages)
-        local n = #m
-        local l = n
-        if options.limit > 0 then l = options.limit end
-        for i = 1, n, l do
-            j = i + l - 1
-            if n < j then j = n end
-            self._check_connection(self)
-            r = ifcore.copy(self._account._account.session,
-                            table.concat(m, ',', i, j), dest._mailbox)
-            self._check_result(self, 'copy', r)
-            if r == false then break end
-        end
+        self._check_connection(self)
+        r = ifcore.copy(self._account._account.session,
+                        _make_chunks(messages), dest._mailbox)
+        self._check_result(self, 'copy', r)
 
         if options.close == true then self._cached_close(self) end
     else
         local fast = self._fetch_fast(self, messages)
-        local mesgs = self._fetch_message(self, messages)
+        if not fast then return end
 
-        for i in pairs(fast) do
+        local order = {}
+        for _, m in ipairs(messages) do
+            if fast[m] then table.insert(order, m) end
+        end
+        table.sort(order)
+
+        local relay = {}
+        local large = {}
+        for _, i in ipairs(order) do
             for k, v in ipairs(fast[i]['flags']) do
                 if string.lower(v) == '\\recent' then
                     table.remove(fast[i]['flags'], k)
                 end
             end
 
+            local size = tonumber(fast[i]['size'])
+            if options.spill == 0 or size <= options.spill then
+                table.insert(relay, { i, size,
+                                      table.concat(fast[i]['flags'], ' '),
+                                      fast[i]['date'] })
+            else
+                table.insert(large, i)
+            end
+        end
+
+        r = true
+        if #relay > 0 then
+            if self._cached_select(self) ~= true then return end
+            self._check_connection(self)
             self._check_connection(dest)
-            r = ifcore.append(dest._account._account.session, dest._mailbox,
-                              mesgs[i], table.concat(fast[i]['flags'], ' '),
-                              fast[i]['date'])
-            self._check_result(dest, 'append', r)
-            if r == false then break end
+            local f, n, octets, seconds
+            f, r, n, octets, seconds =
+                ifcore.relay(self._account._account.session,
+                             dest._account._account.session, dest._mailbox,
+                             relay, options.batch)
+            self._check_result(self, 'fetch', f)
+            if f == false then r = false end
+            if f == true then self._check_result(dest, 'append', r) end
+            if options.close == true then self._cached_close(self) end
+
+            if options.info == true and n > 0 then
+                print(string.format('Relayed %d messages, %d octets, in ' ..
+                                    '%.2f seconds (%.0f octets/second).',
+                                    n, octets, seconds,
+                                    seconds > 0 and octets / seconds or 0))
+            end
+        end
+
+        for _, i in ipairs(large) do
+            if r ~= true then break end
+            if self._cached_select(self) ~= true then return end
+            self._check_connection(self)
+            self._check_connection(dest)
+            local f
+            f, r = ifcore.transfer(self._account._account.session,
+                                   tostring(i),
+                                   dest._account._account.session,
+                                   dest._mailbox,
+                                   table.concat(fast[i]['flags'], ' '),
+                                   fast[i]['date'])
+            self._check_result(self, 'fetchstream', f)
+            if f == false then r = false end
+            if f == true then self._check_result(dest, 'append', r) end
+            if options.close == true then self._cached_close(self) end
         end
     end
 
@@ -214,27 +560,104 @@ function Mailbox._copy_messages(self, dest, messages)
 end
 
 
-function Mailbox._fetch_fast(self, messages)
+function Mailbox._move_messages(self, dest, messages)
     if not messages or #messages == 0 then return end
     if self._cached_select(self) ~= true then return end
 
+    self._check_connection(self)
+    local r = ifcore.move(self._account._account.session,
+                          _make_chunks(messages), dest._mailbox)
+    self._check_result(self, 'move', r)
+
+    if options.close == true then self._cached_close(self) end
+
+    return r
+end
+
+
+function Mailbox._stream_part(self, part, message, dest)
+    if self._cached_select(self) ~= true then return end
+
+    self._check_connection(self)
+    local r, n = ifcore.fetchstream(self._account._account.session,
+                                    tostring(message), part, dest)
+    self._check_result(self, 'fetchstream', r)
+
+    if options.close == true then self._cached_close(self) end
+
+    if r == false then return end
+
+    return n
+end
+
+
+function Mailbox._fetch_bulk(self, request, messages, ...)
     local results = {}
-    for _, m in ipairs(messages) do
+    if #messages == 0 then return results end
+
+    local m = {}
+    for _, v in ipairs(messages) do table.insert(m, v) end
+    for _, c in ipairs(_make_chunks(m)) do
         self._check_connection(self)
-        local r, flags, date, size =
-            ifcore.fetchfast(self._account._account.session, tostring(m))
-        self._check_result(self, 'fetchfast', r)
-        if r == false then break end
+        local t = { ifcore[request](self._account._account.session, c, ...) }
+        self._check_result(self, request, t[1])
+        if t[1] == false then break end
+
+        for k = 2, #t do
+            if results[k - 1] == nil then results[k - 1] = {} end
+            for u, v in pairs(t[k]) do results[k - 1][u] = v end
+        end
+    end
+
+    return results
+end
 
-        if flags ~= nil and date ~= nil and size ~= nil  then
+function Mailbox._fetch_uncached(self, request, messages, item)
+    local results = {}
+    local uncached = {}
+    local stored = {}
+    local cache = self._persistent_cache(self)
+    for _, m in ipairs(messages) do
+        local v = _cache_get(self, m, item)
+        if v ~= nil then
+            results[m] = v
+        else
+            v = self._persistent_get(self, cache, m, item)
+            if v ~= nil then
+                stored[m] = v
+            else
+                table.insert(uncached, m)
+            end
+        end
+    end
+
+    local fetched = self._fetch_bulk(self, request, uncached)[1] or {}
+    for m, v in pairs(fetched) do
+        self._persistent_put(self, cache, m, item, v)
+    end
+    for m, v in pairs(stored) do fetched[m] = v end
+
+    return results, fetched
+end
+
+function Mailbox._fetch_fast(self, messages)
+    if not messages or #messages == 0 then return end
+    if self._cached_select(self) ~= true then return end
+
+    local t = self._fetch_bulk(self, 'fetchfast', messages)
+    local flags, dates, sizes = t[1] or {}, t[2] or {}, t[3] or {}
+
+    local results = {}
+    for _, m in ipairs(messages) do
+        if flags[m] ~= nil and dates[m] ~= nil and sizes[m] ~= nil  then
             local f = {}
-            for s in string.gmatch(flags, '%S+') do
+            for s in string.gmatch(flags[m], '%S+') do
                 table.insert(f, s)
             end
             results[m] = {}
             results[m]['flags'] = f
-            results[m]['date'] = date
-            results[m]['size'] = size
+            results[m]['date'] = dates[m]
+            results[m]['size'] = sizes[m]
         end
     end
 
@@ -247,17 +670,13 @@ function Mailbox._fetch_flags(self, messages)
     if not messages or #messages == 0 then return end
     if self._cached_select(self) ~= true then return end
 
+    local flags = self._fetch_bulk(self, 'fetchflags', messages)[1] or {}
+
     local results = {}
     for _, m in ipairs(messages) do
-        self._check_connection(self)
-        local r, flags = ifcore.fetchflags(self._account._account.session,
-                                           tostring(m))
-        self._check_result(self, 'fetchfast', r)
-        if r == false then break end
-
-        if flags ~= nil then
+        if flags[m] ~= nil then
             local f = {}
-            for s in string.gmatch(flags, '%S+') do
+            for s in string.gmatch(flags[m], '%S+') do
                 table.insert(f, s)
             end
             results[m] = f
@@ -273,23 +692,11 @@ function Mailbox._fetch_date(self, messages)
     if not messages or #messages == 0 then return end
     if self._cached_select(self) ~= true then return end
 
-    local results = {}
-    for _, m in ipairs(messages) do
-        if options.cache == true and
-            self[m]._date then
-            results[m] = self[m]._date
-        else
-            self._check_connection(self)
-            local r, date = ifcore.fetchdate(self._account._account.session,
-                                             tostring(m))
-            self._check_result(self, 'fetchdate', r)
-            if r == false then break end
-
-            if date ~= nil then
-                results[m] = date
-                if options.cache == true then self[m]._date = date end
-            end
-        end
+    local results, dates = self._fetch_uncached(self, 'fetchdate', messages,
+                                                '_date')
+    for m, date in pairs(dates) do
+        results[m] = date
+        _cache_put(self, m, '_date', date)
     end
 
     if options.close == true then self._cached_close(self) end
@@ -301,23 +708,11 @@ function Mailbox._fetch_size(self, messages)
     if not messages or #messages == 0 then return end
     if self._cached_select(self) ~= true then return end
 
-    local results = {}
-    for _, m in ipairs(messages) do
-        if options.cache == true and
-            self[m]._size then
-            results[m] = self[m]._size
-        else
-            self._check_connection(self)
-            local r, size = ifcore.fetchsize(self._account._account.session,
-                                             tostring(m))
-            self._check_result(self, 'fetchsize', r)
-            if r == false then break end
-
-            if size ~= nil then
-                results[m] = tonumber(size)
-                if options.cache == true then self[m]._size = tonumber(size) end
-            end
-        end
+    local results, sizes = self._fetch_uncached(self, 'fetchsize', messages,
+                                                '_size')
+    for m, size in pairs(sizes) do
+        results[m] = tonumber(size)
+        _cache_put(self, m, '_size', tonumber(size))
     end
 
     if options.close == true then self._cached_close(self) end
@@ -329,23 +724,11 @@ function Mailbox._fetch_header(self, messages)
     if not messages or #messages == 0 then return end
     if self._cached_select(self) ~= true then return end
 
-    local results = {}
-    for _, m in ipairs(messages) do
-        if options.cache == true and
-            self[m]._header then
-            results[m] = self[m]._header
-        else
-            self._check_connection(self)
-            local r, header = ifcore.fetchheader(self._account._account.session,
-                                                 tostring(m))
-            self._check_result(self, 'fetchheader', r)
-            if r == false then break end
-
-            if header ~= nil then
-                results[m] = header
-                if options.cache == true then self[m]._header = header end
-            end
-        end
+    local results, headers = self._fetch_uncached(self, 'fetchheader',
+                                                  messages, '_header')
+    for m, header in pairs(headers) do
+        results[m] = header
+        _cache_put(self, m, '_header', header)
     end
 
     if options.close == true then self._cached_close(self) end
@@ -357,23 +740,11 @@ function Mailbox._fetch_body(self, messages)
     if not messages or #messages == 0 then return end
     if self._cached_select(self) ~= true then return end
 
-    local results = {}
-    for _, m in ipairs(messages) do
-        if options.cache == true and
-            self[m]._body then
-            results[m] = self[m]._body
-        else
-            self._check_connection(self)
-            local r, body = ifcore.fetchbody(self._account._account.session,
-                                             tostring(m))
-            self._check_result(self, 'fetchbody', r)
-            if r == false then break end
-
-            if body ~= nil then
-                results[m] = body
-                if options.cache == true then self[m]._body = body end
-            end
-        end
+    local results, bodies = self._fetch_uncached(self, 'fetchbody', messages,
+                                                 '_body')
+    for m, body in pairs(bodies) do
+        results[m] = body
+        _cache_put(self, m, '_body', body)
     end
 
     if options.close == true then self._cached_close(self) end
@@ -406,27 +777,47 @@ function Mailbox._fetch_fields(self, fields, messages)
     if not messages or #messages == 0 then return end
     if self._cached_select(self) ~= true then return end
 
+    local t = {}
+    local cache = self._persistent_cache(self)
+    for _, f in ipairs(fields) do
+        local item = '_fields.' .. string.lower(f)
+        local uncached = {}
+        local stored = {}
+        for _, m in ipairs(messages) do
+            local v = _cache_get(self, m, item)
+            if v ~= nil then
+                if t[m] == nil then t[m] = {} end
+                t[m][f] = v
+            else
+                v = self._persistent_get(self, cache, m, item)
+                if v ~= nil then
+                    stored[m] = v
+                else
+                    table.insert(uncached, m)
+                end
+            end
+        end
+
+        local fetched = self._fetch_bulk(self, 'fetchfields', uncached,
+                                         f)[1] or {}
+        for m, field in pairs(fetched) do
+            self._persistent_put(self, cache, m, item, field)
+        end
+        for m, field in pairs(stored) do fetched[m] = field end
+        for m, field in pairs(fetched) do
+            field = string.gsub(field, '\r\n\r\n$', '\n')
+            if t[m] == nil then t[m] = {} end
+            t[m][f] = field
+            _cache_put(self, m, item, field)
+        end
+    end
+
     local results = {}
     for _, m in ipairs(messages) do
         results[m] = ''
         for _, f in ipairs(fields) do
-            if options.cache == true and
-                self[m]._fields[f] then
-                results[m] = results[m] .. self[m]._fields[f]
-            else
-                self._check_connection(self)
-                local r, field =
-                    ifcore.fetchfields(self._account._account.session,
-                                       tostring(m), f)
-
-                self._check_result(self, 'fetchfields', r)
-                if r == false then break end
-
-                if field ~= nil then
-                    field = string.gsub(field, '\r\n\r\n$', '\n')
-                    results[m] = results[m] .. field
-                    if options.cache == true then self[m]._fields[f] = field end
-                end
+            if t[m] ~= nil and t[m][f] ~= nil then
+                results[m] = results[m] .. t[m][f]
             end
         end
         results[m] = string.gsub(results[m], '\n$', '')
@@ -441,26 +832,12 @@ function Mailbox._fetch_structure(self, messages)
     if not messages or #messages == 0 then return end
     if self._cached_select(self) ~= true then return end
 
-    local results = {}
-    for _, m in ipairs(messages) do
-        if options.cache == true and
-            self[m]._structure then
-            results[m] = self[m]._structure
-        else
-            self._check_connection(self)
-            local r, structure =
-                ifcore.fetchstructure(self._account._account.session,
-                                      tostring(m))
-            self._check_result(self, 'fetchstructure', r)
-            if r == false then break end
-
-            if structure ~= nil then
-                local parsed = _parse_structure({ ['s'] = structure,
-                                                ['i'] = 1 })
-                results[m] = parsed
-                if options.cache == true then self[m]._structure = parsed end
-            end
-        end
+    local results, structures = self._fetch_uncached(self, 'fetchstructure',
+                                                     messages, '_structure')
+    for m, structure in pairs(structures) do
+        local parsed = _parse_structure({ ['s'] = structure, ['i'] = 1 })
+        results[m] = parsed
+        _cache_put(self, m, '_structure', parsed)
     end
 
     if options.close == true then self._cached_close(self) end
@@ -474,9 +851,9 @@ function Mailbox._fetch_parts(self, parts, message)
     local results = {}
     for _, part in ipairs(parts) do
         results[part] = ''
-        if options.cache == true and
-            self[message]._parts[part] then
-            results[part] = self[message]._parts[part]
+        local v = _cache_get(self, message, '_parts.' .. part)
+        if v ~= nil then
+            results[part] = v
         else
             self._check_connection(self)
             local r, bodypart = ifcore.fetchpart(self._account._account.session,
@@ -486,7 +863,7 @@ function Mailbox._fetch_parts(self, parts, message)
 
             if bodypart ~= nil then
                 results[part] = bodypart
-                self[message]._parts[part] = bodypart
+                _cache_put(self, message, '_parts.' .. part, bodypart)
             end
         end
     end
@@ -517,13 +894,24 @@ end
 
 
 function Mailbox.send_query(self, criteria, messages)
-    return Set(self._send_query(self, criteria, messages))
+    if options.lazy == true and Set._lazy and
+       (criteria == nil or type(criteria) == 'string') then
+        local set = Set._query({ [self] = criteria or 'ALL' })
+        if messages then set = set * messages end
+        return set
+    end
+
+    return self._send_query(self, criteria, messages) or Set()
 end
 
 function Mailbox.select_all(self)
     return self.send_query(self)
 end
 
+function Mailbox.count_query(self, criteria, messages)
+    return self._count_query(self, criteria, messages)
+end
+
 
 function Mailbox.add_flags(self, flags, messages)
     _check_required(flags, 'table')
@@ -721,10 +1109,17 @@ function Mailbox.move_messages(self, dest, messages)
     _check_required(messages, 'table')
 
     local mesgs = _extract_messages(self, messages)
-    local rc = self._copy_messages(self, dest, mesgs)
-    local rf = false
-    if rc == true then
-        rf = self._flag_messages(self, 'add', { '\\Deleted' }, mesgs)
+    local rc, rf = false, false
+    if self._account == dest._account and
+       self._cached_select(self) == true and
+       self._account._account.readonly ~= true then
+        rc = self._move_messages(self, dest, mesgs)
+        rf = rc
+    else
+        rc = self._copy_messages(self, dest, mesgs)
+        if rc == true then
+            rf = self._flag_messages(self, 'add', { '\\Deleted' }, mesgs)
+        end
     end
     if options.info == true and rc == true and rf == true then
         print(#mesgs .. ' messages moved from ' .. self._string .. ' to ' ..
@@ -783,6 +1178,56 @@ function Mailbox.fetch_parts(self, parts, message)
 end
 
 
+function Mailbox._append_messages(self, messages)
+    if #messages == 0 then return true end
+
+    local r
+    local batch = {}
+    local size = 0
+    for n, m in ipairs(messages) do
+        table.insert(batch, m)
+        size = size + #m[1]
+        if n == #messages or options.batch == 0 or size >= options.batch then
+            self._check_connection(self)
+            r = ifcore.multiappend(self._account._account.session,
+                                   self._mailbox, batch)
+            self._check_result(self, 'append', r)
+            if r == false then return false end
+            batch = {}
+            size = 0
+        end
+    end
+
+    return r
+end
+
+function Mailbox.append_messages(self, messages)
+    _check_required(messages, 'table')
+
+    local t = {}
+    for _, m in ipairs(messages) do
+        _check_required(m, 'table')
+        local message = m[1] or m.message
+        local flags = m[2] or m.flags
+        local date = m[3] or m.date
+        _check_required(message, 'string')
+        _check_optional(flags, { 'string', 'table' })
+        _check_optional(date, 'string')
+
+        if type(flags) == 'table' then flags = table.concat(flags, ' ') end
+        table.insert(t, { message, flags, date })
+    end
+
+    local r = self._append_messages(self, t)
+    if r == false then return false end
+
+    if options.info == true then
+        print('Appended ' .. #t .. ' messages to ' .. self._string .. '.')
+    end
+
+    return true
+end
+
 function Mailbox.append_message(self, message, flags, date)
     _check_required(message, 'string')
     _check_optional(flags, { 'string', 'table' })
@@ -981,14 +1426,9 @@ function Mailbox.match_field(self, field, pattern, messages)
     local mesgs = _extract_messages(self, messages)
     local fields = self._fetch_fields(self, { field }, mesgs)
     if #mesgs == 0 or fields == nil then return Set({}) end
-    local results = {}
-    for m, f in pairs(fields) do
-        if regex_search(pattern, (string.gsub(f, '^[^:]*: ?(.*)$', '%1'))) then
-            table.insert(results, {self, m})
-        end
-    end
+    local results = regex_evaluate({ pattern }, fields, true)
 
-    return Set(results)
+    return Set._from({ [self] = results[1] })
 end
 
 function Mailbox.match_bcc(self, pattern, messages)
@@ -1023,12 +1463,9 @@ function Mailbox.match_header(self, pattern, messages)
     local mesgs = _extract_messages(self, messages)
     local header = self._fetch_header(self, mesgs)
     if #mesgs == 0 or header == nil then return Set({}) end
-    local results = {}
-    for m, h in pairs(header) do
-        if regex_search(pattern, h) then table.insert(results, {self, m}) end
-    end
+    local results = regex_evaluate({ pattern }, header)
 
-    return Set(results)
+    return Set._from({ [self] = results[1] })
 end
 
 function Mailbox.match_body(self, pattern, messages)
@@ -1038,12 +1475,9 @@ function Mailbox.match_body(self, pattern, messages)
     local mesgs = _extract_messages(self, messages)
     local body = self._fetch_body(self, mesgs)
     if #mesgs == 0 or body == nil then return Set({}) end
-    local results = {}
-    for m, b in pairs(body) do
-        if regex_search(pattern, b) then table.insert(results, {self, m}) end
-    end
+    local results = regex_evaluate({ pattern }, body)
 
-    return Set(results)
+    return Set._from({ [self] = results[1] })
 end
 
 function Mailbox.match_message(self, pattern, messages)
@@ -1053,12 +1487,41 @@ function Mailbox.match_message(self, pattern, messages)
     local mesgs = _extract_messages(self, messages)
     local full = self._fetch_message(self, mesgs)
     if #mesgs == 0 or full == nil then return Set({}) end
+    local results = regex_evaluate({ pattern }, full)
+
+    return Set._from({ [self] = results[1] })
+end
+
+function Mailbox.match_rules(self, rules, messages)
+    _check_required(rules, 'table')
+
+    local fields = {}
     local results = {}
-    for m, f in pairs(full) do
-        if regex_search(pattern, f) then table.insert(results, {self, m}) end
+    for id, rule in pairs(rules) do
+        _check_required(rule[1], 'string')
+        _check_required(rule[2], 'string')
+        local f = string.lower(rule[1])
+        if not fields[f] then
+            fields[f] = { name = rule[1], patterns = {}, ids = {} }
+        end
+        table.insert(fields[f].patterns, rule[2])
+        table.insert(fields[f].ids, id)
+        results[id] = Set()
     end
 
-    return Set(results)
+    if not messages then messages = self._send_query(self) end
+    local mesgs = _extract_messages(self, messages)
+    for _, f in pairs(fields) do
+        local values = self._fetch_fields(self, { f.name }, mesgs)
+        if values ~= nil then
+            local uids = regex_evaluate(f.patterns, values, true)
+            for i, id in ipairs(f.ids) do
+                results[id] = Set._from({ [self] = uids[i] })
+            end
+        end
+    end
+
+    return results
 end
 
 
@@ -1083,5 +1546,15 @@ end
 Mailbox.open = _cached_select
 Mailbox.close = _cached_close
 
+-- All the mailboxes share one metatable, that looks up their methods in the
+-- class, and attaches messages for the rest of the keys.
+Mailbox._object_mt = {}
+
+Mailbox._object_mt.__index = function (self, key)
+    local method = rawget(Mailbox, key)
+    if type(method) == 'function' then return method end
+    return Mailbox._attach_message(self, key)
+end
+
 Mailbox._mt.__index = function () end
 Mailbox._mt.__newindex = function () end
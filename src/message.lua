@@ -13,24 +13,8 @@ Message._mt.__call = function (self, account, mailbox, uid)
     object._account = account
     object._mailbox = mailbox
     object._uid = uid
-    object._string = account._account.username .. '@' ..
-                     account._account.server .. '/' .. mailbox._mailbox ..
-                     '[' .. uid .. ']'
-
-    object._structure = nil
-    object._header = nil
-    object._body = nil
-    object._fields = {}
-    object._parts = {}
-    object._size = nil
-    object._date = nil
-
-    for key, value in pairs(Message) do
-        if type(value) == 'function' then object[key] = value end
-    end
 
-    object._mt = {}
-    setmetatable(object, object._mt)
+    setmetatable(object, Message._object_mt)
 
     return object
 end
@@ -127,6 +111,36 @@ function Message.fetch_flags(self)
     return r[self._uid]
 end
 
+function Message.stream_message(self, dest)
+    local r = self._mailbox._stream_part(self._mailbox, '', self._uid, dest)
+    if not r then return end
+    if options.info == true then
+        print('Streamed message ' .. self._string .. '.')
+    end
+    return r
+end
+
+function Message.stream_part(self, part, dest)
+    local r = self._mailbox._stream_part(self._mailbox, part, self._uid, dest)
+    if not r then return end
+    if options.info == true then
+        print('Streamed part "' .. part .. '" of ' .. self._string .. '.')
+    end
+    return r
+end
+
+
+-- All the messages share one metatable, that looks up their methods in the
+-- class, and builds the rest of their state only when it is needed.
+Message._object_mt = {}
+
+Message._object_mt.__index = function (self, key)
+    if key == '_string' then
+        return self._mailbox._string .. '[' .. self._uid .. ']'
+    end
+    local method = rawget(Message, key)
+    if type(method) == 'function' then return method end
+end
 
 Message._mt.__index = function () end
 Message._mt.__newindex = function () end
@@ -1,8 +1,13 @@
 -- Options related to the interface implementation.
 
+options.batch = 16777216
 options.cache = true
+options.cachesize = 33554432
 options.charset = ''
 options.close = false
 options.info = true
+options.lazy = false
 options.limit = 0
+options.persist = false
 options.range = math.huge
+options.spill = 1048576
@@ -10,61 +10,372 @@
 #include <pcre2.h>
 
 #include "imapfilter.h"
+#include "uidset.h"
 
 
+#define JIT_STACK_START	32768	/* Initial size of the JIT matching stack. */
+#define JIT_STACK_MAX	1048576	/* Maximum size of the JIT matching stack. */
+
+#define REGEXSET_FILTER	16	/* Fewest patterns worth a literal prefilter. */
+#define REGEXSET_OUTPUT	0x80000000	/* Transition to a state with output. */
+#define REGEXSET_META	"imapfilter.regexset"	/* Metatable of pattern sets. */
+
+
+/*
+ * Compiled regular expression, along with the resources that are needed to
+ * match it, so that they are reused by all the matches of the pattern.
+ */
+typedef struct regex {
+	pcre2_code *code;		/* Compiled pattern. */
+	pcre2_match_data *data;		/* Substrings of the last match. */
+	pcre2_match_context *context;	/* Context with the JIT stack. */
+	pcre2_jit_stack *stack;		/* Stack for the JIT compiled code. */
+	int jit;			/* Pattern was compiled by the JIT. */
+} regex;
+
+/*
+ * Set of regular expressions that are searched for in a subject at once.  The
+ * longest literal string that each pattern requires is added to an
+ * Aho-Corasick automaton, which finds in a single pass over the subject the
+ * patterns that might match, so that only those need to be tried.
+ */
+typedef struct regexset {
+	regex *single;			/* Each of the patterns on its own. */
+	unsigned char *filtered;	/* Pattern has a required literal. */
+	unsigned char *found;		/* Literal or pattern found in subject. */
+	int *same;			/* Next pattern with the same literal. */
+	unsigned int count;		/* Number of patterns. */
+	unsigned int *next;		/* Transitions, 256 for each state. */
+	int *output;			/* First pattern ending at each state. */
+	unsigned int *dict;		/* Next state with output on failure. */
+	unsigned int states;		/* Number of states of the automaton. */
+	unsigned int size;		/* States that memory is allocated for. */
+} regexset;
+
+
+int regex_compile(regex *re, PCRE2_SPTR pattern, size_t length);
+int regex_match(regex *re, PCRE2_SPTR subject, size_t length);
+void regex_free(regex *re);
+size_t regex_literal(PCRE2_SPTR pattern, size_t length, char *literal);
+unsigned int regexset_state(regexset *rs);
+void regexset_build(regexset *rs);
+void regexset_scan(regexset *rs, const unsigned char *subject, size_t length);
+void regexset_free(regexset *rs);
+
 static int ifre_compile(lua_State *lua);
 static int ifre_exec(lua_State *lua);
 static int ifre_free(lua_State *lua);
+static int ifre_combine(lua_State *lua);
+static int ifre_scan(lua_State *lua);
+static int ifre_evaluate(lua_State *lua);
+static int ifre_gc(lua_State *lua);
 
 /* Lua imapfilter library of PCRE related functions. */
 static const luaL_Reg ifrelib[] = {
 	{ "compile", ifre_compile },
 	{ "exec", ifre_exec },
 	{ "free", ifre_free },
+	{ "combine", ifre_combine },
+	{ "scan", ifre_scan },
+	{ "evaluate", ifre_evaluate },
 	{ NULL, NULL }
 };
 
 
+/*
+ * Compile a regular expression, along with the resources needed to match it.
+ */
+int
+regex_compile(regex *re, PCRE2_SPTR pattern, size_t length)
+{
+	int errornumber;
+	PCRE2_SIZE erroroffset;
+
+	memset(re, 0, sizeof(regex));
+
+	re->code = pcre2_compile(pattern, length, 0, &errornumber,
+	    &erroroffset, NULL);
+
+	if (re->code == NULL) {
+		PCRE2_UCHAR buffer[256];
+		pcre2_get_error_message(errornumber, buffer, sizeof(buffer));
+		fprintf(stderr, "RE failed at offset %d: %s\n",
+		    (int)erroroffset, buffer);
+		return -1;
+	}
+
+	re->data = pcre2_match_data_create_from_pattern(re->code, NULL);
+	re->context = pcre2_match_context_create(NULL);
+
+	/*
+	 * The JIT might not be available on this platform, in which case the
+	 * interpreter is used for matching instead.
+	 */
+	if (pcre2_jit_compile(re->code, PCRE2_JIT_COMPLETE) == 0) {
+		re->stack = pcre2_jit_stack_create(JIT_STACK_START,
+		    JIT_STACK_MAX, NULL);
+		if (re->context != NULL && re->stack != NULL) {
+			pcre2_jit_stack_assign(re->context, NULL, re->stack);
+			re->jit = 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Match a compiled regular expression against a subject.
+ */
+int
+regex_match(regex *re, PCRE2_SPTR subject, size_t length)
+{
+
+	if (re->jit)
+		return pcre2_jit_match(re->code, subject, length, 0, 0,
+		    re->data, re->context);
+	else
+		return pcre2_match(re->code, subject, length, 0, 0, re->data,
+		    re->context);
+}
+
+
+/*
+ * Release the resources of a compiled regular expression.
+ */
+void
+regex_free(regex *re)
+{
+
+	if (re->stack != NULL)
+		pcre2_jit_stack_free(re->stack);
+	if (re->context != NULL)
+		pcre2_match_context_free(re->context);
+	if (re->data != NULL)
+		pcre2_match_data_free(re->data);
+	if (re->code != NULL)
+		pcre2_code_free(re->code);
+	memset(re, 0, sizeof(regex));
+}
+
+
+/*
+ * Find the longest string that any match of a pattern must contain, and store
+ * it in lower case.  Only the top level of the pattern is examined, and no
+ * string is returned when the pattern has alternatives, or options that the
+ * search for the string cannot follow.
+ */
+size_t
+regex_literal(PCRE2_SPTR pattern, size_t length, char *literal)
+{
+	size_t i, j, n, m;
+	int depth;
+	unsigned char c;
+	char *run;
+
+	run = (char *)xmalloc(length + 1);
+	n = m = 0;
+	depth = 0;
+
+	for (i = 0; i <= length; i++) {
+		c = (i < length ? pattern[i] : '\0');
+
+		if (i < length && c == '\\') {
+			if (++i == length || pattern[i] == 'Q')
+				goto bail;
+			c = pattern[i];
+			if (strchr("dDwWsSbBhHvVRXAzZGKE", c) != NULL)
+				c = '\0';
+			else if ((c >= '0' && c <= '9') ||
+			    (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))
+				goto bail;
+			else if (depth == 0) {
+				run[n++] = c;
+				continue;
+			}
+		} else if (i < length && c == '[') {
+			if (i + 1 < length && pattern[i + 1] == '^')
+				i++;
+			if (i + 1 < length && pattern[i + 1] == ']')
+				i++;
+			for (i++; i < length && pattern[i] != ']'; i++)
+				if (pattern[i] == '\\')
+					i++;
+				else if (pattern[i] == '[' && i + 1 < length &&
+				    pattern[i + 1] == ':') {
+					for (i += 2; i + 1 < length &&
+					    (pattern[i] != ':' ||
+					    pattern[i + 1] != ']'); i++);
+					i++;
+				}
+			if (i >= length)
+				goto bail;
+			c = '\0';
+		} else if (i < length && c == '(') {
+			if (i + 1 < length && pattern[i + 1] == '*')
+				goto bail;
+			if (i + 1 < length && pattern[i + 1] == '?')
+				for (j = i + 2; j < length && pattern[j] != ')' &&
+				    pattern[j] != ':'; j++)
+					if (pattern[j] == 'x')
+						goto bail;
+			depth++;
+			c = '\0';
+		} else if (i < length && c == ')') {
+			depth--;
+			c = '\0';
+		} else if (i < length && c == '|' && depth == 0) {
+			goto bail;
+		} else if (i < length && (c == '*' || c == '?' || c == '{')) {
+			if (n > 0)
+				n--;
+			if (c == '{') {
+				while (i + 1 < length &&
+				    strchr("0123456789, ", pattern[i + 1]) !=
+				    NULL && pattern[i + 1] != '\0')
+					i++;
+				if (i + 1 < length && pattern[i + 1] == '}')
+					i++;
+			}
+			c = '\0';
+		} else if (i < length && (c == '+' || c == '.' || c == '^' ||
+		    c == '$')) {
+			c = '\0';
+		}
+
+		if (i < length && c != '\0') {
+			if (depth == 0)
+				run[n++] = (c >= 'A' && c <= 'Z' ? c + 32 : c);
+			continue;
+		}
+
+		if (n > m) {
+			memcpy(literal, run, n);
+			m = n;
+		}
+		n = 0;
+	}
+
+	xfree(run);
+
+	return m;
+bail:
+	xfree(run);
+
+	return 0;
+}
+
+
+/*
+ * Add a new state to the automaton of a set of patterns.
+ */
+unsigned int
+regexset_state(regexset *rs)
+{
+	unsigned int s;
+
+	s = rs->states++;
+
+	if (rs->states > rs->size) {
+		rs->size = (rs->size == 0 ? 64 : rs->size * 2);
+		rs->next = (unsigned int *)xrealloc(rs->next,
+		    rs->size * 256 * sizeof(unsigned int));
+		rs->output = (int *)xrealloc(rs->output,
+		    rs->size * sizeof(int));
+		rs->dict = (unsigned int *)xrealloc(rs->dict,
+		    rs->size * sizeof(unsigned int));
+	}
+
+	memset(rs->next + s * 256, 0, 256 * sizeof(unsigned int));
+	rs->output[s] = -1;
+	rs->dict[s] = 0;
+
+	return s;
+}
+
+
+/*
+ * Turn the trie of the literals of a set of patterns into an automaton, by
+ * following the failure links breadth first, so that scanning a subject takes
+ * a single transition for each character.
+ */
+void
+regexset_build(regexset *rs)
+{
+	unsigned int *fail, *queue;
+	unsigned int r, u, f, c, head, tail;
+
+	fail = (unsigned int *)xmalloc(rs->states * sizeof(unsigned int));
+	queue = (unsigned int *)xmalloc(rs->states * sizeof(unsigned int));
+
+	head = tail = 0;
+	for (c = 0; c < 256; c++)
+		if ((u = rs->next[c]) != 0) {
+			fail[u] = 0;
+			queue[tail++] = u;
+		}
+
+	while (head < tail) {
+		r = queue[head++];
+		for (c = 0; c < 256; c++) {
+			u = rs->next[r * 256 + c];
+			f = rs->next[fail[r] * 256 + c];
+			if (u == 0) {
+				rs->next[r * 256 + c] = f;
+				continue;
+			}
+			fail[u] = f;
+			rs->dict[u] = (rs->output[f] != -1 ? f : rs->dict[f]);
+			queue[tail++] = u;
+		}
+	}
+
+	/*
+	 * Mark the transitions to states where some literal ends, so that the
+	 * scanning can tell them apart without looking any further.
+	 */
+	for (r = 0; r < rs->states; r++)
+		for (c = 0; c < 256; c++) {
+			u = rs->next[r * 256 + c];
+			if (rs->output[u] != -1 || rs->dict[u] != 0)
+				rs->next[r * 256 + c] |= REGEXSET_OUTPUT;
+		}
+
+	xfree(fail);
+	xfree(queue);
+}
+
+
 /*
  * Lua implementation of the PCRE compile function.
  */
 static int
 ifre_compile(lua_State *lua)
 {
-	pcre2_code **re;
+	regex *re;
 	PCRE2_SPTR pattern;
-	int errornumber;
-	PCRE2_SIZE erroroffset;
+	size_t pattern_length;
 
 	if (lua_gettop(lua) != 1)
 		luaL_error(lua, "wrong number of arguments");
 	luaL_checktype(lua, 1, LUA_TSTRING);
 
-	pattern = (PCRE2_SPTR)lua_tostring(lua, 1);
+	pattern = (PCRE2_SPTR)lua_tolstring(lua, 1, &pattern_length);
 
 #if LUA_VERSION_NUM < 504
-	re = (pcre2_code **)(lua_newuserdata(lua, sizeof(pcre2_code *)));
+	re = (regex *)(lua_newuserdata(lua, sizeof(regex)));
 #else
-	re = (pcre2_code **)(lua_newuserdatauv(lua, sizeof(pcre2_code *), 1));
+	re = (regex *)(lua_newuserdatauv(lua, sizeof(regex), 1));
 #endif
-
-	*re = pcre2_compile(pattern, PCRE2_ZERO_TERMINATED, 0, &errornumber,
-	    &erroroffset, NULL);
-
-	if (*re == NULL) {
-		PCRE2_UCHAR buffer[256];
-		pcre2_get_error_message(errornumber, buffer, sizeof(buffer));
-		fprintf(stderr, "RE failed at offset %d: %s\n",
-		    (int)erroroffset, buffer);
+	if (regex_compile(re, pattern, pattern_length) == -1)
 		lua_pop(lua, 1);
-	}
 
 	lua_remove(lua, 1);
 
-	lua_pushboolean(lua, (*re != NULL));
+	lua_pushboolean(lua, (re->code != NULL));
 	lua_insert(lua, 1);
 	
-	return (*re != NULL ? 2 : 1);
+	return (re->code != NULL ? 2 : 1);
 }
 
 
@@ -75,8 +386,7 @@ static int
 ifre_exec(lua_State *lua)
 {
 	int i, rc;
-	pcre2_code *re;
-	pcre2_match_data *match_data;
+	regex *re;
 	PCRE2_SPTR subject;
 	size_t subject_length;
 	PCRE2_SIZE *ovector;
@@ -86,16 +396,15 @@ ifre_exec(lua_State *lua)
 	luaL_checktype(lua, 1, LUA_TUSERDATA);
 	luaL_checktype(lua, 2, LUA_TSTRING);
 
-	re = *(pcre2_code **)(lua_touserdata(lua, 1));
-	subject = (PCRE2_SPTR)lua_tostring(lua, 2);
-	subject_length = strlen((char *)subject);
-
-	match_data = pcre2_match_data_create_from_pattern(re, NULL);
+	re = (regex *)(lua_touserdata(lua, 1));
+	if (re->code == NULL)
+		luaL_error(lua, "regular expression has been freed");
+	subject = (PCRE2_SPTR)lua_tolstring(lua, 2, &subject_length);
 
-	rc = pcre2_match(re, subject, subject_length, 0, 0, match_data, NULL);
+	rc = regex_match(re, subject, subject_length);
 
 	if (rc > 0) {
-		ovector = pcre2_get_ovector_pointer(match_data);
+		ovector = pcre2_get_ovector_pointer(re->data);
 		for (i = 0; i < rc; i++) {
 			if (ovector[2 * i] != PCRE2_UNSET &&
 			    ovector[2 * i + 1] != PCRE2_UNSET) {
@@ -108,8 +417,6 @@ ifre_exec(lua_State *lua)
 		}
 	}
 
-	pcre2_match_data_free(match_data);
-
 	lua_remove(lua, 1);
 	lua_remove(lua, 1);
 
@@ -126,15 +433,15 @@ ifre_exec(lua_State *lua)
 static int
 ifre_free(lua_State *lua)
 {
-	pcre2_code *re;
+	regex *re;
 
 	if (lua_gettop(lua) != 1)
 		luaL_error(lua, "wrong number of arguments");
 	luaL_checktype(lua, 1, LUA_TUSERDATA);
 
-	re = *(pcre2_code **)(lua_touserdata(lua, 1));
+	re = (regex *)(lua_touserdata(lua, 1));
 
-	pcre2_code_free(re);
+	regex_free(re);
 
 	lua_remove(lua, 1);
 
@@ -142,6 +449,271 @@ ifre_free(lua_State *lua)
 }
 
 
+/*
+ * Search for a set of patterns in a subject, and mark those that matched.  The
+ * automaton finds the patterns whose literal the subject contains, and only
+ * those, and the patterns without a literal, are then tried.
+ */
+void
+regexset_scan(regexset *rs, const unsigned char *subject, size_t length)
+{
+	size_t j;
+	unsigned int i, s, t;
+	unsigned char c;
+	int k;
+
+	memset(rs->found, 0, rs->count + 1);
+
+	for (s = 0, j = 0; rs->states > 1 && j < length; j++) {
+		c = subject[j];
+		s = rs->next[s * 256 + (c >= 'A' && c <= 'Z' ? c + 32 : c)];
+		if (!(s & REGEXSET_OUTPUT))
+			continue;
+		s &= ~REGEXSET_OUTPUT;
+		for (t = (rs->output[s] != -1 ? s : rs->dict[s]); t != 0;
+		    t = rs->dict[t])
+			for (k = rs->output[t]; k != -1; k = rs->same[k])
+				rs->found[k] = 1;
+	}
+
+	for (i = 0; i < rs->count; i++)
+		rs->found[i] = (rs->single[i].code != NULL &&
+		    (rs->found[i] || !rs->filtered[i]) &&
+		    regex_match(&rs->single[i], (PCRE2_SPTR)subject, length) >
+		    0);
+}
+
+
+/*
+ * Release the compiled patterns and the automaton of a set of patterns.
+ */
+void
+regexset_free(regexset *rs)
+{
+	unsigned int i;
+
+	if (rs->single != NULL) {
+		for (i = 0; i < rs->count; i++)
+			regex_free(&rs->single[i]);
+		xfree(rs->single);
+	}
+	if (rs->filtered != NULL)
+		xfree(rs->filtered);
+	if (rs->found != NULL)
+		xfree(rs->found);
+	if (rs->same != NULL)
+		xfree(rs->same);
+	if (rs->next != NULL)
+		xfree(rs->next);
+	if (rs->output != NULL)
+		xfree(rs->output);
+	if (rs->dict != NULL)
+		xfree(rs->dict);
+	memset(rs, 0, sizeof(regexset));
+}
+
+
+/*
+ * Lua implementation of a function that compiles a set of patterns, so that
+ * all of them can be searched for in a single pass over a subject.
+ */
+static int
+ifre_combine(lua_State *lua)
+{
+	regexset *rs;
+	PCRE2_SPTR pattern;
+	size_t pattern_length, n, j;
+	unsigned int i, s, t;
+	char *literal;
+
+	if (lua_gettop(lua) != 1)
+		luaL_error(lua, "wrong number of arguments");
+	luaL_checktype(lua, 1, LUA_TTABLE);
+
+#if LUA_VERSION_NUM < 504
+	rs = (regexset *)(lua_newuserdata(lua, sizeof(regexset)));
+#else
+	rs = (regexset *)(lua_newuserdatauv(lua, sizeof(regexset), 1));
+#endif
+	memset(rs, 0, sizeof(regexset));
+	luaL_getmetatable(lua, REGEXSET_META);
+	lua_setmetatable(lua, -2);
+
+#if LUA_VERSION_NUM < 502
+	rs->count = lua_objlen(lua, 1);
+#else
+	rs->count = lua_rawlen(lua, 1);
+#endif
+	rs->single = (regex *)xmalloc((rs->count + 1) * sizeof(regex));
+	memset(rs->single, 0, (rs->count + 1) * sizeof(regex));
+	rs->filtered = (unsigned char *)xmalloc(rs->count + 1);
+	rs->found = (unsigned char *)xmalloc(rs->count + 1);
+	rs->same = (int *)xmalloc((rs->count + 1) * sizeof(int));
+
+	regexset_state(rs);
+
+	for (i = 0; i < rs->count; i++) {
+		lua_rawgeti(lua, 1, i + 1);
+		if (lua_type(lua, -1) != LUA_TSTRING)
+			luaL_error(lua, "string pattern expected");
+		pattern = (PCRE2_SPTR)lua_tolstring(lua, -1, &pattern_length);
+
+		regex_compile(&rs->single[i], pattern, pattern_length);
+
+		literal = (char *)xmalloc(pattern_length + 1);
+		n = (rs->count >= REGEXSET_FILTER ? regex_literal(pattern,
+		    pattern_length, literal) : 0);
+		rs->filtered[i] = (n > 0);
+		rs->same[i] = -1;
+		if (n > 0) {
+			for (s = 0, j = 0; j < n; j++, s = t)
+				if ((t = rs->next[s * 256 +
+				    (unsigned char)literal[j]]) == 0) {
+					t = regexset_state(rs);
+					rs->next[s * 256 +
+					    (unsigned char)literal[j]] = t;
+				}
+			rs->same[i] = rs->output[s];
+			rs->output[s] = i;
+		}
+		xfree(literal);
+
+		lua_pop(lua, 1);
+	}
+
+	regexset_build(rs);
+
+	lua_remove(lua, 1);
+
+	lua_pushboolean(lua, 1);
+	lua_insert(lua, 1);
+
+	return 2;
+}
+
+
+/*
+ * Lua implementation of a function that searches for a set of patterns in a
+ * subject, and returns the indices of the patterns that matched.
+ */
+static int
+ifre_scan(lua_State *lua)
+{
+	regexset *rs;
+	const unsigned char *subject;
+	size_t subject_length;
+	unsigned int i, n;
+
+	if (lua_gettop(lua) != 2)
+		luaL_error(lua, "wrong number of arguments");
+	rs = (regexset *)(luaL_checkudata(lua, 1, REGEXSET_META));
+	luaL_checktype(lua, 2, LUA_TSTRING);
+
+	subject = (const unsigned char *)lua_tolstring(lua, 2,
+	    &subject_length);
+
+	regexset_scan(rs, subject, subject_length);
+
+	lua_newtable(lua);
+	for (i = 0, n = 0; i < rs->count; i++)
+		if (rs->found[i]) {
+			lua_pushinteger(lua, (lua_Integer)(i + 1));
+			lua_rawseti(lua, -2, ++n);
+		}
+
+	lua_remove(lua, 1);
+	lua_remove(lua, 1);
+
+	return 1;
+}
+
+
+/*
+ * Lua implementation of a function that searches for a set of patterns in a
+ * batch of subjects, indexed by the UIDs of their messages, and returns for
+ * each of the patterns the set of UIDs of the subjects that matched.  The
+ * subjects can optionally be header fields, in which case the name of the
+ * field is skipped.
+ */
+static int
+ifre_evaluate(lua_State *lua)
+{
+	regexset *rs;
+	uidset **sets;
+	const unsigned char *subject, *c;
+	size_t subject_length;
+	unsigned int i, u;
+	int n, field;
+
+	n = lua_gettop(lua);
+	if (n != 2 && n != 3)
+		luaL_error(lua, "wrong number of arguments");
+	rs = (regexset *)(luaL_checkudata(lua, 1, REGEXSET_META));
+	luaL_checktype(lua, 2, LUA_TTABLE);
+	if (n == 3)
+		luaL_checktype(lua, 3, LUA_TBOOLEAN);
+
+	field = (n == 3 && lua_toboolean(lua, 3));
+
+	lua_newtable(lua);
+	sets = (uidset **)xmalloc((rs->count + 1) * sizeof(uidset *));
+	for (i = 0; i < rs->count; i++) {
+		sets[i] = uidset_push(lua);
+		lua_rawseti(lua, -2, i + 1);
+	}
+
+	lua_pushnil(lua);
+	while (lua_next(lua, 2) != 0) {
+		if (lua_type(lua, -2) == LUA_TNUMBER &&
+		    lua_type(lua, -1) == LUA_TSTRING) {
+			u = (unsigned int)(lua_tonumber(lua, -2));
+			subject = (const unsigned char *)lua_tolstring(lua, -1,
+			    &subject_length);
+			if (field && (c = memchr(subject, ':',
+			    subject_length)) != NULL) {
+				if (++c < subject + subject_length && *c == ' ')
+					c++;
+				subject_length -= c - subject;
+				subject = c;
+			}
+
+			regexset_scan(rs, subject, subject_length);
+			for (i = 0; i < rs->count; i++)
+				if (rs->found[i])
+					uidset_add(sets[i], u, u);
+		}
+		lua_pop(lua, 1);
+	}
+
+	for (i = 0; i < rs->count; i++)
+		uidset_normalize(sets[i]);
+	xfree(sets);
+
+	for (; n > 0; n--)
+		lua_remove(lua, 1);
+
+	return 1;
+}
+
+
+/*
+ * Release the resources of a set of patterns when it is garbage collected.
+ */
+static int
+ifre_gc(lua_State *lua)
+{
+	regexset *rs;
+
+	rs = (regexset *)(luaL_checkudata(lua, 1, REGEXSET_META));
+
+	regexset_free(rs);
+
+	lua_pop(lua, 1);
+
+	return 0;
+}
+
+
 /*
  * Open imapfilter library of PCRE related functions.
  */
@@ -149,6 +721,11 @@ LUALIB_API int
 luaopen_ifre(lua_State *lua)
 {
 
+	luaL_newmetatable(lua, REGEXSET_META);
+	lua_pushcfunction(lua, ifre_gc);
+	lua_setfield(lua, -2, "__gc");
+	lua_pop(lua, 1);
+
 #if LUA_VERSION_NUM < 502
 	luaL_register(lua, "ifre", ifrelib);
 #else
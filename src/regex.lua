@@ -1,4 +1,5 @@
--- A simple wrapper for PCRE that uses a cache for compiled expressions.
+-- A simple wrapper for PCRE that uses a cache for compiled expressions, which
+-- also keep the resources needed to match them.
 
 _regex_cache = {}
 
@@ -22,3 +23,57 @@ function regex_search(pattern, subject)
     if compiled == nil then return nil end
     return ifre.exec(compiled, subject)
 end
+
+-- Sets of patterns are compiled together, so that all of them are searched
+-- for in a single pass over the subject.  They are cached both by the table of
+-- patterns, which is cheap to look up, and by the patterns themselves, for as
+-- long as any table of the same patterns is still in use.
+_regex_set_cache = {}
+
+_regex_set_cache.mt = { __mode = 'k' }
+setmetatable(_regex_set_cache, _regex_set_cache.mt)
+
+_regex_set_shared = {}
+
+_regex_set_shared.mt = { __mode = 'v' }
+setmetatable(_regex_set_shared, _regex_set_shared.mt)
+
+
+function _regex_set(patterns)
+    local compiled = _regex_set_cache[patterns]
+    if compiled == nil then
+        local key = {}
+        for _, p in ipairs(patterns) do table.insert(key, #p .. ':' .. p) end
+        key = table.concat(key)
+
+        compiled = _regex_set_shared[key]
+        if compiled == nil then
+            local r
+            r, compiled = ifre.combine(patterns)
+            if not r then return end
+            _regex_set_shared[key] = compiled
+        end
+        _regex_set_cache[patterns] = compiled
+    end
+    return compiled
+end
+
+
+function regex_scan(patterns, subject)
+    _check_required(patterns, 'table')
+    _check_required(subject, 'string')
+
+    local compiled = _regex_set(patterns)
+    if compiled == nil then return {} end
+    return ifre.scan(compiled, subject)
+end
+
+function regex_evaluate(patterns, subjects, field)
+    _check_required(patterns, 'table')
+    _check_required(subjects, 'table')
+    _check_optional(field, 'boolean')
+
+    local compiled = _regex_set(patterns)
+    if compiled == nil then return {} end
+    return ifre.evaluate(compiled, subjects, field == true)
+end
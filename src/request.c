@@ -7,6 +7,7 @@
 #include "imapfilter.h"
 #include "session.h"
 #include "buffer.h"
+#include "fetch.h"
 
 
 extern options opts;
@@ -16,9 +17,32 @@ buffer obuf;			/* Output buffer. */
 static int tag = 0x1000;	/* Every IMAP command is prefixed with a
 				 * unique [:alnum:] string. */
 
+#define PIPELINE_MAX	64	/* Maximum number of pipelined commands. */
+#define LITERALMINUS_MAX 4096	/* Largest non-synchronizing literal allowed
+				 * by LITERAL-. */
+
 
 int send_request(session *ssn, const char *fmt,...);
 int send_continuation(session *ssn, const char *data, size_t len);
+int send_continuation_file(session *ssn, FILE *fp, size_t len);
+int send_pipeline(session *ssn, const char *cmd, const char **mesgs, const
+    char *args);
+
+int send_copy(session *ssn, const char *cmd, const char **mesgs, const char
+    *mbox);
+int send_expunge(session *ssn, const char **mesgs);
+
+int send_search(session *ssn, const char *criteria, const char *charset, const
+    char *results);
+
+int send_append(session *ssn, const char *mbox, const char *mesg, FILE *fp,
+    size_t mesglen, const char *flags, const char *date);
+int send_multiappend(session *ssn, const char *mbox, const appenditem *items,
+    size_t n);
+int send_append_pipeline(session *ssn, const char *mbox, const appenditem
+    *items, size_t n);
+char *append_args(session *ssn, const appenditem *item);
+int append_nonsync(session *ssn, size_t len);
 
 int handle_error(session *ssn);
 
@@ -38,18 +62,30 @@ send_request(session *ssn, const char *fmt,...)
 	va_list args;
 	int t = tag;
 
+	if (ssn->suspend.repeat) {	/* Sent before it was suspended. */
+		ssn->suspend.repeat = 0;
+		t = ssn->suspend.tag;
+		ssn->suspend.tag = 0;
+		if (ssn->suspend.held.len > 0) {
+			session_pushback(ssn, ssn->suspend.held.data,
+			    ssn->suspend.held.len);
+			ssn->suspend.held.len = 0;
+		}
+		return t;
+	}
+
 	if (ssn->socket == -1)
 		return STATUS_ERROR;
 
 	buffer_reset(&obuf);
-	obuf.len = snprintf(obuf.data, obuf.size + 1, "%04X ", tag);
+	obuf.len = snprintf(obuf.data, obuf.size + 1, "%08X ", tag);
 
 	va_start(args, fmt);
 	n = vsnprintf(obuf.data + obuf.len, obuf.size - obuf.len -
 	    strlen("\r\n") + 1, fmt, args);
 	va_end(args);
-	if (n > (int)obuf.size) {
-		buffer_check(&obuf, n);
+	if (n > (int)(obuf.size - obuf.len - strlen("\r\n"))) {
+		buffer_check(&obuf, obuf.len + n + strlen("\r\n"));
 		va_start(args, fmt);
 		vsnprintf(obuf.data + obuf.len, obuf.size - obuf.len -
 		    strlen("\r\n") + 1, fmt, args);
@@ -69,7 +105,9 @@ send_request(session *ssn, const char *fmt,...)
 	if (socket_write(ssn, obuf.data, obuf.len) == -1)
 		return STATUS_ERROR;
 
-	if (tag == 0xFFFF)	/* Tag always between 0x1000 and 0xFFFF. */
+	session_track(ssn, t);
+
+	if (tag == 0x7FFFFFFF)	/* Tag always between 0x1000 and 0x7FFFFFFF. */
 		tag = 0x0FFF;
 	tag++;
 
@@ -107,11 +145,93 @@ send_continuation(session *ssn, const char *data, size_t len)
 
 
 /*
- * Cleanup on failures.
+ * Sends a response to a command continuation request, reading the data from
+ * a file in pieces, so that they need not be kept in memory.
+ */
+int
+send_continuation_file(session *ssn, FILE *fp, size_t len)
+{
+	char b[OUTPUT_BUF * 16];
+	size_t n;
+
+	if (ssn->socket == -1)
+		return STATUS_ERROR;
+
+	if (opts.debug)
+		debug("sending continuation data (%d): %lu bytes from file\n\n",
+		    ssn->socket, (unsigned long)(len));
+
+	while (len > 0) {
+		n = fread(b, sizeof(char), (len < sizeof(b) ? len : sizeof(b)),
+		    fp);
+		if (n == 0)
+			return STATUS_ERROR;
+		if (socket_write(ssn, b, n) == -1)
+			return STATUS_ERROR;
+		len -= n;
+	}
+
+	if (socket_write(ssn, "\r\n", strlen("\r\n")) == -1)
+		return STATUS_ERROR;
+
+	return 0;
+}
+
+
+/*
+ * Sends the same command for each of the message sets, without waiting for
+ * the server to complete the previous one, but keeping no more than the
+ * configured number of commands in flight.  Once a command does not succeed,
+ * no more commands are sent, but those already in flight are completed.
+ * Returns the status of the first command that did not succeed, if any.
+ */
+int
+send_pipeline(session *ssn, const char *cmd, const char **mesgs, const char
+    *args)
+{
+	int t[PIPELINE_MAX], r, s;
+	size_t d, i, j;
+
+	d = (size_t)(get_option_number("pipeline"));
+	if (d < 1)
+		d = 1;
+	else if (d > PIPELINE_MAX)
+		d = PIPELINE_MAX;
+
+	r = STATUS_OK;
+	for (i = j = 0; mesgs[j] != NULL; j++) {
+		if (j - i == d) {
+			if ((s = response_generic(ssn, t[i++ % d])) < 0)
+				return s;
+			if ((r = s) != STATUS_OK)
+				break;
+		}
+		if ((t[j % d] = send_request(ssn, "%s %s%s", cmd, mesgs[j],
+		    args)) < 0)
+			return STATUS_ERROR;
+	}
+	while (i < j) {
+		if ((s = response_generic(ssn, t[i++ % d])) < 0)
+			return s;
+		if (r == STATUS_OK)
+			r = s;
+	}
+
+	return r;
+}
+
+
+/*
+ * Cleanup on failures.  A command suspended while waiting for its response
+ * has not failed, and the request is to be repeated later to complete it;
+ * a response set aside means another command was sent since, and it failed.
  */
 int
 handle_error(session *ssn)
 {
+	if (ssn->suspend.tag != 0 && ssn->suspend.held.len == 0)
+		return STATUS_SUSPEND;
+
 	session_destroy(ssn);
 	return STATUS_ERROR;
 }
@@ -141,6 +261,7 @@ request_login(session **ssnptr, const char *server, const char *port, const char
     const char *username, const char *password, const char *oauth2)
 {
 	int t, r, rg = -1, rl = -1;
+	unsigned int e;
 	session *ssn = *ssnptr;
 
 	if (ssn && ssn->socket != -1)
@@ -222,6 +343,23 @@ request_login(session **ssnptr, const char *server, const char *port, const char
 		}
 	}
 
+	if (ssn->capabilities & CAPABILITY_COMPRESS &&
+	    get_option_boolean("compress")) {
+		TRY(t = send_request(ssn, "COMPRESS DEFLATE"));
+		TRY(r = response_generic(ssn, t));
+		if (r == STATUS_OK)
+			TRY(compress_start(ssn));
+	}
+
+	if (ssn->capabilities & CAPABILITY_ENABLE &&
+	    ssn->capabilities & CAPABILITY_CONDSTORE &&
+	    ssn->capabilities & CAPABILITY_QRESYNC) {
+		TRY(t = send_request(ssn, "ENABLE CONDSTORE QRESYNC"));
+		TRY(r = response_enable(ssn, t, &e));
+		if (r == STATUS_OK && e & CAPABILITY_QRESYNC)
+			ssn->qresync = 1;
+	}
+
 	if (ssn->capabilities & CAPABILITY_NAMESPACE &&
 	    get_option_boolean("namespace")) {
 		TRY(t = send_request(ssn, "NAMESPACE"));
@@ -277,18 +415,56 @@ request_status(session *ssn, const char *mbox, unsigned int *exists, unsigned
 
 
 /*
- * Open mailbox in read-write mode.
+ * Open mailbox in read-write mode.  If QRESYNC is enabled and the UIDVALIDITY
+ * and modification sequence of a previous synchronization are supplied, the
+ * server also reports the messages known to the client that were expunged and
+ * the messages whose flags changed since then.
  */
 int
-request_select(session *ssn, const char *mbox)
+request_select(session *ssn, const char *mbox, unsigned int *uidvalidity,
+    unsigned long long *modseq, const char *known, char **vanished,
+    fetchlist *fl)
 {
 	int t, r;
 	const char *m;
 
 	m = apply_namespace(mbox, ssn);
 
-	TRY(t = send_request(ssn, "SELECT \"%s\"", m));
-	TRY(r = response_select(ssn, t));
+	if (ssn->qresync && *uidvalidity != 0 && *modseq != 0) {
+		if (known != NULL && *known != '\0') {
+			TRY(t = send_request(ssn, "SELECT \"%s\" (QRESYNC "
+			    "(%u %llu %s))", m, *uidvalidity, *modseq, known));
+		} else {
+			TRY(t = send_request(ssn, "SELECT \"%s\" (QRESYNC "
+			    "(%u %llu))", m, *uidvalidity, *modseq));
+		}
+	} else {
+		TRY(t = send_request(ssn, "SELECT \"%s\"", m));
+	}
+	TRY(r = response_select(ssn, t, uidvalidity, modseq, vanished, fl));
+
+	return r;
+}
+
+
+/*
+ * Get the flags of the messages of the selected mailbox that changed, and the
+ * messages that were expunged, since the specified modification sequence.
+ */
+int
+request_changes(session *ssn, unsigned long long *modseq, char **vanished,
+    fetchlist *fl)
+{
+	int t, r;
+
+	if (*modseq == 0) {
+		TRY(t = send_request(ssn, "UID FETCH 1:* (FLAGS) "
+		    "(CHANGEDSINCE 0)"));
+	} else {
+		TRY(t = send_request(ssn, "UID FETCH 1:* (FLAGS) "
+		    "(CHANGEDSINCE %llu VANISHED)", *modseq));
+	}
+	TRY(r = response_changes(ssn, t, modseq, vanished, fl));
 
 	return r;
 }
@@ -366,37 +542,75 @@ request_lsub(session *ssn, const char *refer, const char *name, char **mboxs,
 
 
 /*
- * Search selected mailbox according to the supplied search criteria.
+ * Send a search command for the supplied search criteria, asking the server
+ * to return the specified results, if it supports ESEARCH.
  */
 int
-request_search(session *ssn, const char *criteria, const char *charset, char
-    **mesgs)
+send_search(session *ssn, const char *criteria, const char *charset, const
+    char *results)
 {
-	int t, r;
+	int t;
+	const char *r;
+
+	r = "";
+	if (ssn->capabilities & CAPABILITY_ESEARCH)
+		r = results;
 
 	if (charset != NULL && *charset != '\0' && !ssn->utf8) {
-		TRY(t = send_request(ssn, "UID SEARCH CHARSET \"%s\" %s",
+		TRY(t = send_request(ssn, "UID SEARCH %sCHARSET \"%s\" %s", r,
 		    charset, criteria));
 	} else {
-		TRY(t = send_request(ssn, "UID SEARCH %s", criteria));
+		TRY(t = send_request(ssn, "UID SEARCH %s%s", r, criteria));
 	}
+
+	return t;
+}
+
+
+/*
+ * Search selected mailbox according to the supplied search criteria.
+ */
+int
+request_search(session *ssn, const char *criteria, const char *charset, char
+    **mesgs)
+{
+	int t, r;
+
+	TRY(t = send_search(ssn, criteria, charset, "RETURN (ALL) "));
 	TRY(r = response_search(ssn, t, mesgs));
 
 	return r;
 }
 
 
+/*
+ * Count the messages that match the supplied search criteria, and find the
+ * lowest and highest of their UIDs.
+ */
+int
+request_searchcount(session *ssn, const char *criteria, const char *charset,
+    unsigned long *count, unsigned long *min, unsigned long *max)
+{
+	int t, r;
+
+	TRY(t = send_search(ssn, criteria, charset,
+	    "RETURN (COUNT MIN MAX) "));
+	TRY(r = response_searchcount(ssn, t, count, min, max));
+
+	return r;
+}
+
+
 /*
  * Fetch the FLAGS, INTERNALDATE and RFC822.SIZE of the messages.
  */
 int
-request_fetchfast(session *ssn, const char *mesg, char **flags, char **date,
-    char **size)
+request_fetchfast(session *ssn, const char *mesg, fetchlist *fl)
 {
 	int t, r;
 
 	TRY(t = send_request(ssn, "UID FETCH %s (FLAGS INTERNALDATE RFC822.SIZE)", mesg));
-	TRY(r = response_fetchfast(ssn, t, flags, date, size));
+	TRY(r = response_fetch(ssn, t, fl));
 
 	return r;
 }
@@ -406,12 +620,12 @@ request_fetchfast(session *ssn, const char *mesg, char **flags, char **date,
  * Fetch the FLAGS of the messages.
  */
 int
-request_fetchflags(session *ssn, const char *mesg, char **flags)
+request_fetchflags(session *ssn, const char *mesg, fetchlist *fl)
 {
 	int t, r;
 
 	TRY(t = send_request(ssn, "UID FETCH %s FLAGS", mesg));
-	TRY(r = response_fetchflags(ssn, t, flags));
+	TRY(r = response_fetch(ssn, t, fl));
 
 	return r;
 }
@@ -421,12 +635,12 @@ request_fetchflags(session *ssn, const char *mesg, char **flags)
  * Fetch the INTERNALDATE of the messages.
  */
 int
-request_fetchdate(session *ssn, const char *mesg, char **date)
+request_fetchdate(session *ssn, const char *mesg, fetchlist *fl)
 {
 	int t, r;
 
 	TRY(t = send_request(ssn, "UID FETCH %s INTERNALDATE", mesg));
-	TRY(r = response_fetchdate(ssn, t, date));
+	TRY(r = response_fetch(ssn, t, fl));
 
 	return r;
 }
@@ -434,12 +648,12 @@ request_fetchdate(session *ssn, const char *mesg, char **date)
  * Fetch the RFC822.SIZE of the messages.
  */
 int
-request_fetchsize(session *ssn, const char *mesg, char **size)
+request_fetchsize(session *ssn, const char *mesg, fetchlist *fl)
 {
 	int t, r;
 
 	TRY(t = send_request(ssn, "UID FETCH %s RFC822.SIZE", mesg));
-	TRY(r = response_fetchsize(ssn, t, size));
+	TRY(r = response_fetch(ssn, t, fl));
 
 	return r;
 }
@@ -449,12 +663,12 @@ request_fetchsize(session *ssn, const char *mesg, char **size)
  * Fetch the body structure, ie. BODYSTRUCTURE, of the messages.
  */
 int
-request_fetchstructure(session *ssn, const char *mesg, char **structure)
+request_fetchstructure(session *ssn, const char *mesg, fetchlist *fl)
 {
 	int t, r;
 
 	TRY(t = send_request(ssn, "UID FETCH %s BODYSTRUCTURE", mesg));
-	TRY(r = response_fetchstructure(ssn, t, structure));
+	TRY(r = response_fetch(ssn, t, fl));
 
 	return r;
 }
@@ -464,12 +678,12 @@ request_fetchstructure(session *ssn, const char *mesg, char **structure)
  * Fetch the header, ie. BODY[HEADER], of the messages.
  */
 int
-request_fetchheader(session *ssn, const char *mesg, char **header, size_t *len)
+request_fetchheader(session *ssn, const char *mesg, fetchlist *fl)
 {
 	int t, r;
 
 	TRY(t = send_request(ssn, "UID FETCH %s BODY.PEEK[HEADER]", mesg));
-	TRY(r = response_fetchbody(ssn, t, header, len));
+	TRY(r = response_fetch(ssn, t, fl));
 
 	return r;
 }
@@ -479,12 +693,12 @@ request_fetchheader(session *ssn, const char *mesg, char **header, size_t *len)
  * Fetch the text, ie. BODY[TEXT], of the messages.
  */
 int
-request_fetchtext(session *ssn, const char *mesg, char **text, size_t *len)
+request_fetchtext(session *ssn, const char *mesg, fetchlist *fl)
 {
 	int t, r;
 
 	TRY(t = send_request(ssn, "UID FETCH %s BODY.PEEK[TEXT]", mesg));
-	TRY(r = response_fetchbody(ssn, t, text, len));
+	TRY(r = response_fetch(ssn, t, fl));
 
 	return r;
 }
@@ -496,7 +710,7 @@ request_fetchtext(session *ssn, const char *mesg, char **text, size_t *len)
  */
 int
 request_fetchfields(session *ssn, const char *mesg, const char *headerfields,
-    char **fields, size_t *len)
+    fetchlist *fl)
 {
 	int t, r;
 
@@ -509,7 +723,7 @@ request_fetchfields(session *ssn, const char *mesg, const char *headerfields,
 		    headerfields, ")]");
 		TRY(t = send_request(ssn, "UID FETCH %s %s", mesg, f));
 	}
-	TRY(r = response_fetchbody(ssn, t, fields, len));
+	TRY(r = response_fetch(ssn, t, fl));
 
 	return r;
 }
@@ -520,8 +734,8 @@ request_fetchfields(session *ssn, const char *mesg, const char *headerfields,
  * messages.
  */
 int
-request_fetchpart(session *ssn, const char *mesg, const char *part, char
-    **bodypart, size_t *len)
+request_fetchpart(session *ssn, const char *mesg, const char *part,
+    fetchlist *fl)
 {
 	int t, r;
 
@@ -532,7 +746,36 @@ request_fetchpart(session *ssn, const char *mesg, const char *part, char
 		snprintf(f, n, "%s%s%s", "BODY.PEEK[", part, "]");
 		TRY(t = send_request(ssn, "UID FETCH %s %s", mesg, f));
 	}
-	TRY(r = response_fetchbody(ssn, t, bodypart, len));
+	TRY(r = response_fetch(ssn, t, fl));
+
+	return r;
+}
+
+
+/*
+ * Start fetching the messages without waiting for the server to respond, and
+ * return the tag of the command, so that the response can be collected later.
+ */
+int
+request_fetchahead(session *ssn, const char *mesg)
+{
+	int t;
+
+	TRY(t = send_request(ssn, "UID FETCH %s BODY.PEEK[]", mesg));
+
+	return t;
+}
+
+
+/*
+ * Collect the messages requested by a previous fetch.
+ */
+int
+request_fetchcollect(session *ssn, int tag, fetchlist *fl)
+{
+	int r;
+
+	TRY(r = response_fetch(ssn, tag, fl));
 
 	return r;
 }
@@ -542,34 +785,362 @@ request_fetchpart(session *ssn, const char *mesg, const char *part, char
  * Add, remove or replace the specified flags of the messages.
  */
 int
-request_store(session *ssn, const char *mesg, const char *mode, const char
+request_store(session *ssn, const char **mesgs, const char *mode, const char
     *flags)
+{
+	int r;
+	char *a;
+
+	if (opts.dryrun)
+		return STATUS_DRYRUN;
+
+	a = (char *)xmalloc(strlen(" +FLAGS.SILENT ()") + strlen(flags) + 1);
+	sprintf(a, " %sFLAGS.SILENT (%s)", (!strncasecmp(mode, "add", 3) ? "+" :
+	    !strncasecmp(mode, "remove", 6) ? "-" : ""), flags);
+	r = send_pipeline(ssn, "UID STORE", mesgs, a);
+	xfree(a);
+	TRY(r);
+
+	if (r == STATUS_OK && xstrcasestr(flags, "\\Deleted") &&
+	    get_option_boolean("expunge"))
+		TRY(r = send_expunge(ssn, mesgs));
+
+	return r;
+}
+
+
+/*
+ * Expunge the specified messages.  Without UIDPLUS the only way to do this is
+ * to expunge all the messages of the mailbox that are marked deleted.
+ */
+int
+send_expunge(session *ssn, const char **mesgs)
+{
+	int t, r;
+
+	if (ssn->capabilities & CAPABILITY_UIDPLUS)
+		return send_pipeline(ssn, "UID EXPUNGE", mesgs, "");
+
+	if ((t = send_request(ssn, "EXPUNGE")) < 0)
+		return t;
+	if ((r = response_generic(ssn, t)) < 0)
+		return r;
+
+	return r;
+}
+
+
+/*
+ * Copy or move the specified messages to another mailbox.  The first set of
+ * messages is copied on its own, so that the mailbox is created if needed, and
+ * the rest are pipelined.
+ */
+int
+send_copy(session *ssn, const char *cmd, const char **mesgs, const char *mbox)
 {
 	int t, r;
+	const char *m;
+	char *a;
+
+	if (mesgs[0] == NULL)
+		return STATUS_OK;
+
+	m = apply_namespace(mbox, ssn);
+
+	if ((t = send_request(ssn, "%s %s \"%s\"", cmd, mesgs[0], m)) < 0)
+		return t;
+	if ((r = response_generic(ssn, t)) < 0)
+		return r;
+
+	if (r == STATUS_TRYCREATE) {
+		if ((t = send_request(ssn, "CREATE \"%s\"", m)) < 0 ||
+		    (r = response_generic(ssn, t)) < 0)
+			return -1;
+
+		if (get_option_boolean("subscribe")) {
+			if ((t = send_request(ssn, "SUBSCRIBE \"%s\"", m)) < 0 ||
+			    (r = response_generic(ssn, t)) < 0)
+				return -1;
+		}
+		if ((t = send_request(ssn, "%s %s \"%s\"", cmd, mesgs[0],
+		    m)) < 0)
+			return t;
+		if ((r = response_generic(ssn, t)) < 0)
+			return r;
+	}
+
+	if (r != STATUS_OK || mesgs[1] == NULL)
+		return r;
+
+	a = (char *)xmalloc(strlen(" \"\"") + strlen(m) + 1);
+	sprintf(a, " \"%s\"", m);
+	r = send_pipeline(ssn, cmd, mesgs + 1, a);
+	xfree(a);
+
+	return r;
+}
+
+
+/*
+ * Copy the specified messages to another mailbox.
+ */
+int
+request_copy(session *ssn, const char **mesgs, const char *mbox)
+{
+	int r;
 
 	if (opts.dryrun)
 		return STATUS_DRYRUN;
 
-	TRY(t = send_request(ssn, "UID STORE %s %sFLAGS.SILENT (%s)", mesg,
-	    (!strncasecmp(mode, "add", 3) ? "+" :
-	    !strncasecmp(mode, "remove", 6) ? "-" : ""), flags));
-	TRY(r = response_generic(ssn, t));
+	TRY(r = send_copy(ssn, "UID COPY", mesgs, mbox));
+
+	return r;
+}
+
+
+/*
+ * Move the specified messages to another mailbox.  If the server does not
+ * support MOVE, or the messages are not to be expunged immediately, they are
+ * copied and then marked deleted.
+ */
+int
+request_move(session *ssn, const char **mesgs, const char *mbox)
+{
+	int r;
+
+	if (opts.dryrun)
+		return STATUS_DRYRUN;
+
+	if (ssn->capabilities & CAPABILITY_MOVE &&
+	    get_option_boolean("expunge")) {
+		TRY(r = send_copy(ssn, "UID MOVE", mesgs, mbox));
+		return r;
+	}
+
+	TRY(r = send_copy(ssn, "UID COPY", mesgs, mbox));
+	if (r != STATUS_OK)
+		return r;
+
+	return request_store(ssn, mesgs, "add", "\\Deleted");
+}
+
+
+/*
+ * Send an APPEND command and the message, taken either from memory or from a
+ * file, that is to be appended to the mailbox.  If the server accepts
+ * non-synchronizing literals the message is sent right after the command,
+ * without waiting for a command continuation request.
+ */
+int
+send_append(session *ssn, const char *mbox, const char *mesg, FILE *fp,
+    size_t mesglen, const char *flags, const char *date)
+{
+	int t, r, l;
+	char *a;
+	appenditem it;
+
+	if (fp != NULL && fseek(fp, 0L, SEEK_SET) == -1)
+		return STATUS_ERROR;
+
+	it.mesg = mesg;
+	it.len = mesglen;
+	it.flags = flags;
+	it.date = date;
+
+	l = append_nonsync(ssn, mesglen);
 
-	if (xstrcasestr(flags, "\\Deleted") && get_option_boolean("expunge")) {
-		TRY(t = send_request(ssn, "EXPUNGE"));
+	a = append_args(ssn, &it);
+	t = send_request(ssn, "APPEND \"%s\"%s", mbox, a);
+	xfree(a);
+	TRY(t);
+	if (l) {
+		r = STATUS_CONTINUE;
+	} else {
+		TRY(r = response_continuation(ssn, t));
+	}
+
+	if (r == STATUS_CONTINUE) {
+		if (fp != NULL) {
+			TRY(r = send_continuation_file(ssn, fp, mesglen));
+		} else {
+			TRY(r = send_continuation(ssn, mesg, mesglen));
+		}
 		TRY(r = response_generic(ssn, t));
 	}
 
+	return r;
+}
+
+
+/*
+ * Send a single APPEND command that carries all the supplied messages, as
+ * specified by MULTIAPPEND.  Either all of them are appended or none.
+ */
+int
+send_multiappend(session *ssn, const char *mbox, const appenditem *items,
+    size_t n)
+{
+	int t, r;
+	size_t i;
+	char *a;
+
+	a = append_args(ssn, &items[0]);
+	t = send_request(ssn, "APPEND \"%s\"%s", mbox, a);
+	xfree(a);
+	TRY(t);
+
+	for (i = 0; i < n; i++) {
+		if (!append_nonsync(ssn, items[i].len)) {
+			TRY(r = response_continuation(ssn, t));
+			if (r != STATUS_CONTINUE)
+				return r;
+		}
+
+		debug("sending continuation data (%d): %lu bytes\n\n",
+		    ssn->socket, (unsigned long)(items[i].len));
+
+		TRY(socket_write(ssn, items[i].mesg, items[i].len));
+		if (i + 1 < n) {
+			a = append_args(ssn, &items[i + 1]);
+			verbose("C (%d):%s\r\n", ssn->socket, a);
+			r = socket_write(ssn, a, strlen(a));
+			xfree(a);
+			TRY(r);
+		}
+		TRY(socket_write(ssn, "\r\n", strlen("\r\n")));
+	}
+
+	TRY(r = response_generic(ssn, t));
 
 	return r;
 }
 
 
 /*
- * Copy the specified messages to another mailbox.
+ * Send an APPEND command for each of the supplied messages, without waiting
+ * for the server to complete the previous one, but keeping no more than the
+ * configured number of commands in flight.  Unless the server accepts
+ * non-synchronizing literals, each message is still sent only after the
+ * server has asked for it.  Once a command does not succeed, no more messages
+ * are appended, but the commands already in flight are completed.  Returns
+ * the status of the first command that did not succeed, if any.
  */
 int
-request_copy(session *ssn, const char *mesg, const char *mbox)
+send_append_pipeline(session *ssn, const char *mbox, const appenditem *items,
+    size_t n)
+{
+	int t[PIPELINE_MAX], r, s;
+	size_t d, i, j;
+	char *a;
+
+	d = (size_t)(get_option_number("pipeline"));
+	if (d < 1)
+		d = 1;
+	else if (d > PIPELINE_MAX)
+		d = PIPELINE_MAX;
+
+	r = STATUS_OK;
+	for (i = j = 0; j < n && r == STATUS_OK; j++) {
+		if (j - i == d) {
+			if (t[i % d] != -1) {
+				if ((s = response_generic(ssn, t[i % d])) < 0)
+					return s;
+				r = s;
+			}
+			i++;
+			if (r != STATUS_OK)
+				break;
+		}
+
+		a = append_args(ssn, &items[j]);
+		t[j % d] = send_request(ssn, "APPEND \"%s\"%s", mbox, a);
+		xfree(a);
+		if (t[j % d] < 0)
+			return STATUS_ERROR;
+
+		if (!append_nonsync(ssn, items[j].len)) {
+			if ((s = response_continuation(ssn, t[j % d])) < 0)
+				return s;
+			if (s != STATUS_CONTINUE) {
+				t[j % d] = -1;
+				if (r == STATUS_OK)
+					r = s;
+				continue;
+			}
+		}
+
+		if (send_continuation(ssn, items[j].mesg, items[j].len) < 0)
+			return STATUS_ERROR;
+	}
+	for (; i < j; i++) {
+		if (t[i % d] == -1)
+			continue;
+		if ((s = response_generic(ssn, t[i % d])) < 0)
+			return s;
+		if (r == STATUS_OK)
+			r = s;
+	}
+
+	return r;
+}
+
+
+/*
+ * Arguments of an APPEND command that follow the mailbox name: the flags and
+ * date of the message, if any, and the literal that carries it.
+ */
+char *
+append_args(session *ssn, const appenditem *item)
+{
+	char *a;
+
+	a = (char *)xmalloc(strlen(" () \"\" {+}") + (item->flags ?
+	    strlen(item->flags) : 0) + (item->date ? strlen(item->date) : 0) +
+	    24);
+	sprintf(a, "%s%s%s%s%s%s {%lu%s}", (item->flags ? " (" : ""),
+	    (item->flags ? item->flags : ""), (item->flags ? ")" : ""),
+	    (item->date ? " \"" : ""), (item->date ? item->date : ""),
+	    (item->date ? "\"" : ""), (unsigned long)(item->len),
+	    (append_nonsync(ssn, item->len) ? "+" : ""));
+
+	return a;
+}
+
+
+/*
+ * Check if a message of the specified length can be sent as a
+ * non-synchronizing literal.
+ */
+int
+append_nonsync(session *ssn, size_t len)
+{
+
+	return (ssn->capabilities & CAPABILITY_LITERALPLUS ||
+	    (ssn->capabilities & CAPABILITY_LITERALMINUS &&
+	    len <= LITERALMINUS_MAX));
+}
+
+
+/*
+ * Append supplied message to the specified mailbox.
+ */
+int
+request_append(session *ssn, const char *mbox, const char *mesg, size_t
+    mesglen, const char *flags, const char *date)
+{
+
+	return request_append_file(ssn, mbox, mesg, NULL, mesglen, flags,
+	    date);
+}
+
+
+/*
+ * Append supplied message, or the message stored in the supplied file, to the
+ * specified mailbox.
+ */
+int
+request_append_file(session *ssn, const char *mbox, const char *mesg, FILE
+    *fp, size_t mesglen, const char *flags, const char *date)
 {
 	int t, r;
 	const char *m;
@@ -579,8 +1150,7 @@ request_copy(session *ssn, const char *mesg, const char *mbox)
 
 	m = apply_namespace(mbox, ssn);
 
-	TRY(t = send_request(ssn, "UID COPY %s \"%s\"", mesg, m));
-	TRY(r = response_generic(ssn, t));
+	TRY(r = send_append(ssn, m, mesg, fp, mesglen, flags, date));
 
 	if (r == STATUS_TRYCREATE) {
 		TRY(t = send_request(ssn, "CREATE \"%s\"", m));
@@ -590,8 +1160,8 @@ request_copy(session *ssn, const char *mesg, const char *mbox)
 			TRY(t = send_request(ssn, "SUBSCRIBE \"%s\"", m));
 			TRY(r = response_generic(ssn, t));
 		}
-		TRY(t = send_request(ssn, "UID COPY %s \"%s\"", mesg, m));
-		TRY(r = response_generic(ssn, t));
+
+		TRY(r = send_append(ssn, m, mesg, fp, mesglen, flags, date));
 	}
 
 	return r;
@@ -599,29 +1169,33 @@ request_copy(session *ssn, const char *mesg, const char *mbox)
 
 
 /*
- * Append supplied message to the specified mailbox.
+ * Append the supplied messages to the specified mailbox, with a single command
+ * if the server supports MULTIAPPEND, or else with a series of pipelined
+ * commands; the first message is appended on its own, so that the mailbox is
+ * created if needed.
  */
 int
-request_append(session *ssn, const char *mbox, const char *mesg, size_t
-    mesglen, const char *flags, const char *date)
+request_multiappend(session *ssn, const char *mbox, const appenditem *items,
+    size_t n)
 {
-	int t, r;
+	int t, r, ma;
 	const char *m;
 
 	if (opts.dryrun)
 		return STATUS_DRYRUN;
 
+	if (n == 0)
+		return STATUS_OK;
+
 	m = apply_namespace(mbox, ssn);
 
-	TRY(t = send_request(ssn, "APPEND \"%s\"%s%s%s%s%s%s {%d}", m,
-	    (flags ? " (" : ""), (flags ? flags : ""),
-	    (flags ? ")" : ""), (date ? " \"" : ""),
-	    (date ? date : ""), (date ? "\"" : ""), mesglen));
-	TRY(r = response_continuation(ssn, t));
+	ma = (ssn->capabilities & CAPABILITY_MULTIAPPEND && n > 1);
 
-	if (r == STATUS_CONTINUE) {
-		TRY(r = send_continuation(ssn, mesg, mesglen));
-		TRY(r = response_generic(ssn, t));
+	if (ma) {
+		TRY(r = send_multiappend(ssn, m, items, n));
+	} else {
+		TRY(r = send_append(ssn, m, items[0].mesg, NULL, items[0].len,
+		    items[0].flags, items[0].date));
 	}
 
 	if (r == STATUS_TRYCREATE) {
@@ -633,17 +1207,19 @@ request_append(session *ssn, const char *mbox, const char *mesg, size_t
 			TRY(r = response_generic(ssn, t));
 		}
 
-		TRY(t = send_request(ssn, "APPEND \"%s\"%s%s%s%s%s%s {%d}", m,
-		    (flags ? " (" : ""), (flags ? flags : ""),
-		    (flags ? ")" : ""), (date ? " \"" : ""),
-		    (date ? date : ""), (date ? "\"" : ""), mesglen));
-		TRY(r = response_continuation(ssn, t));
-		if (r == STATUS_CONTINUE) {
-			TRY(r = send_continuation(ssn, mesg, mesglen));
-			TRY(r = response_generic(ssn, t));
+		if (ma) {
+			TRY(r = send_multiappend(ssn, m, items, n));
+		} else {
+			TRY(r = send_append(ssn, m, items[0].mesg, NULL,
+			    items[0].len, items[0].flags, items[0].date));
 		}
 	}
 
+	if (ma || r != STATUS_OK || n == 1)
+		return r;
+
+	TRY(r = send_append_pipeline(ssn, m, items + 1, n - 1));
+
 	return r;
 }
 
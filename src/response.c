@@ -3,80 +3,38 @@
 #include <string.h>
 #include <strings.h>
 #include <ctype.h>
-#include <regex.h>
 
 #include "imapfilter.h"
 #include "session.h"
 #include "buffer.h"
-#include "regexp.h"
+#include "fetch.h"
+#include "token.h"
 
 
 extern options opts;
 
 buffer ibuf;			/* Input buffer. */
-enum {				/* Server data responses to be parsed;
-				 * regular expressions index. */
-	RESPONSE_TAGGED,
-	RESPONSE_UNTAGGED,
-	RESPONSE_CAPABILITY,
-	RESPONSE_AUTHENTICATE,
-	RESPONSE_NAMESPACE,
-	RESPONSE_STATUS,
-	RESPONSE_STATUS_MESSAGES,
-	RESPONSE_STATUS_RECENT,
-	RESPONSE_STATUS_UNSEEN,
-	RESPONSE_STATUS_UIDNEXT,
-	RESPONSE_EXISTS,
-	RESPONSE_RECENT,
-	RESPONSE_LIST,
-	RESPONSE_SEARCH,
-	RESPONSE_FETCH,
-	RESPONSE_FETCH_FLAGS,
-	RESPONSE_FETCH_DATE,
-	RESPONSE_FETCH_SIZE,
-	RESPONSE_FETCH_STRUCTURE,
-	RESPONSE_FETCH_BODY,
-};
-regexp responses[] = {		/* Server data responses to be parsed;
-				 * regular expressions patterns. */
-	{ "([[:xdigit:]]{4,4}) (OK|NO|BAD) [^[:cntrl:]]*\r+\n+", NULL, 0, NULL },
-	{ "\\* [[:digit:]]+ ([[:graph:]]*)[^[:cntrl:]]*\r+\n+", NULL, 0, NULL },
-	{ "\\* CAPABILITY ([[:print:]]*)\r+\n+", NULL, 0, NULL },
-	{ "\\+ ([[:graph:]]*)\r+\n+", NULL, 0, NULL },
-	{ "\\* NAMESPACE (NIL|\\(\\(\"([[:graph:]]*)\" \"([[:print:]])\"\\)"
-	  "[[:print:]]*\\)) (NIL|\\([[:print:]]*\\)) (NIL|\\([[:print:]]*\\)) *"
-	  "\r+\n+", NULL, 0, NULL },
-	{ "\\* STATUS [[:print:]]* \\(([[:alnum:] ]*)\\) *\r+\n+", NULL, 0, NULL },
-	{ "MESSAGES ([[:digit:]]+)", NULL, 0, NULL },
-	{ "RECENT ([[:digit:]]+)", NULL, 0, NULL },
-	{ "UNSEEN ([[:digit:]]+)", NULL, 0, NULL },
-	{ "UIDNEXT ([[:digit:]]+)", NULL, 0, NULL },
-	{ "\\* ([[:digit:]]+) EXISTS *\r+\n+", NULL, 0, NULL },
-	{ "\\* ([[:digit:]]+) RECENT *\r+\n+", NULL, 0, NULL },
-	{ "\\* (LIST|LSUB) \\(([[:print:]]*)\\) (\"[[:print:]]\"|NIL) "
-	  "(\"([[:print:]]+)\"|([[:print:]]+)|\\{([[:digit:]]+)\\} *\r+\n+"
-	  "([[:print:]]*))\r+\n+", NULL, 0, NULL },
-	{ "\\* SEARCH ?([[:digit:] ]*)\r+\n+", NULL, 0, NULL },
-	{ "\\* [[:digit:]]+ FETCH \\(([[:print:]]*)\\) *\r+\n+", NULL, 0, NULL },
-	{ "FLAGS \\(([[:print:]]*)\\)", NULL, 0, NULL },
-	{ "INTERNALDATE \"([[:print:]]*)\"", NULL, 0, NULL },
-	{ "RFC822.SIZE ([[:digit:]]+)", NULL, 0, NULL },
-	{ "BODYSTRUCTURE (\\([[:print:]]+\\))", NULL, 0, NULL },
-	{ "\\* [[:digit:]]+ FETCH \\([[:print:]]*BODY\\[[[:print:]]*\\] "
-	  "(\\{([[:digit:]]+)\\} *\r+\n+|\"([[:print:]]*)\")", NULL, 0, NULL },
-	{ NULL, NULL, 0, NULL }
-};
 
 
 int receive_response(session *ssn, char *buf, long timeout, int timeoutfail, int *interrupt);
+void debug_response(session *ssn, const char *buf, size_t len);
 
-int check_tag(char *buf, session *ssn, int tag);
+int check_tag(const char *b, const char *e, session *ssn, int tag);
 int check_bye(char *buf);
-int check_continuation(char *buf);
 int check_trycreate(char *buf);
 
 int handle_bye(session *ssn);
 
+const char *scan_next(size_t *line, size_t *pos, fetchsink *sk);
+void scan_literal(size_t pos, fetchsink *sk);
+int scan_response(session *ssn, int tag, int cont, fetchsink *sk);
+const char *check_untagged(const char *b, const char *e, const char *name,
+    unsigned long *num);
+void parse_fetch(const char *b, const char *e, fetchlist *fl);
+void parse_vanished(const char *b, const char *e, char **vanished);
+char *put_range(char *m, const char *set, unsigned long first, unsigned long
+    last);
+
 
 /*
  * Read data the server sent.
@@ -86,62 +44,207 @@ receive_response(session *ssn, char *buf, long timeout, int timeoutfail, int *in
 {
 	ssize_t n;
 
+	if (ssn->pending.len > 0) {
+		n = (ssn->pending.len < INPUT_BUF ? ssn->pending.len : INPUT_BUF);
+		memcpy(buf, ssn->pending.data, n);
+		buf[n] = '\0';
+		ssn->pending.len -= n;
+		memmove(ssn->pending.data, ssn->pending.data + n,
+		    ssn->pending.len + 1);
+
+		return n;
+	}
+
 	if ((n = socket_read(ssn, buf, INPUT_BUF, timeout ? timeout :
 	    (long)(get_option_number("timeout")), timeoutfail, interrupt)) == -1)
 		return STATUS_ERROR;
 
+	debug_response(ssn, buf, n);
 
-	if (opts.debug) {
-		int i;
-		
-		debug("getting response (%d):\n\n", ssn->socket);
+	return n;
+}
 
-		for (i = 0; i < n; i++)
-			debugc(buf[i]);
 
-		debug("\n");
-	}
+/*
+ * Print the data the server sent, when debugging.
+ */
+void
+debug_response(session *ssn, const char *buf, size_t len)
+{
+	size_t i;
 
-	return n;
+	if (!opts.debug)
+		return;
+
+	debug("getting response (%d):\n\n", ssn->socket);
+
+	for (i = 0; i < len; i++)
+		debugc(buf[i]);
+
+	debug("\n");
 }
 
 
 /*
- * Search for tagged response in the data that the server sent.
+ * Read the data that the server has already sent, without waiting for more,
+ * and check if the tagged response of a command has been received.  The data
+ * are kept for the response and scanned only once, skipping over literals,
+ * whose contents may look like the tagged response.
  */
 int
-check_tag(char *buf, session *ssn, int tag)
+response_ready(session *ssn, int tag)
 {
-	int r;
-	char t[4 + 1];
-	regexp *re;
-
-	r = STATUS_NONE;
-
-	snprintf(t, sizeof(t), "%04X", tag);
-
-	re = &responses[RESPONSE_TAGGED];
-
-	if (!regexec(re->preg, buf, re->nmatch, re->pmatch, 0)) {
-		if (!strncasecmp(buf + re->pmatch[1].rm_so, t,
-		    strlen(t))) {
-			if (!strncasecmp(buf + re->pmatch[2].rm_so,
-			    "OK", strlen("OK")))
-				r = STATUS_OK;
-			else if (!strncasecmp(buf + re->pmatch[2].rm_so,
-			    "NO", strlen("NO")))
-				r = STATUS_NO;
-			else if (!strncasecmp(buf + re->pmatch[2].rm_so,
-			    "BAD", strlen("BAD")))
-				r = STATUS_BAD;
+	ssize_t n;
+	size_t i, l;
+	char *b, *e, *c;
+
+	if (session_status(ssn, tag) != STATUS_NONE)
+		return 1;
+
+	for (;;) {
+		buffer_check(&ssn->pending, ssn->pending.len + INPUT_BUF);
+		if ((n = socket_read(ssn, ssn->pending.data + ssn->pending.len,
+		    INPUT_BUF, -1, 0, NULL)) == -1)
+			return 1;
+		if (n == 0)
+			break;
+		debug_response(ssn, ssn->pending.data + ssn->pending.len, n);
+		ssn->pending.len += n;
+	}
+	ssn->pending.data[ssn->pending.len] = '\0';
+
+	i = ssn->suspend.offset;
+	for (;;) {
+		if (ssn->suspend.literal > 0) {
+			l = ssn->pending.len - i;
+			if (l > ssn->suspend.literal)
+				l = ssn->suspend.literal;
+			i += l;
+			ssn->suspend.literal -= l;
+			if (ssn->suspend.literal > 0)
+				break;
+		}
+
+		b = ssn->pending.data + i;
+		if ((e = memchr(b, '\n', ssn->pending.len - i)) == NULL)
+			break;
+		i = e - ssn->pending.data + 1;
+
+		for (c = b; c < e && c - b < 8 && isxdigit((unsigned char)(*c));
+		    c++);
+		if (c - b == 8 && *c == ' ' &&
+		    (int)(strtol(b, NULL, 16)) == tag) {
+			ssn->suspend.offset = i;
+			return 1;
+		}
+
+		if (e - b > 3 && e[-1] == '\r' && e[-2] == '}') {
+			for (c = e - 3; c > b && (isdigit((unsigned char)(*c)) ||
+			    *c == '+'); c--);
+			if (*c == '{')
+				ssn->suspend.literal = strtoul(c + 1, NULL, 10);
 		}
 	}
+	ssn->suspend.offset = i;
+
+	return 0;
+}
 
-	if (r != STATUS_NONE)
-		verbose("S (%d): %s", ssn->socket, buf + re->pmatch[0].rm_so);
+
+/*
+ * Wait for the tagged response of the suspended command, and set the response
+ * aside until the command is repeated, so that other commands can be sent
+ * through the session in the meantime.
+ */
+int
+response_hold(session *ssn)
+{
+	long timeout;
+	size_t n;
+
+	timeout = (long)(get_option_number("timeout"));
+
+	while (!response_ready(ssn, ssn->suspend.tag))
+		if (socket_wait(ssn, SOCKET_READ, timeout) != 1)
+			return STATUS_ERROR;
+
+	n = ssn->suspend.offset;
+	buffer_check(&ssn->suspend.held, n);
+	memcpy(ssn->suspend.held.data, ssn->pending.data, n);
+	ssn->suspend.held.len = n;
+
+	ssn->pending.len -= n;
+	memmove(ssn->pending.data, ssn->pending.data + n, ssn->pending.len + 1);
+	ssn->suspend.offset = ssn->suspend.literal = 0;
+
+	return STATUS_OK;
+}
+
+
+/*
+ * Read and throw away the response of a suspended command, whose coroutine
+ * will never repeat it.
+ */
+int
+response_discard(session *ssn)
+{
+	int t;
+
+	t = ssn->suspend.tag;
+	ssn->suspend.tag = 0;
+	ssn->suspend.allow = 0;
+
+	if (ssn->suspend.held.len > 0) {
+		session_pushback(ssn, ssn->suspend.held.data,
+		    ssn->suspend.held.len);
+		ssn->suspend.held.len = 0;
+	}
+
+	return scan_response(ssn, t, 0, NULL);
+}
+
+
+/*
+ * Check if a line of the data that the server sent is the tagged response of
+ * a command.  Completions of other commands in flight are recorded, and the
+ * status is returned only for the command with the specified tag.
+ */
+int
+check_tag(const char *b, const char *e, session *ssn, int tag)
+{
+	int r, t;
+	const char *c;
+
+	for (c = b; c < e && c - b < 8 && isxdigit((unsigned char)(*c)); c++);
+	if (c - b != 8 || c >= e || *c++ != ' ')
+		return STATUS_NONE;
+
+	if (e - c > 2 && !strncasecmp(c, "OK", strlen("OK")) &&
+	    (c[2] == ' ' || c[2] == '\r' || c[2] == '\n'))
+		r = STATUS_OK;
+	else if (e - c > 2 && !strncasecmp(c, "NO", strlen("NO")) &&
+	    (c[2] == ' ' || c[2] == '\r' || c[2] == '\n'))
+		r = STATUS_NO;
+	else if (e - c > 3 && !strncasecmp(c, "BAD", strlen("BAD")) &&
+	    (c[3] == ' ' || c[3] == '\r' || c[3] == '\n'))
+		r = STATUS_BAD;
+	else
+		return STATUS_NONE;
+
+	t = (int)(strtol(b, NULL, 16));
+
+	if (!session_complete(ssn, t, r) && t != tag)
+		return STATUS_NONE;
+
+	verbose("S (%d): %.*s", ssn->socket, (int)(e - b), b);
 
 	if (r == STATUS_NO || r == STATUS_BAD)
-		error("IMAP (%d): %s", ssn->socket, buf + re->pmatch[0].rm_so);
+		error("IMAP (%d): %.*s", ssn->socket, (int)(e - b), b);
+
+	if (t != tag)
+		return STATUS_NONE;
+
+	session_collect(ssn, tag);
 
 	return r;
 }
@@ -177,20 +280,6 @@ check_preauth(char *buf)
 }
 
 
-/*
- * Check if the server sent a continuation request.
- */
-int
-check_continuation(char *buf)
-{
-
-	if ((buf[0] == '+' && buf[1] == ' ') || xstrcasestr(buf, "\r\n+ "))
-		return 1;
-	else
-		return 0;
-}
-
-
 /*
  * Check if the server sent a TRYCREATE response.
  */
@@ -216,29 +305,299 @@ handle_bye(session *ssn)
 
 
 /*
- * Get server data and make sure there is a tagged response inside them.
+ * Get the next complete line, including any literals it contains, of the data
+ * in the input buffer.  The offsets of the start of the line and of the data
+ * already scanned are kept between calls, so that every byte is looked at
+ * only once, and the contents of literals are skipped over.  If a sink is
+ * supplied, the contents of literals are handed over to it as they arrive and
+ * the literals are left empty in the buffer.
+ */
+const char *
+scan_next(size_t *line, size_t *pos, fetchsink *sk)
+{
+	const char *b, *c, *d;
+	char *q;
+	size_t m;
+	unsigned long n;
+
+	if (sk != NULL && sk->left > 0) {
+		scan_literal(*pos, sk);
+		if (sk->left > 0)
+			return NULL;
+	}
+
+	while (*pos < ibuf.len && (c = memchr(ibuf.data + *pos, '\n',
+	    ibuf.len - *pos)) != NULL) {
+		b = ibuf.data + *line;
+		d = c;
+		if (d > b && *(d - 1) == '\r')
+			d--;
+		if (d > b && *(d - 1) == '}') {
+			for (d--; d > b && isdigit((unsigned char)(*(d - 1))); d--);
+			if (d > b && *(d - 1) == '{' && *d != '}') {
+				n = strtoul(d, NULL, 10);
+				if (sk == NULL || n == 0) {
+					*pos = c + 1 - ibuf.data + n;
+					continue;
+				}
+				q = ibuf.data + (d - ibuf.data);
+				m = strspn(q, "0123456789") - 1;
+				*q = '0';
+				memmove(q + 1, q + 1 + m, ibuf.data + ibuf.len -
+				    (q + 1 + m) + 1);
+				ibuf.len -= m;
+				*pos = c + 1 - ibuf.data - m;
+				sk->left = n;
+				scan_literal(*pos, sk);
+				if (sk->left > 0)
+					return NULL;
+				continue;
+			}
+		}
+		*pos = c + 1 - ibuf.data;
+		*line = *pos;
+		return b;
+	}
+	if (*pos < ibuf.len)
+		*pos = ibuf.len;
+
+	return NULL;
+}
+
+
+/*
+ * Hand over to the sink the part of a literal that has been received, starting
+ * at the specified offset of the input buffer, and remove it from the buffer,
+ * so that the buffer does not grow with the size of the literal.
+ */
+void
+scan_literal(size_t pos, fetchsink *sk)
+{
+	size_t n;
+
+	n = ibuf.len - pos;
+	if (n > sk->left)
+		n = sk->left;
+	if (n == 0)
+		return;
+
+	if (!sk->error && sk->write(sk->arg, ibuf.data + pos, n) == -1)
+		sk->error = 1;
+
+	memmove(ibuf.data + pos, ibuf.data + pos + n, ibuf.len - pos - n);
+	ibuf.len -= n;
+	ibuf.data[ibuf.len] = '\0';
+
+	sk->left -= n;
+	sk->len += n;
+}
+
+
+/*
+ * Read the data that the server sent, until the tagged response of the command
+ * or, if requested, a continuation request is received.  Any data that follow
+ * are kept for the responses of the commands sent later.
  */
 int
-response_generic(session *ssn, int tag)
+scan_response(session *ssn, int tag, int cont, fetchsink *sk)
 {
-	int r;
+	int r, bye;
 	ssize_t n;
+	size_t line, pos;
+	const char *b, *e;
 
 	if (tag < 0)
 		return STATUS_ERROR;
 
+	if (ssn->suspend.allow && !cont) {
+		ssn->suspend.allow = 0;
+		if (!response_ready(ssn, tag)) {
+			ssn->suspend.tag = tag;
+			return STATUS_SUSPEND;
+		}
+	}
+	ssn->suspend.offset = ssn->suspend.literal = 0;
+
 	buffer_reset(&ibuf);
+	if (ibuf.size > INPUT_BUF * 16)
+		buffer_shrink(&ibuf, INPUT_BUF);
+
+	if ((r = session_collect(ssn, tag)) != STATUS_NONE)
+		return r;
 
-	do {
+	line = pos = 0;
+	bye = 0;
+
+	for (;;) {
 		buffer_check(&ibuf, ibuf.len + INPUT_BUF);
 		if ((n = receive_response(ssn, ibuf.data + ibuf.len, 0, 1, NULL)) ==
 		    -1)
 			return STATUS_ERROR;
 		ibuf.len += n;
 
-		if (check_bye(ibuf.data))
+		while ((b = scan_next(&line, &pos, sk)) != NULL) {
+			e = ibuf.data + line;
+			if (!strncasecmp(b, "* BYE", strlen("* BYE")))
+				bye = 1;
+			else if ((r = check_tag(b, e, ssn, tag)) != STATUS_NONE ||
+			    (cont && *b == '+' && (b[1] == ' ' || b[1] == '\r' ||
+			    b[1] == '\n'))) {
+				if (line < ibuf.len) {
+					session_pushback(ssn, e, ibuf.len - line);
+					ibuf.len = line;
+					ibuf.data[ibuf.len] = '\0';
+				}
+				return r;
+			}
+		}
+
+		if (bye)
 			return handle_bye(ssn);
-	} while ((r = check_tag(ibuf.data, ssn, tag)) == STATUS_NONE);
+	}
+}
+
+
+/*
+ * Check if a line of the data that the server sent is an untagged response of
+ * the specified type, ie. "* <name>" or "* <number> <name>", and return the
+ * position after the name of the response.
+ */
+const char *
+check_untagged(const char *b, const char *e, const char *name,
+    unsigned long *num)
+{
+	token tk;
+
+	if (e - b < 2 || b[0] != '*' || b[1] != ' ')
+		return NULL;
+
+	if ((b = token_next(b + 2, e, &tk)) == NULL || tk.type != TOKEN_ATOM)
+		return NULL;
+
+	if (isdigit((unsigned char)(*tk.data))) {
+		if (num != NULL)
+			*num = strtoul(tk.data, NULL, 10);
+		if ((b = token_next(b, e, &tk)) == NULL ||
+		    tk.type != TOKEN_ATOM)
+			return NULL;
+	}
+
+	if (!token_equal(&tk, name))
+		return NULL;
+
+	return b;
+}
+
+
+/*
+ * Parse the data items of a FETCH response and add those of them that are
+ * known to the list of fetched data items, under the UID of the message.
+ */
+void
+parse_fetch(const char *b, const char *e, fetchlist *fl)
+{
+	fetchitem fi, *f;
+	token n, v;
+
+	memset(&fi, 0, sizeof(fetchitem));
+
+	while ((b = token_next(b, e, &n)) != NULL &&
+	    (b = token_next(b, e, &v)) != NULL) {
+		if (v.type == TOKEN_NIL)
+			continue;
+
+		if (token_equal(&n, "UID")) {
+			fi.uid = strtoul(v.data, NULL, 10);
+		} else if (token_equal(&n, "MODSEQ") && v.type == TOKEN_LIST) {
+			fi.modseq = strtoull(v.data, NULL, 10);
+		} else if (token_equal(&n, "FLAGS") && v.type == TOKEN_LIST) {
+			fi.flags = v.data;
+			fi.flagslen = v.len;
+		} else if (token_equal(&n, "INTERNALDATE")) {
+			fi.date = v.data;
+			fi.datelen = v.len;
+		} else if (token_equal(&n, "RFC822.SIZE")) {
+			fi.size = v.data;
+			fi.sizelen = v.len;
+		} else if (token_equal(&n, "BODYSTRUCTURE") &&
+		    v.type == TOKEN_LIST) {
+			fi.structure = v.data - 1;
+			fi.structurelen = v.len + 2;
+		} else if (n.len > strlen("BODY[") &&
+		    !strncasecmp(n.data, "BODY[", strlen("BODY["))) {
+			fi.body = v.data;
+			fi.bodylen = v.len;
+		}
+	}
+
+	if (fi.uid == 0)
+		return;
+
+	f = fetchlist_add(fl, fi.uid);
+	if (fi.modseq)
+		f->modseq = fi.modseq;
+	if (fi.flags) {
+		f->flags = fi.flags;
+		f->flagslen = fi.flagslen;
+	}
+	if (fi.date) {
+		f->date = fi.date;
+		f->datelen = fi.datelen;
+	}
+	if (fi.size) {
+		f->size = fi.size;
+		f->sizelen = fi.sizelen;
+	}
+	if (fi.structure) {
+		f->structure = fi.structure;
+		f->structurelen = fi.structurelen;
+	}
+	if (fi.body) {
+		f->body = fi.body;
+		f->bodylen = fi.bodylen;
+	}
+}
+
+
+/*
+ * Parse a VANISHED response and append the UIDs of the expunged messages it
+ * reports to the comma separated list of expunged messages.
+ */
+void
+parse_vanished(const char *b, const char *e, char **vanished)
+{
+	size_t n;
+	token tk;
+
+	if ((b = token_next(b, e, &tk)) == NULL)
+		return;
+	if (tk.type == TOKEN_LIST && (b = token_next(b, e, &tk)) == NULL)
+		return;
+	if (tk.type != TOKEN_ATOM)
+		return;
+
+	if (*vanished == NULL) {
+		*vanished = xstrndup(tk.data, tk.len);
+	} else {
+		n = strlen(*vanished);
+		*vanished = (char *)xrealloc(*vanished, n + tk.len + 2);
+		(*vanished)[n] = ',';
+		memcpy(*vanished + n + 1, tk.data, tk.len);
+		(*vanished)[n + 1 + tk.len] = '\0';
+	}
+}
+
+
+/*
+ * Get server data and make sure there is a tagged response inside them.
+ */
+int
+response_generic(session *ssn, int tag)
+{
+	int r;
+
+	if ((r = scan_response(ssn, tag, 0, NULL)) < 0)
+		return r;
 
 	if (r == STATUS_NO &&
 	    (check_trycreate(ibuf.data) || get_option_boolean("create")))
@@ -255,21 +614,9 @@ int
 response_continuation(session *ssn, int tag)
 {
 	int r;
-	ssize_t n;
 
-	buffer_reset(&ibuf);
-
-	do {
-		buffer_check(&ibuf, ibuf.len + INPUT_BUF);
-		if ((n = receive_response(ssn, ibuf.data + ibuf.len, 0, 1, NULL)) ==
-		    -1)
-			return STATUS_ERROR;
-		ibuf.len += n;
-
-		if (check_bye(ibuf.data))
-			return handle_bye(ssn);
-	} while ((r = check_tag(ibuf.data, ssn, tag)) == STATUS_NONE &&
-	    !check_continuation(ibuf.data));
+	if ((r = scan_response(ssn, tag, 1, NULL)) < 0)
+		return r;
 
 	if (r == STATUS_NO &&
 	    (check_trycreate(ibuf.data) || get_option_boolean("create")))
@@ -313,8 +660,9 @@ int
 response_capability(session *ssn, int tag)
 {
 	int r;
-	char *s;
-	regexp *re;
+	size_t line, pos;
+	const char *b, *e;
+	token tk;
 
 	r = response_generic(ssn, tag);
 	if (r < 0)
@@ -322,40 +670,97 @@ response_capability(session *ssn, int tag)
 
 	ssn->protocol = PROTOCOL_NONE;
 
-	re = &responses[RESPONSE_CAPABILITY];
+	line = pos = 0;
+	while ((b = scan_next(&line, &pos, NULL)) != NULL) {
+		e = ibuf.data + line;
+		if ((b = check_untagged(b, e, "CAPABILITY", NULL)) == NULL)
+			continue;
 
-	if (!regexec(re->preg, ibuf.data, re->nmatch, re->pmatch, 0)) {
-		s = xstrndup(ibuf.data + re->pmatch[1].rm_so,
-		    re->pmatch[1].rm_eo - re->pmatch[1].rm_so);
+		ssn->capabilities = CAPABILITY_NONE;
+
+		while ((b = token_next(b, e, &tk)) != NULL) {
+			if (token_equal(&tk, "IMAP4rev1"))
+				ssn->protocol = PROTOCOL_IMAP4REV1;
+			else if (tk.len >= strlen("IMAP4") &&
+			    !strncasecmp(tk.data, "IMAP4", strlen("IMAP4")) &&
+			    ssn->protocol == PROTOCOL_NONE)
+				ssn->protocol = PROTOCOL_IMAP4;
+			else if (token_equal(&tk, "NAMESPACE"))
+				ssn->capabilities |= CAPABILITY_NAMESPACE;
+			else if (token_equal(&tk, "STARTTLS"))
+				ssn->capabilities |= CAPABILITY_STARTTLS;
+			else if (token_equal(&tk, "CHILDREN"))
+				ssn->capabilities |= CAPABILITY_CHILDREN;
+			else if (token_equal(&tk, "IDLE"))
+				ssn->capabilities |= CAPABILITY_IDLE;
+			else if (token_equal(&tk, "AUTH=XOAUTH2"))
+				ssn->capabilities |= CAPABILITY_XOAUTH2;
+			else if (token_equal(&tk, "ENABLE"))
+				ssn->capabilities |= CAPABILITY_ENABLE;
+			else if (token_equal(&tk, "UTF8=ACCEPT"))
+				ssn->capabilities |= CAPABILITY_UTF8;
+			else if (token_equal(&tk, "CONDSTORE"))
+				ssn->capabilities |= CAPABILITY_CONDSTORE;
+			else if (token_equal(&tk, "QRESYNC"))
+				ssn->capabilities |= CAPABILITY_QRESYNC;
+			else if (token_equal(&tk, "MOVE"))
+				ssn->capabilities |= CAPABILITY_MOVE;
+			else if (token_equal(&tk, "UIDPLUS"))
+				ssn->capabilities |= CAPABILITY_UIDPLUS;
+			else if (token_equal(&tk, "COMPRESS=DEFLATE"))
+				ssn->capabilities |= CAPABILITY_COMPRESS;
+			else if (token_equal(&tk, "LITERAL+"))
+				ssn->capabilities |= CAPABILITY_LITERALPLUS;
+			else if (token_equal(&tk, "LITERAL-"))
+				ssn->capabilities |= CAPABILITY_LITERALMINUS;
+			else if (token_equal(&tk, "MULTIAPPEND"))
+				ssn->capabilities |= CAPABILITY_MULTIAPPEND;
+			else if (token_equal(&tk, "ESEARCH"))
+				ssn->capabilities |= CAPABILITY_ESEARCH;
+		}
 
-		if (xstrcasestr(s, "IMAP4rev1"))
-			ssn->protocol = PROTOCOL_IMAP4REV1;
-		else if (xstrcasestr(s, "IMAP4"))
-			ssn->protocol = PROTOCOL_IMAP4;
-		else {
+		if (ssn->protocol == PROTOCOL_NONE) {
 			error("server supports neither the IMAP4rev1 nor the "
 			    "IMAP4 protocol\n");
 			return STATUS_ERROR;
 		}
+	}
 
-		ssn->capabilities = CAPABILITY_NONE;
+	return r;
+}
 
-		if (xstrcasestr(s, "NAMESPACE"))
-			ssn->capabilities |= CAPABILITY_NAMESPACE;
-		if (xstrcasestr(s, "STARTTLS"))
-			ssn->capabilities |= CAPABILITY_STARTTLS;
-		if (xstrcasestr(s, "CHILDREN"))
-			ssn->capabilities |= CAPABILITY_CHILDREN;
-		if (xstrcasestr(s, "IDLE"))
-			ssn->capabilities |= CAPABILITY_IDLE;
-		if (xstrcasestr(s, "AUTH=XOAUTH2"))
-			ssn->capabilities |= CAPABILITY_XOAUTH2;
-		if (xstrcasestr(s, "ENABLE"))
-			ssn->capabilities |= CAPABILITY_ENABLE;
-		if (xstrcasestr(s, "UTF8=ACCEPT"))
-			ssn->capabilities |= CAPABILITY_UTF8;
 
-		xfree(s);
+/*
+ * Process the data that server sent due to IMAP ENABLE client request, and get
+ * the capabilities that were actually enabled.
+ */
+int
+response_enable(session *ssn, int tag, unsigned int *enabled)
+{
+	int r;
+	size_t line, pos;
+	const char *b, *e;
+	token tk;
+
+	if ((r = response_generic(ssn, tag)) < 0)
+		return r;
+
+	*enabled = CAPABILITY_NONE;
+
+	line = pos = 0;
+	while ((b = scan_next(&line, &pos, NULL)) != NULL) {
+		e = ibuf.data + line;
+		if ((b = check_untagged(b, e, "ENABLED", NULL)) == NULL)
+			continue;
+
+		while ((b = token_next(b, e, &tk)) != NULL) {
+			if (token_equal(&tk, "UTF8=ACCEPT"))
+				*enabled |= CAPABILITY_UTF8;
+			else if (token_equal(&tk, "CONDSTORE"))
+				*enabled |= CAPABILITY_CONDSTORE;
+			else if (token_equal(&tk, "QRESYNC"))
+				*enabled |= CAPABILITY_QRESYNC;
+		}
 	}
 
 	return r;
@@ -369,15 +774,23 @@ int
 response_authenticate(session *ssn, int tag, unsigned char **cont)
 {
 	int r;
-	regexp *re;
+	size_t line, pos;
+	const char *b, *e;
+	token tk;
 
-	re = &responses[RESPONSE_AUTHENTICATE];
+	if ((r = response_continuation(ssn, tag)) != STATUS_CONTINUE)
+		return r;
 
-	if ((r = response_continuation(ssn, tag)) == STATUS_CONTINUE &&
-	    !regexec(re->preg, ibuf.data, re->nmatch, re->pmatch, 0))
-		*cont = (unsigned char *)xstrndup(ibuf.data +
-		    re->pmatch[1].rm_so, re->pmatch[1].rm_eo -
-		    re->pmatch[1].rm_so);
+	line = pos = 0;
+	while ((b = scan_next(&line, &pos, NULL)) != NULL) {
+		e = ibuf.data + line;
+		if (b[0] == '+' && b[1] == ' ' &&
+		    token_next(b + 2, e, &tk) != NULL &&
+		    tk.type == TOKEN_ATOM) {
+			*cont = (unsigned char *)xstrndup(tk.data, tk.len);
+			break;
+		}
+	}
 
 	return r;
 }
@@ -389,8 +802,10 @@ response_authenticate(session *ssn, int tag, unsigned char **cont)
 int
 response_namespace(session *ssn, int tag)
 {
-	int r, n;
-	regexp *re;
+	int r;
+	size_t line, pos;
+	const char *b, *e;
+	token tk, p, d;
 
 	if ((r = response_generic(ssn, tag)) < 0)
 		return r;
@@ -400,14 +815,27 @@ response_namespace(session *ssn, int tag)
 	ssn->ns.prefix = NULL;
 	ssn->ns.delim = '\0';
 
-	re = &responses[RESPONSE_NAMESPACE];
+	line = pos = 0;
+	while ((b = scan_next(&line, &pos, NULL)) != NULL) {
+		e = ibuf.data + line;
+		if ((b = check_untagged(b, e, "NAMESPACE", NULL)) == NULL)
+			continue;
+
+		/* Only the first of the personal namespaces is used. */
+		if (token_next(b, e, &tk) == NULL || tk.type != TOKEN_LIST ||
+		    token_next(tk.data, tk.data + tk.len, &tk) == NULL ||
+		    tk.type != TOKEN_LIST)
+			break;
+		if ((b = token_next(tk.data, tk.data + tk.len, &p)) == NULL ||
+		    token_next(b, tk.data + tk.len, &d) == NULL ||
+		    d.type != TOKEN_QUOTED || d.len == 0)
+			break;
 
-	if (!regexec(re->preg, ibuf.data, re->nmatch, re->pmatch, 0)) {
-		n = re->pmatch[2].rm_eo - re->pmatch[2].rm_so;
-		if (n > 0)
-			ssn->ns.prefix = xstrndup(ibuf.data +
-			    re->pmatch[2].rm_so, n);
-		ssn->ns.delim = *(ibuf.data + re->pmatch[3].rm_so);
+		if ((p.type == TOKEN_QUOTED || p.type == TOKEN_LITERAL) &&
+		    p.len > 0)
+			ssn->ns.prefix = xstrndup(p.data, p.len);
+		ssn->ns.delim = *d.data;
+		break;
 	}
 	debug("namespace (%d): '%s' '%c'\n", ssn->socket,
 	    (ssn->ns.prefix ? ssn->ns.prefix : ""), ssn->ns.delim);
@@ -424,35 +852,63 @@ response_status(session *ssn, int tag, unsigned int *exist,
     unsigned int *recent, unsigned int *unseen, unsigned int *uidnext)
 {
 	int r;
-	char *s;
-	regexp *re;
+	size_t line, pos;
+	const char *b, *e;
+	token tk, n, v;
 
 	if ((r = response_generic(ssn, tag)) < 0)
 		return r;
 
-	re = &responses[RESPONSE_STATUS];
-
-	if (!regexec(re->preg, ibuf.data, re->nmatch, re->pmatch, 0)) {
-		s = xstrndup(ibuf.data + re->pmatch[1].rm_so,
-		    re->pmatch[1].rm_eo - re->pmatch[1].rm_so);
+	line = pos = 0;
+	while ((b = scan_next(&line, &pos, NULL)) != NULL) {
+		e = ibuf.data + line;
+		if ((b = check_untagged(b, e, "STATUS", NULL)) == NULL ||
+		    (b = token_next(b, e, &tk)) == NULL ||
+		    token_next(b, e, &tk) == NULL || tk.type != TOKEN_LIST)
+			continue;
+
+		b = tk.data;
+		e = tk.data + tk.len;
+		while ((b = token_next(b, e, &n)) != NULL &&
+		    (b = token_next(b, e, &v)) != NULL) {
+			if (token_equal(&n, "MESSAGES"))
+				*exist = strtol(v.data, NULL, 10);
+			else if (token_equal(&n, "RECENT"))
+				*recent = strtol(v.data, NULL, 10);
+			else if (token_equal(&n, "UNSEEN"))
+				*unseen = strtol(v.data, NULL, 10);
+			else if (token_equal(&n, "UIDNEXT"))
+				*uidnext = strtol(v.data, NULL, 10);
+		}
+		break;
+	}
 
-		re = &responses[RESPONSE_STATUS_MESSAGES];
-		if (!regexec(re->preg, s, re->nmatch, re->pmatch, 0))
-			*exist = strtol(s + re->pmatch[1].rm_so, NULL, 10);
+	return r;
+}
 
-		re = &responses[RESPONSE_STATUS_RECENT];
-		if (!regexec(re->preg, s, re->nmatch, re->pmatch, 0))
-			*recent = strtol(s + re->pmatch[1].rm_so, NULL, 10);
 
-		re = &responses[RESPONSE_STATUS_UNSEEN];
-		if (!regexec(re->preg, s, re->nmatch, re->pmatch, 0))
-			*unseen = strtol(s + re->pmatch[1].rm_so, NULL, 10);
+/*
+ * Process the data that server sent due to IMAP EXAMINE client request.
+ */
+int
+response_examine(session *ssn, int tag, unsigned int *exist,
+    unsigned int *recent)
+{
+	int r;
+	size_t line, pos;
+	unsigned long n;
+	const char *b, *e;
 
-		re = &responses[RESPONSE_STATUS_UIDNEXT];
-		if (!regexec(re->preg, s, re->nmatch, re->pmatch, 0))
-			*uidnext = strtol(s + re->pmatch[1].rm_so, NULL, 10);
+	if ((r = response_generic(ssn, tag)) < 0)
+		return r;
 
-		xfree(s);
+	line = pos = 0;
+	while ((b = scan_next(&line, &pos, NULL)) != NULL) {
+		e = ibuf.data + line;
+		if (check_untagged(b, e, "EXISTS", &n) != NULL)
+			*exist = n;
+		else if (check_untagged(b, e, "RECENT", &n) != NULL)
+			*recent = n;
 	}
 
 	return r;
@@ -460,43 +916,83 @@ response_status(session *ssn, int tag, unsigned int *exist,
 
 
 /*
- * Process the data that server sent due to IMAP EXAMINE client request.
+ * Process the data that server sent due to IMAP SELECT client request, and
+ * get the UIDVALIDITY of the mailbox.
  */
 int
-response_examine(session *ssn, int tag, unsigned int *exist,
-    unsigned int *recent)
+response_select(session *ssn, int tag, unsigned int *uidvalidity,
+    unsigned long long *modseq, char **vanished, fetchlist *fl)
 {
 	int r;
-	regexp *re;
+	size_t line, pos;
+	const char *b, *e, *c;
+	token tk;
 
 	if ((r = response_generic(ssn, tag)) < 0)
 		return r;
 
-	re = &responses[RESPONSE_EXISTS];
-	if (!regexec(re->preg, ibuf.data, re->nmatch, re->pmatch, 0))
-		*exist = strtol(ibuf.data + re->pmatch[1].rm_so, NULL, 10);
+	*modseq = 0;
+
+	line = pos = 0;
+	while ((b = scan_next(&line, &pos, NULL)) != NULL) {
+		e = ibuf.data + line;
+		if ((c = check_untagged(b, e, "OK", NULL)) != NULL) {
+			if (e - c > (long)(strlen(" [UIDVALIDITY ")) &&
+			    !strncasecmp(c, " [UIDVALIDITY ",
+			    strlen(" [UIDVALIDITY ")))
+				*uidvalidity = strtoul(c +
+				    strlen(" [UIDVALIDITY "), NULL, 10);
+			else if (e - c > (long)(strlen(" [HIGHESTMODSEQ ")) &&
+			    !strncasecmp(c, " [HIGHESTMODSEQ ",
+			    strlen(" [HIGHESTMODSEQ ")))
+				*modseq = strtoull(c +
+				    strlen(" [HIGHESTMODSEQ "), NULL, 10);
+		} else if ((c = check_untagged(b, e, "VANISHED", NULL)) !=
+		    NULL) {
+			parse_vanished(c, e, vanished);
+		} else if ((c = check_untagged(b, e, "FETCH", NULL)) != NULL &&
+		    token_next(c, e, &tk) != NULL && tk.type == TOKEN_LIST) {
+			parse_fetch(tk.data, tk.data + tk.len, fl);
+		}
+	}
 
-	re = &responses[RESPONSE_RECENT];
-	if (!regexec(re->preg, ibuf.data, re->nmatch, re->pmatch, 0))
-		*recent = strtol(ibuf.data + re->pmatch[1].rm_so, NULL, 10);
+	if (xstrcasestr(ibuf.data, "[READ-ONLY]"))
+		return STATUS_READONLY;
 
 	return r;
 }
 
 
 /*
- * Process the data that server sent due to IMAP SELECT client request.
+ * Process the data that server sent due to IMAP UID FETCH client request with
+ * the CHANGEDSINCE modifier, and get the highest modification sequence of the
+ * changes reported.
  */
 int
-response_select(session *ssn, int tag)
+response_changes(session *ssn, int tag, unsigned long long *modseq,
+    char **vanished, fetchlist *fl)
 {
 	int r;
+	size_t i, line, pos;
+	const char *b, *e, *c;
+	token tk;
 
 	if ((r = response_generic(ssn, tag)) < 0)
 		return r;
 
-	if (xstrcasestr(ibuf.data, "[READ-ONLY]"))
-		return STATUS_READONLY;
+	line = pos = 0;
+	while ((b = scan_next(&line, &pos, NULL)) != NULL) {
+		e = ibuf.data + line;
+		if ((c = check_untagged(b, e, "VANISHED", NULL)) != NULL)
+			parse_vanished(c, e, vanished);
+		else if ((c = check_untagged(b, e, "FETCH", NULL)) != NULL &&
+		    token_next(c, e, &tk) != NULL && tk.type == TOKEN_LIST)
+			parse_fetch(tk.data, tk.data + tk.len, fl);
+	}
+
+	for (i = 0; i < fl->len; i++)
+		if (fl->items[i].modseq > *modseq)
+			*modseq = fl->items[i].modseq;
 
 	return r;
 }
@@ -509,10 +1005,11 @@ response_select(session *ssn, int tag)
 int
 response_list(session *ssn, int tag, char **mboxs, char **folders)
 {
-	int r, n;
-	char *b, *a, *s, *m, *f;
-	const char *v;
-	regexp *re;
+	int r, n, noselect, noinferiors, children, nochildren;
+	size_t line, pos;
+	char *m, *f, *s;
+	const char *b, *e, *c, *v;
+	token a, t, tk;
 
 	if ((r = response_generic(ssn, tag)) < 0)
 		return r;
@@ -521,48 +1018,54 @@ response_list(session *ssn, int tag, char **mboxs, char **folders)
 	f = *folders = (char *)xmalloc((ibuf.len + 1) * sizeof(char));
 	*m = *f = '\0';
 
-	re = &responses[RESPONSE_LIST];
-
-	b = ibuf.data;
-	while (!regexec(re->preg, b, re->nmatch, re->pmatch, 0)) {
-		a = xstrndup(b + re->pmatch[2].rm_so,
-		    re->pmatch[2].rm_eo - re->pmatch[2].rm_so);
-
-		if (re->pmatch[5].rm_so != -1 && re->pmatch[5].rm_eo != -1)
-			s = xstrndup(b + re->pmatch[5].rm_so,
-			    re->pmatch[5].rm_eo - re->pmatch[5].rm_so);
-		else if (re->pmatch[6].rm_so != -1 &&
-		    re->pmatch[6].rm_eo != -1)
-			s = xstrndup(b + re->pmatch[6].rm_so,
-			    re->pmatch[6].rm_eo - re->pmatch[6].rm_so);
-		else
-			s = xstrndup(b + re->pmatch[8].rm_so, strtoul(b +
-			    re->pmatch[7].rm_so, NULL, 10));
+	line = pos = 0;
+	while ((b = scan_next(&line, &pos, NULL)) != NULL) {
+		e = ibuf.data + line;
+		if ((c = check_untagged(b, e, "LIST", NULL)) == NULL &&
+		    (c = check_untagged(b, e, "LSUB", NULL)) == NULL)
+			continue;
+
+		if ((c = token_next(c, e, &a)) == NULL ||
+		    a.type != TOKEN_LIST ||
+		    (c = token_next(c, e, &tk)) == NULL ||
+		    token_next(c, e, &tk) == NULL || tk.type == TOKEN_LIST ||
+		    tk.type == TOKEN_NIL)
+			continue;
+
+		noselect = noinferiors = children = nochildren = 0;
+		for (c = a.data; (c = token_next(c, a.data + a.len, &t)) !=
+		    NULL;) {
+			if (token_equal(&t, "\\NoSelect"))
+				noselect = 1;
+			else if (token_equal(&t, "\\NoInferiors"))
+				noinferiors = 1;
+			else if (token_equal(&t, "\\HasChildren"))
+				children = 1;
+			else if (token_equal(&t, "\\HasNoChildren"))
+				nochildren = 1;
+		}
 
+		s = xstrndup(tk.data, tk.len);
 		v = reverse_namespace(s, ssn);
 		n = strlen(v);
 
-		if (!xstrcasestr(a, "\\NoSelect")) {
+		if (!noselect) {
 			xstrncpy(m, v, ibuf.len - (m - *mboxs));
 			m += n;
 			xstrncpy(m, "\n", ibuf.len - (m - *mboxs));
 			m += strlen("\n");
 		}
 
-		if (!xstrcasestr(a, "\\NoInferiors") &&
+		if (!noinferiors &&
 		    (!(ssn->capabilities & CAPABILITY_CHILDREN) ||
 		    ((ssn->capabilities & CAPABILITY_CHILDREN) &&
-		    (xstrcasestr(a, "\\HasChildren")) &&
-		    !xstrcasestr(a, "\\HasNoChildren")))) {
+		    children && !nochildren))) {
 			xstrncpy(f, v, ibuf.len - (f - *folders));
 			f += n;
 			xstrncpy(f, "\n", ibuf.len - (f - *folders));
 			f += strlen("\n");
 		}
 
-		b += re->pmatch[0].rm_eo;
-
-		xfree(a);
 		xfree(s);
 	}
 
@@ -571,142 +1074,133 @@ response_list(session *ssn, int tag, char **mboxs, char **folders)
 
 
 /*
- * Process the data that server sent due to IMAP SEARCH client request.
+ * Process the data that server sent due to IMAP SEARCH client request.  The
+ * messages are returned as a sequence set, eg. "1:5,7", either as it was sent
+ * in an ESEARCH response, or by collapsing consecutive UIDs of a SEARCH
+ * response into ranges.
  */
 int
 response_search(session *ssn, int tag, char **mesgs)
 {
-	int r;
-	unsigned int min;
-	regexp *re;
-	char *b, *m;
+	int r, esearch;
+	size_t line, pos;
+	unsigned long u, first, last;
+	char *m;
+	const char *b, *e, *c;
+	token tk;
 
 	if ((r = response_generic(ssn, tag)) < 0)
 		return r;
 
-	re = &responses[RESPONSE_SEARCH];
+	m = NULL;
+	first = last = 0;
+
+	line = pos = 0;
+	while ((b = scan_next(&line, &pos, NULL)) != NULL) {
+		e = ibuf.data + line;
+		if ((c = check_untagged(b, e, "ESEARCH", NULL)) != NULL)
+			esearch = 1;
+		else if ((c = check_untagged(b, e, "SEARCH", NULL)) != NULL)
+			esearch = 0;
+		else
+			continue;
 
-	b = ibuf.data;
-	while (!regexec(re->preg, b, re->nmatch, re->pmatch, 0)) {
 		if (!*mesgs) {
 			*mesgs = (char *)xmalloc((ibuf.len + 1) *
 			    sizeof(char));
+			**mesgs = '\0';
+		}
+		if (m == NULL)
+			m = *mesgs;
+
+		if (esearch) {
+			while ((c = token_next(c, e, &tk)) != NULL)
+				if (tk.type == TOKEN_ATOM &&
+				    token_equal(&tk, "ALL") &&
+				    (c = token_next(c, e, &tk)) != NULL) {
+					if (m != *mesgs)
+						*m++ = ',';
+					memcpy(m, tk.data, tk.len);
+					m += tk.len;
+				}
+			*m = '\0';
+			continue;
 		}
-		m = *mesgs;
-		*m = '\0';
-
-		min = (unsigned int)(re->pmatch[1].rm_eo -
-		    re->pmatch[1].rm_so) < ibuf.len ?
-		    (unsigned int)(re->pmatch[1].rm_eo - re->pmatch[1].rm_so) :
-		    ibuf.len;
-
-		xstrncpy(m, b + re->pmatch[1].rm_so, min);
-		m += min;
-		xstrncpy(m++, " ", ibuf.len - min);
-
-		b += re->pmatch[0].rm_eo;
-	}
-
-	return r;
-}
-
-
-/*
- * Process the data that server sent due to IMAP FETCH FAST client request.
- */
-int
-response_fetchfast(session *ssn, int tag, char **flags, char **date,
-    char **size)
-{
-	int r;
-	char *s;
-	regexp *re;
-
-	if ((r = response_generic(ssn, tag)) < 0)
-		return r;
-
-	re = &responses[RESPONSE_FETCH];
-	if (!regexec(re->preg, ibuf.data, re->nmatch, re->pmatch, 0)) {
-		s = xstrndup(ibuf.data + re->pmatch[1].rm_so,
-		    re->pmatch[1].rm_eo - re->pmatch[1].rm_so);
-
-		re = &responses[RESPONSE_FETCH_FLAGS];
-		if (!regexec(re->preg, s, re->nmatch, re->pmatch, 0))
-			*flags = xstrndup(s + re->pmatch[1].rm_so,
-			    re->pmatch[1].rm_eo - re->pmatch[1].rm_so);
-
-		re = &responses[RESPONSE_FETCH_DATE];
-		if (!regexec(re->preg, s, re->nmatch, re->pmatch, 0))
-			*date = xstrndup(s + re->pmatch[1].rm_so,
-			    re->pmatch[1].rm_eo - re->pmatch[1].rm_so);
-
-		re = &responses[RESPONSE_FETCH_SIZE];
-		if (!regexec(re->preg, s, re->nmatch, re->pmatch, 0))
-			*size = xstrndup(s + re->pmatch[1].rm_so,
-			    re->pmatch[1].rm_eo - re->pmatch[1].rm_so);
-
-		xfree(s);
-	}
-
-	return r;
-}
-
-
-/*
- * Process the data that server sent due to IMAP FETCH FLAGS client request.
- */
-int
-response_fetchflags(session *ssn, int tag, char **flags)
-{
-	int r;
-	char *s;
-	regexp *re;
-
-	if ((r = response_generic(ssn, tag)) < 0)
-		return r;
-
-	re = &responses[RESPONSE_FETCH];
-	if (!regexec(re->preg, ibuf.data, re->nmatch, re->pmatch, 0)) {
-		s = xstrndup(ibuf.data + re->pmatch[1].rm_so,
-		    re->pmatch[1].rm_eo - re->pmatch[1].rm_so);
-
-		re = &responses[RESPONSE_FETCH_FLAGS];
-		if (!regexec(re->preg, s, re->nmatch, re->pmatch, 0))
-			*flags = xstrndup(s + re->pmatch[1].rm_so,
-			    re->pmatch[1].rm_eo - re->pmatch[1].rm_so);
 
-		xfree(s);
+		while ((c = token_next(c, e, &tk)) != NULL) {
+			if (tk.type != TOKEN_ATOM ||
+			    !isdigit((unsigned char)(*tk.data)))
+				continue;
+			u = strtoul(tk.data, NULL, 10);
+			if (first != 0 && u == last + 1) {
+				last = u;
+				continue;
+			}
+			if (first != 0)
+				m = put_range(m, *mesgs, first, last);
+			first = last = u;
+		}
 	}
+	if (first != 0)
+		m = put_range(m, *mesgs, first, last);
 
 	return r;
 }
 
 
 /*
- * Process the data that server sent due to IMAP FETCH INTERNALDATE client
- * request.
+ * Process the data that server sent due to IMAP SEARCH client request, when
+ * only the number of the messages and their lowest and highest UIDs are
+ * needed.  These are either sent in an ESEARCH response, or counted from the
+ * UIDs of a SEARCH response.
  */
 int
-response_fetchdate(session *ssn, int tag, char **date)
+response_searchcount(session *ssn, int tag, unsigned long *count,
+    unsigned long *min, unsigned long *max)
 {
 	int r;
-	char *s;
-	regexp *re;
+	size_t line, pos;
+	unsigned long u;
+	const char *b, *e, *c;
+	token tk;
 
 	if ((r = response_generic(ssn, tag)) < 0)
 		return r;
 
-	re = &responses[RESPONSE_FETCH];
-	if (!regexec(re->preg, ibuf.data, re->nmatch, re->pmatch, 0)) {
-		s = xstrndup(ibuf.data + re->pmatch[1].rm_so,
-		    re->pmatch[1].rm_eo - re->pmatch[1].rm_so);
-
-		re = &responses[RESPONSE_FETCH_DATE];
-		if (!regexec(re->preg, s, re->nmatch, re->pmatch, 0))
-			*date = xstrndup(s + re->pmatch[1].rm_so,
-			    re->pmatch[1].rm_eo - re->pmatch[1].rm_so);
-
-		xfree(s);
+	*count = *min = *max = 0;
+
+	line = pos = 0;
+	while ((b = scan_next(&line, &pos, NULL)) != NULL) {
+		e = ibuf.data + line;
+		if ((c = check_untagged(b, e, "ESEARCH", NULL)) != NULL) {
+			while ((c = token_next(c, e, &tk)) != NULL) {
+				if (tk.type != TOKEN_ATOM)
+					continue;
+				if (token_equal(&tk, "COUNT") &&
+				    (c = token_next(c, e, &tk)) != NULL)
+					*count = strtoul(tk.data, NULL, 10);
+				else if (token_equal(&tk, "MIN") &&
+				    (c = token_next(c, e, &tk)) != NULL)
+					*min = strtoul(tk.data, NULL, 10);
+				else if (token_equal(&tk, "MAX") &&
+				    (c = token_next(c, e, &tk)) != NULL)
+					*max = strtoul(tk.data, NULL, 10);
+				if (c == NULL)
+					break;
+			}
+		} else if ((c = check_untagged(b, e, "SEARCH", NULL)) != NULL) {
+			while ((c = token_next(c, e, &tk)) != NULL) {
+				if (tk.type != TOKEN_ATOM ||
+				    !isdigit((unsigned char)(*tk.data)))
+					continue;
+				u = strtoul(tk.data, NULL, 10);
+				if (*count == 0 || u < *min)
+					*min = u;
+				if (*count == 0 || u > *max)
+					*max = u;
+				(*count)++;
+			}
+		}
 	}
 
 	return r;
@@ -714,61 +1208,46 @@ response_fetchdate(session *ssn, int tag, char **date)
 
 
 /*
- * Process the data that server sent due to IMAP FETCH RFC822.SIZE client
- * request.
+ * Append a range of UIDs to a sequence set, and return the new end of the set.
  */
-int
-response_fetchsize(session *ssn, int tag, char **size)
+char *
+put_range(char *m, const char *set, unsigned long first, unsigned long last)
 {
-	int r;
-	char *s;
-	regexp *re;
-
-	if ((r = response_generic(ssn, tag)) < 0)
-		return r;
 
-	re = &responses[RESPONSE_FETCH];
-	if (!regexec(re->preg, ibuf.data, re->nmatch, re->pmatch, 0)) {
-		s = xstrndup(ibuf.data + re->pmatch[1].rm_so,
-		    re->pmatch[1].rm_eo - re->pmatch[1].rm_so);
-
-		re = &responses[RESPONSE_FETCH_SIZE];
-		if (!regexec(re->preg, s, re->nmatch, re->pmatch, 0))
-			*size = xstrndup(s + re->pmatch[1].rm_so,
-			    re->pmatch[1].rm_eo - re->pmatch[1].rm_so);
-
-		xfree(s);
-	}
+	if (m != set)
+		*m++ = ',';
+	if (first == last)
+		m += sprintf(m, "%lu", first);
+	else
+		m += sprintf(m, "%lu:%lu", first, last);
 
-	return r;
+	return m;
 }
 
 
 /*
- * Process the data that server sent due to IMAP FETCH BODYSTRUCTURE client
- * request.
+ * Process the data that server sent due to IMAP FETCH client request, ie.
+ * FETCH FLAGS, FETCH INTERNALDATE, FETCH RFC822.SIZE, FETCH BODYSTRUCTURE,
+ * FETCH BODY[HEADER], FETCH BODY[TEXT], FETCH BODY[HEADER.FIELDS (<fields>)],
+ * FETCH BODY[<part>], for one or more messages.
  */
 int
-response_fetchstructure(session *ssn, int tag, char **structure)
+response_fetch(session *ssn, int tag, fetchlist *fl)
 {
 	int r;
-	char *s;
-	regexp *re;
+	size_t line, pos;
+	const char *b, *e;
+	token tk;
 
-	if ((r = response_generic(ssn, tag)) < 0)
+	if ((r = scan_response(ssn, tag, 0, fl->sink)) < 0)
 		return r;
 
-	re = &responses[RESPONSE_FETCH];
-	if (!regexec(re->preg, ibuf.data, re->nmatch, re->pmatch, 0)) {
-		s = xstrndup(ibuf.data + re->pmatch[1].rm_so,
-		    re->pmatch[1].rm_eo - re->pmatch[1].rm_so);
-
-		re = &responses[RESPONSE_FETCH_STRUCTURE];
-		if (!regexec(re->preg, s, re->nmatch, re->pmatch, 0)) {
-			*structure = xstrndup(s + re->pmatch[1].rm_so,
-			    re->pmatch[1].rm_eo - re->pmatch[1].rm_so);
-		}
-		xfree(s);
+	line = pos = 0;
+	while ((b = scan_next(&line, &pos, NULL)) != NULL) {
+		e = ibuf.data + line;
+		if ((b = check_untagged(b, e, "FETCH", NULL)) != NULL &&
+		    token_next(b, e, &tk) != NULL && tk.type == TOKEN_LIST)
+			parse_fetch(tk.data, tk.data + tk.len, fl);
 	}
 
 	return r;
@@ -776,119 +1255,57 @@ response_fetchstructure(session *ssn, int tag, char **structure)
 
 
 /*
- * Process the data that server sent due to IMAP FETCH BODY[] client request,
- * ie. FETCH BODY[HEADER], FETCH BODY[TEXT], FETCH BODY[HEADER.FIELDS
- * (<fields>)], FETCH BODY[<part>].
+ * Process the data that server sent due to IMAP IDLE client request.
  */
 int
-response_fetchbody(session *ssn, int tag, char **body, size_t *len)
+response_idle(session *ssn, int tag, char **event)
 {
-	int r, match;
-	unsigned int offset;
 	ssize_t n;
-	regexp *re;
+	size_t line, pos;
+	int eintr = 0;
+	const char *b, *c, *e;
+	token tk;
 
 	if (tag == -1)
 		return STATUS_ERROR;
 
 	buffer_reset(&ibuf);
+	line = pos = 0;
 
-	match = -1;
-	offset = 0;
-	
-	re = &responses[RESPONSE_FETCH_BODY];
-
-	do {
+	for (;;) {
 		buffer_check(&ibuf, ibuf.len + INPUT_BUF);
-		if ((n = receive_response(ssn, ibuf.data + ibuf.len, 0, 1, NULL)) ==
-		    -1)
-			return STATUS_ERROR;
+		n = receive_response(ssn, ibuf.data + ibuf.len,
+		    get_option_number("keepalive") * 60, 0, &eintr);
+		if (n < 0) {
+			if (eintr)
+				return STATUS_INTERRUPT;
+			else
+				return STATUS_ERROR;
+		}
+		if (n == 0)
+			return STATUS_TIMEOUT;
 		ibuf.len += n;
 
-		if (match != 0) {
-			match = regexec(re->preg, ibuf.data, re->nmatch,
-			    re->pmatch, 0);
-			
-			if (match == 0 && re->pmatch[2].rm_so != -1 &&
-			    re->pmatch[2].rm_eo != -1) {
-				*len = strtoul(ibuf.data + re->pmatch[2].rm_so,
-				    NULL, 10);
-				offset = re->pmatch[0].rm_eo + *len;
-			}
-		}
+		while ((b = scan_next(&line, &pos, NULL)) != NULL) {
+			e = ibuf.data + line;
 
-		if (offset != 0 && ibuf.len >= offset) {
-			if (check_bye(ibuf.data + offset))
+			if (!strncasecmp(b, "* BYE", strlen("* BYE")))
 				return handle_bye(ssn);
-		}
-	} while (ibuf.len < offset || (r = check_tag(ibuf.data + offset, ssn,
-	    tag)) == STATUS_NONE);
-
-	if (match == 0) {
-		if (re->pmatch[2].rm_so != -1 &&
-		    re->pmatch[2].rm_eo != -1) {
-			*body = ibuf.data + re->pmatch[0].rm_eo;
-		} else {
-			*body = ibuf.data + re->pmatch[3].rm_so;
-			*len = re->pmatch[3].rm_eo - re->pmatch[3].rm_so;
-		}
-	}
-
-	return r;
-}
-
-
-/*
- * Process the data that server sent due to IMAP IDLE client request.
- */
-int
-response_idle(session *ssn, int tag, char **event)
-{
-	regexp *re;
-	ssize_t n;
-	int eintr = 0;
 
-	if (tag == -1)
-		return STATUS_ERROR;
+			if (e - b < 2 || b[0] != '*' || b[1] != ' ' ||
+			    (c = token_next(b + 2, e, &tk)) == NULL ||
+			    !isdigit((unsigned char)(*tk.data)) ||
+			    token_next(c, e, &tk) == NULL)
+				continue;
 
-	re = &responses[RESPONSE_UNTAGGED];
+			verbose("S (%d): %.*s", ssn->socket, (int)(e - b), b);
 
-	for (;;) {
-		buffer_reset(&ibuf);
-
-		do {
-			buffer_check(&ibuf, ibuf.len + INPUT_BUF);
-			n = receive_response(ssn, ibuf.data + ibuf.len,
-			    get_option_number("keepalive") * 60, 0, &eintr);
-			if (n < 0) {
-				if (eintr)
-					return STATUS_INTERRUPT;
-				else
-					return STATUS_ERROR;
+			if (get_option_boolean("wakeonany") ||
+			    token_equal(&tk, "RECENT") ||
+			    token_equal(&tk, "EXISTS")) {
+				*event = xstrndup(tk.data, tk.len);
+				return STATUS_UNTAGGED;
 			}
-			if (n == 0)
-				return STATUS_TIMEOUT;
-			ibuf.len += n;
-
-			if (check_bye(ibuf.data))
-				return handle_bye(ssn);
-
-		} while (regexec(re->preg, ibuf.data, re->nmatch, re->pmatch, 0));
-
-		verbose("S (%d): %s", ssn->socket, ibuf.data);
-
-		if (get_option_boolean("wakeonany"))
-			break;
-		if (!strncasecmp(ibuf.data + re->pmatch[1].rm_so,
-		    "RECENT", strlen("RECENT")))
-			break;
-		if (!strncasecmp(ibuf.data + re->pmatch[1].rm_so,
-		    "EXISTS", strlen("EXISTS")))
-			break;
+		}
 	}
-
-	*event = xstrndup(ibuf.data + re->pmatch[1].rm_so,
-	    re->pmatch[1].rm_eo - re->pmatch[1].rm_so);
-
-	return STATUS_UNTAGGED;
 }
@@ -4,6 +4,7 @@
 #include "imapfilter.h"
 #include "session.h"
 #include "list.h"
+#include "buffer.h"
 
 
 extern list *sessions;
@@ -21,6 +22,8 @@ session_new(void)
 	session *s = (session *)xmalloc(sizeof(session));
 
 	session_init(s);
+	buffer_init(&s->pending, INPUT_BUF);
+	buffer_init(&s->suspend.held, INPUT_BUF);
 
 	sessions = list_append(sessions, s);
 
@@ -36,17 +39,32 @@ session_init(session *ssn)
 {
 
 	ssn->socket = -1;
+	ssn->events = SOCKET_NONE;
 	ssn->sslconn = NULL;
 	ssn->protocol = PROTOCOL_NONE;
 	ssn->capabilities = CAPABILITY_NONE;
 	ssn->ns.prefix = NULL;
 	ssn->ns.delim = '\0';
+	ssn->compress = NULL;
 	ssn->utf8 = 0;
+	ssn->qresync = 0;
+	ssn->inflight.tags = NULL;
+	ssn->inflight.status = NULL;
+	ssn->inflight.len = 0;
+	ssn->inflight.size = 0;
+	ssn->suspend.allow = 0;
+	ssn->suspend.tag = 0;
+	ssn->suspend.expired = 0;
+	ssn->suspend.offset = 0;
+	ssn->suspend.literal = 0;
+	ssn->suspend.repeat = 0;
 }
 
 
 /*
- * Remove session from sessions linked list and free allocated memory.
+ * Remove session from sessions linked list and free allocated memory.  A
+ * connection still open is closed first, so that the socket is no longer
+ * watched for events that refer to the session.
  */
 void
 session_destroy(session *ssn)
@@ -55,11 +73,122 @@ session_destroy(session *ssn)
 	if (!ssn)
 		return;
 
+	if (ssn->socket != -1 || ssn->sslconn || ssn->compress)
+		close_connection(ssn);
+
 	sessions = list_remove(sessions, ssn);
 
 	if (ssn->ns.prefix) {
 		xfree(ssn->ns.prefix);
 		ssn->ns.prefix = NULL;
 	}
+	if (ssn->inflight.tags) {
+		xfree(ssn->inflight.tags);
+		xfree(ssn->inflight.status);
+	}
+	buffer_free(&ssn->pending);
+	buffer_free(&ssn->suspend.held);
 	xfree(ssn);
 }
+
+
+/*
+ * Add the tag of a command that was just sent to the table of commands in
+ * flight.
+ */
+void
+session_track(session *ssn, int tag)
+{
+
+	if (ssn->inflight.len == ssn->inflight.size) {
+		ssn->inflight.size = (ssn->inflight.size ? ssn->inflight.size *
+		    2 : 16);
+		ssn->inflight.tags = (int *)xrealloc(ssn->inflight.tags,
+		    ssn->inflight.size * sizeof(int));
+		ssn->inflight.status = (int *)xrealloc(ssn->inflight.status,
+		    ssn->inflight.size * sizeof(int));
+	}
+	ssn->inflight.tags[ssn->inflight.len] = tag;
+	ssn->inflight.status[ssn->inflight.len] = STATUS_NONE;
+	ssn->inflight.len++;
+}
+
+
+/*
+ * Record the status of a command in flight, returning true only the first
+ * time its completion is seen.
+ */
+int
+session_complete(session *ssn, int tag, int status)
+{
+	size_t i;
+
+	for (i = 0; i < ssn->inflight.len; i++)
+		if (ssn->inflight.tags[i] == tag) {
+			if (ssn->inflight.status[i] != STATUS_NONE)
+				return 0;
+			ssn->inflight.status[i] = status;
+			return 1;
+		}
+
+	return 0;
+}
+
+
+/*
+ * Get the status of a command in flight, without removing it from the table.
+ */
+int
+session_status(session *ssn, int tag)
+{
+	size_t i;
+
+	for (i = 0; i < ssn->inflight.len; i++)
+		if (ssn->inflight.tags[i] == tag)
+			return ssn->inflight.status[i];
+
+	return STATUS_NONE;
+}
+
+
+/*
+ * Get the status of a command, and remove it from the table of commands in
+ * flight if it has completed.
+ */
+int
+session_collect(session *ssn, int tag)
+{
+	int r;
+	size_t i;
+
+	for (i = 0; i < ssn->inflight.len; i++)
+		if (ssn->inflight.tags[i] == tag) {
+			if ((r = ssn->inflight.status[i]) == STATUS_NONE)
+				return r;
+			ssn->inflight.len--;
+			ssn->inflight.tags[i] =
+			    ssn->inflight.tags[ssn->inflight.len];
+			ssn->inflight.status[i] =
+			    ssn->inflight.status[ssn->inflight.len];
+			return r;
+		}
+
+	return STATUS_NONE;
+}
+
+
+/*
+ * Keep data that were received after the response of a command, so that they
+ * are processed together with the response of the next command.
+ */
+void
+session_pushback(session *ssn, const char *data, size_t len)
+{
+
+	buffer_check(&ssn->pending, ssn->pending.len + len);
+	memmove(ssn->pending.data + len, ssn->pending.data,
+	    ssn->pending.len);
+	memcpy(ssn->pending.data, data, len);
+	ssn->pending.len += len;
+	ssn->pending.data[ssn->pending.len] = '\0';
+}
@@ -4,11 +4,16 @@
 
 #include <openssl/ssl.h>
 
+#include "buffer.h"
+
 
 /* IMAP session. */
 typedef struct session {
 	int socket;		/* Socket. */
+	int events;		/* Readiness of the socket, as last reported
+				 * by the event loop. */
 	SSL *sslconn;		/* SSL connection. */
+	struct compress *compress;	/* Compression layer, if negotiated. */
 	unsigned int protocol;	/* IMAP protocol.  Currently IMAP4rev1 and
 				 * IMAP4 are supported. */
 	unsigned int capabilities;	/* Capabilities of the mail server. */
@@ -17,12 +22,37 @@ typedef struct session {
 		char delim;	/* Namespace delimiter. */
 	} ns;
 	int utf8; 		/* UTF8 enabled. */
+	int qresync;		/* CONDSTORE and QRESYNC enabled. */
+	struct {		/* Commands sent but not yet completed. */
+		int *tags;	/* Tags of the commands. */
+		int *status;	/* Status of each command, once completed. */
+		size_t len;	/* Number of commands in flight. */
+		size_t size;	/* Size of the table. */
+	} inflight;
+	buffer pending;		/* Data received that belong to responses of
+				 * later commands. */
+	struct {		/* Command suspended until its response is
+				 * received, so that its coroutine can yield. */
+		int allow;	/* The next command may be suspended. */
+		int tag;	/* Tag of the suspended command. */
+		int expired;	/* Timeout period expired while waiting. */
+		size_t offset;	/* Data pending that have been scanned. */
+		size_t literal;	/* Data of a literal still to be scanned. */
+		int repeat;	/* The coroutine is repeating the command. */
+		buffer held;	/* Response of the command, set aside while
+				 * others use the session. */
+	} suspend;
 } session;
 
 
 /*	session.c	*/
 session *session_new(void);
 void session_destroy(session *ssn);
+void session_track(session *ssn, int tag);
+int session_complete(session *ssn, int tag, int status);
+int session_status(session *ssn, int tag);
+int session_collect(session *ssn, int tag);
+void session_pushback(session *ssn, const char *data, size_t len);
 
 
 #endif				/* SESSION_H */
@@ -1,10 +1,44 @@
--- A simple implementation of sets.
+-- A simple implementation of sets.  The messages of a set are kept as sets of
+-- UIDs for each mailbox, and they are expanded to pairs of mailboxes and UIDs
+-- only when the set is indexed; from then on the pairs are used instead, as
+-- they may have been changed in any way.  With the lazy option, the results
+-- of searches are instead kept as the search queries for each mailbox, which
+-- are combined by the set operations and sent to the server only when they
+-- are needed.
 
 Set = {}
 
 Set._mt = {}
 setmetatable(Set, Set._mt)
 
+Set._lazy = (_VERSION ~= 'Lua 5.1' and _VERSION ~= 'Lua 5.2')
+
+
+local function _rawlen(t)
+    if rawlen then return rawlen(t) end
+    return #t
+end
+
+local function _queries(set)
+    if type(set) ~= 'table' then return end
+    return rawget(set, '_queries')
+end
+
+local function _empty(set)
+    return _queries(set) == nil and next(_extract_uids(set)) == nil
+end
+
+local function _conjunction(a, b)
+    if a == b then return a end
+    if type(b) == 'table' and b[1] == 'and' and (b[2] == a or b[3] == a) then
+        return b
+    end
+    if type(a) == 'table' and a[1] == 'and' and (a[2] == b or a[3] == b) then
+        return a
+    end
+    return { 'and', a, b }
+end
+
 
 function Set._new(self, values)
     local object
@@ -12,85 +46,144 @@ function Set._new(self, values)
     object = values or {}
 
     object._type = 'set'
+    object._expanded = true
 
-    for key, value in pairs(Set) do
-        if type(value) == 'function' then object[key] = value end
-    end
-
-    object._mt = {}
-    object._mt.__add = object._union
-    object._mt.__mul = object._intersection
-    object._mt.__sub = object._difference
-    setmetatable(object, object._mt)
+    setmetatable(object, Set._object_mt)
 
     return object
 end
 
-function Set._union(seta, setb)
+function Set._from(uids)
     local set = Set()
-    local t = {}
 
-    for _, v in ipairs(seta) do
-        b, m = table.unpack(v)
-        if not t[b] then t[b] = {} end
-        t[b][m] = true
-    end
-    for _, v in ipairs(setb) do
-        b, m = table.unpack(v)
-        if not t[b] then t[b] = {} end
-        t[b][m] = true
-    end
-    for b in pairs(t) do
-        for m in pairs(t[b]) do table.insert(set, { b, m }) end
+    set._uids = {}
+    for b, u in pairs(uids) do
+        if ifset.count(u) > 0 then set._uids[b] = u end
     end
+    set._expanded = false
+    if not Set._lazy then set._expand(set) end
 
     return set
 end
 
-function Set._intersection(seta, setb)
+function Set._query(queries)
     local set = Set()
-    local ta = {}
-    local tb = {}
 
-    for _, v in ipairs(seta) do
-        b, m = table.unpack(v)
-        if not ta[b] then ta[b] = {} end
-        ta[b][m] = true
+    set._queries = queries
+    set._expanded = false
+
+    return set
+end
+
+function Set._expand(self)
+    if rawget(self, '_expanded') then return end
+    for b, u in pairs(self._uidsets(self)) do ifset.append(u, self, b) end
+    self._expanded = true
+end
+
+function Set._index(self, key)
+    if type(key) ~= 'number' then
+        local method = rawget(Set, key)
+        if type(method) == 'function' then return method end
+        return
     end
-    for _, v in ipairs(setb) do
-        b, m = table.unpack(v)
-        if not tb[b] then tb[b] = {} end
-        tb[b][m] = true
+    if rawget(self, '_expanded') then return end
+    Set._expand(self)
+    return rawget(self, key)
+end
+
+function Set._length(self)
+    Set._expand(self)
+    return _rawlen(self)
+end
+
+function Set._uidsets(self)
+    if _queries(self) then
+        local t = {}
+        for b, q in pairs(self._queries) do
+            local r = b._send_query(b, { _make_expression(q) })
+            if r then t[b] = _extract_uids(r)[b] end
+        end
+        self._queries = nil
+        self._uids = t
+    elseif self._uids == nil or self._expanded then
+        local t = {}
+        for i = 1, _rawlen(self) do
+            local b, m = table.unpack(self[i])
+            if not t[b] then t[b] = {} end
+            table.insert(t[b], m)
+        end
+        self._uids = {}
+        for b, u in pairs(t) do self._uids[b] = ifset.new(u) end
     end
-    for b in pairs(ta) do
-        if tb[b] then
-            for m in pairs(ta[b]) do
-                if tb[b][m] then table.insert(set, { b, m }) end
-            end
+    return self._uids
+end
+
+
+function Set._union(seta, setb)
+    local t = {}
+
+    local qa, qb = _queries(seta), _queries(setb)
+    if qa and (qb or _empty(setb)) or qb and _empty(seta) then
+        for b, q in pairs(qa or {}) do t[b] = q end
+        for b, q in pairs(qb or {}) do
+            if t[b] then t[b] = { 'or', t[b], q } else t[b] = q end
         end
+        return Set._query(t)
     end
 
-    return set
+    for b, u in pairs(_extract_uids(seta)) do t[b] = u end
+    for b, u in pairs(_extract_uids(setb)) do
+        if t[b] then t[b] = ifset.union(t[b], u) else t[b] = u end
+    end
+
+    return Set._from(t)
 end
 
-function Set._difference(seta, setb)
-    local set = Set()
+function Set._intersection(seta, setb)
     local t = {}
 
-    for _, v in ipairs(seta) do
-        b, m = table.unpack(v)
-        if not t[b] then t[b] = {} end
-        t[b][m] = true
+    local qa, qb = _queries(seta), _queries(setb)
+    if qa and qb then
+        for b, q in pairs(qa) do
+            if qb[b] then t[b] = _conjunction(q, qb[b]) end
+        end
+        return Set._query(t)
     end
-    for _, v in ipairs(setb) do
-        b, m = table.unpack(v)
-        if t[b] then t[b][m] = nil end
+    if _empty(seta) or _empty(setb) then return Set() end
+
+    local tb = _extract_uids(setb)
+
+    for b, u in pairs(_extract_uids(seta)) do
+        if tb[b] then t[b] = ifset.intersection(u, tb[b]) end
     end
-    for b in pairs(t) do
-        for m in pairs(t[b]) do table.insert(set, { b, m }) end
+
+    return Set._from(t)
+end
+
+function Set._difference(seta, setb)
+    local t = {}
+
+    local qa, qb = _queries(seta), _queries(setb)
+    if qa and (qb or _empty(setb)) then
+        for b, q in pairs(qa) do
+            if qb and qb[b] then
+                t[b] = { 'and', q, { 'not', qb[b] } }
+            else
+                t[b] = q
+            end
+        end
+        return Set._query(t)
     end
+    if _empty(seta) then return Set() end
 
-    return set
+    local tb = _extract_uids(setb)
+
+    for b, u in pairs(_extract_uids(seta)) do
+        if tb[b] then t[b] = ifset.difference(u, tb[b]) else t[b] = u end
+    end
+
+    return Set._from(t)
 end
 
 
@@ -631,6 +724,20 @@ function Set.match_field(self, field, pattern)
     return self * set
 end
 
+function Set.match_rules(self, rules)
+    _check_required(rules, 'table')
+
+    local results = {}
+    for id in pairs(rules) do results[id] = Set() end
+    for mbox in pairs(_extract_mailboxes(self)) do
+        for id, set in pairs(mbox.match_rules(mbox, rules, self)) do
+            results[id] = results[id] + set
+        end
+    end
+    for id, set in pairs(results) do results[id] = self * set end
+    return results
+end
+
 function Set.match_header(self, pattern)
     _check_required(pattern, 'string')
 
@@ -662,4 +769,14 @@ function Set.match_message(self, pattern)
 end
 
 
+-- All the sets share one metatable, with the set operations, and that looks
+-- up their methods in the class.
+Set._object_mt = {}
+
+Set._object_mt.__add = Set._union
+Set._object_mt.__mul = Set._intersection
+Set._object_mt.__sub = Set._difference
+Set._object_mt.__index = Set._index
+Set._object_mt.__len = Set._length
+
 Set._mt.__call = Set._new
@@ -3,12 +3,18 @@
 #include <string.h>
 #include <strings.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/time.h>
-#include <sys/select.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -37,6 +43,18 @@ SSL_CTX *tls12ctx = NULL;
 #endif
 
 
+#ifdef __linux__
+#define EVENTS_MAX	64	/* Events retrieved from the event loop at once. */
+
+static int epfd = -1;		/* Event loop that all the sockets belong to. */
+static pid_t epowner = -1;	/* Process that created the event loop. */
+#endif
+
+
+int socket_register(session *ssn);
+int socket_unregister(session *ssn);
+int socket_connect(session *ssn, struct addrinfo *res);
+
 int handle_socket_error(session *ssn);
 int handle_secure_open_error(session *ssn);
 int handle_secure_error(session *ssn);
@@ -113,9 +131,11 @@ open_connection(session *ssn, const char *server, const char *port,
 		    res->ai_protocol);
 
 		if (sockfd >= 0) {
-			if (connect(sockfd, res->ai_addr, res->ai_addrlen) == 0)
+			ssn->socket = sockfd;
+			if (socket_connect(ssn, res) == 0)
 				break;
 
+			close_connection(ssn);
 			sockfd = -1;
 		}
 		res = res->ai_next;
@@ -130,8 +150,6 @@ open_connection(session *ssn, const char *server, const char *port,
 		return -1;
 	}
 
-	ssn->socket = sockfd;
-
 	if (sslproto) {
 		if (open_secure_connection(ssn, server, sslproto) == -1) {
 			close_connection(ssn);
@@ -143,6 +161,256 @@ open_connection(session *ssn, const char *server, const char *port,
 }
 
 
+/*
+ * Add the socket of a session to the event loop, after switching it to
+ * non-blocking mode.
+ */
+int
+socket_register(session *ssn)
+{
+	int flags;
+#ifdef __linux__
+	struct epoll_event ev;
+#endif
+
+	if ((flags = fcntl(ssn->socket, F_GETFL, 0)) == -1 ||
+	    fcntl(ssn->socket, F_SETFL, flags | O_NONBLOCK) == -1) {
+		error("setting socket to non-blocking mode; %s\n",
+		    strerror(errno));
+		return -1;
+	}
+
+	ssn->events = SOCKET_NONE;
+
+#ifdef __linux__
+	if (epfd == -1 || epowner != getpid()) {
+		if (epfd != -1)
+			close(epfd);
+		if ((epfd = epoll_create(EVENTS_MAX)) == -1) {
+			error("creating event loop; %s\n", strerror(errno));
+			return -1;
+		}
+		fcntl(epfd, F_SETFD, FD_CLOEXEC);
+		epowner = getpid();
+	}
+
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.ptr = ssn;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, ssn->socket, &ev) == -1) {
+		error("adding socket to event loop; %s\n", strerror(errno));
+		return -1;
+	}
+#endif
+
+	return 0;
+}
+
+
+/*
+ * Remove the socket of a session from the event loop.
+ */
+int
+socket_unregister(session *ssn)
+{
+#ifdef __linux__
+	struct epoll_event ev;
+
+	if (epfd == -1 || epowner != getpid())
+		return 0;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_DEL, ssn->socket, &ev) == -1 &&
+	    errno != ENOENT && errno != EBADF)
+		return -1;
+#else
+	(void)ssn;
+#endif
+
+	return 0;
+}
+
+
+/*
+ * Wait until the socket of a session is ready for any of the specified
+ * events, or the timeout period, if any, expires.  Readiness reported for the
+ * sockets of other sessions in the meantime is recorded in those sessions.
+ * Returns 1 if the socket is ready, 0 on timeout and -1 on error.
+ */
+int
+socket_wait(session *ssn, int events, long timeout)
+{
+#ifdef __linux__
+	int i, n, ms;
+	struct epoll_event ev[EVENTS_MAX];
+	struct timespec end, now;
+	session *s;
+
+	if (timeout > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		end.tv_sec += timeout;
+	}
+
+	while (!(ssn->events & events)) {
+		ms = -1;
+		if (timeout > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec > end.tv_sec ||
+			    (now.tv_sec == end.tv_sec &&
+			    now.tv_nsec >= end.tv_nsec))
+				return 0;
+			ms = (end.tv_sec - now.tv_sec) * 1000 +
+			    (end.tv_nsec - now.tv_nsec + 999999) / 1000000;
+		}
+
+		if ((n = epoll_wait(epfd, ev, EVENTS_MAX, ms)) == -1)
+			return -1;
+
+		for (i = 0; i < n; i++) {
+			s = (session *)(ev[i].data.ptr);
+			if (ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				s->events |= SOCKET_READ;
+			if (ev[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+				s->events |= SOCKET_WRITE;
+		}
+	}
+
+	return 1;
+#else
+	int r;
+	struct pollfd pfd;
+
+	if (ssn->events & events)
+		return 1;
+
+	pfd.fd = ssn->socket;
+	pfd.events = ((events & SOCKET_READ) ? POLLIN : 0) |
+	    ((events & SOCKET_WRITE) ? POLLOUT : 0);
+	pfd.revents = 0;
+
+	if ((r = poll(&pfd, 1, (timeout > 0 ? (int)(timeout * 1000) : -1))) <=
+	    0)
+		return r;
+
+	if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+		ssn->events |= SOCKET_READ;
+	if (pfd.revents & (POLLOUT | POLLHUP | POLLERR))
+		ssn->events |= SOCKET_WRITE;
+
+	return 1;
+#endif
+}
+
+
+/*
+ * Wait until the socket of any of the sessions has data to read, or the
+ * timeout period, if any, expires; a negative timeout only checks the sockets
+ * without waiting.  Returns 1 if a socket is ready, 0 on timeout and -1 on
+ * error.
+ */
+int
+socket_poll(session **ssns, size_t n, long timeout)
+{
+	size_t j;
+#ifdef __linux__
+	int i, k, ms;
+	struct epoll_event ev[EVENTS_MAX];
+	struct timespec end, now;
+	session *s;
+
+	if (timeout > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		end.tv_sec += timeout;
+	}
+
+	ms = -1;
+	for (;;) {
+		for (j = 0; j < n; j++)
+			if (ssns[j]->events & SOCKET_READ)
+				return 1;
+
+		if (timeout < 0) {
+			if (ms == 0)
+				return 0;
+			ms = 0;
+		} else if (timeout > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec > end.tv_sec ||
+			    (now.tv_sec == end.tv_sec &&
+			    now.tv_nsec >= end.tv_nsec))
+				return 0;
+			ms = (end.tv_sec - now.tv_sec) * 1000 +
+			    (end.tv_nsec - now.tv_nsec + 999999) / 1000000;
+		}
+
+		if ((k = epoll_wait(epfd, ev, EVENTS_MAX, ms)) == -1)
+			return -1;
+
+		for (i = 0; i < k; i++) {
+			s = (session *)(ev[i].data.ptr);
+			if (ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				s->events |= SOCKET_READ;
+			if (ev[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+				s->events |= SOCKET_WRITE;
+		}
+	}
+#else
+	int r;
+	struct pollfd pfd[n > 0 ? n : 1];
+
+	for (j = 0; j < n; j++) {
+		if (ssns[j]->events & SOCKET_READ)
+			return 1;
+		pfd[j].fd = ssns[j]->socket;
+		pfd[j].events = POLLIN;
+		pfd[j].revents = 0;
+	}
+
+	if ((r = poll(pfd, n, (timeout > 0 ? (int)(timeout * 1000) :
+	    (timeout < 0 ? 0 : -1)))) <= 0)
+		return r;
+
+	for (j = 0; j < n; j++)
+		if (pfd[j].revents & (POLLIN | POLLHUP | POLLERR))
+			ssns[j]->events |= SOCKET_READ;
+
+	return 1;
+#endif
+}
+
+
+/*
+ * Connect the socket of a session to the specified address, waiting no longer
+ * than the timeout period for the connection to be established.
+ */
+int
+socket_connect(session *ssn, struct addrinfo *res)
+{
+	int e;
+	socklen_t l;
+
+	if (socket_register(ssn) == -1)
+		return -1;
+
+	if (connect(ssn->socket, res->ai_addr, res->ai_addrlen) == 0)
+		return 0;
+	if (errno != EINPROGRESS)
+		return -1;
+
+	ssn->events &= ~SOCKET_WRITE;
+	if (socket_wait(ssn, SOCKET_WRITE,
+	    (long)(get_option_number("timeout"))) != 1)
+		return -1;
+
+	l = sizeof(e);
+	if (getsockopt(ssn->socket, SOL_SOCKET, SO_ERROR, &e, &l) == -1 ||
+	    e != 0)
+		return -1;
+
+	return 0;
+}
+
+
 /*
  * Initialize SSL/TLS connection.
  */
@@ -239,12 +507,28 @@ open_secure_connection(session *ssn, const char *server, const char *sslproto)
 			    "connection has been closed cleanly\n",
 			    server);
 			return handle_secure_open_error(ssn);
+		case SSL_ERROR_WANT_READ:
+			ssn->events &= ~SOCKET_READ;
+			if (socket_wait(ssn, SOCKET_READ,
+			    (long)(get_option_number("timeout"))) != 1) {
+				error("initiating SSL connection to %s; "
+				    "timeout period expired\n", server);
+				return handle_secure_open_error(ssn);
+			}
+			break;
+		case SSL_ERROR_WANT_WRITE:
+			ssn->events &= ~SOCKET_WRITE;
+			if (socket_wait(ssn, SOCKET_WRITE,
+			    (long)(get_option_number("timeout"))) != 1) {
+				error("initiating SSL connection to %s; "
+				    "timeout period expired\n", server);
+				return handle_secure_open_error(ssn);
+			}
+			break;
 		case SSL_ERROR_NONE:
 		case SSL_ERROR_WANT_CONNECT:
 		case SSL_ERROR_WANT_ACCEPT:
 		case SSL_ERROR_WANT_X509_LOOKUP:
-		case SSL_ERROR_WANT_READ:
-		case SSL_ERROR_WANT_WRITE:
 			break;
 		case SSL_ERROR_SYSCALL:
 			e = ERR_get_error();
@@ -289,9 +573,11 @@ close_connection(session *ssn)
 
 	r = 0;
 
+	compress_stop(ssn);
 	close_secure_connection(ssn);
 
 	if (ssn->socket != -1) {
+		socket_unregister(ssn);
 		r = close(ssn->socket);
 		ssn->socket = -1;
 
@@ -320,81 +606,84 @@ close_secure_connection(session *ssn)
 
 
 /*
- * Read data from socket.
+ * Read data from socket, through the compression layer if there is one.
  */
 ssize_t
 socket_read(session *ssn, char *buf, size_t len, long timeout, int timeoutfail, int *interrupt)
 {
-	int s;
-	ssize_t r;
-	fd_set fds;
-
-	struct timeval tv;
 
-	struct timeval *tvp;
+	if (ssn->compress)
+		return compress_read(ssn, buf, len, timeout, timeoutfail,
+		    interrupt);
 
-	r = 0;
-	s = 1;
-	tvp = NULL;
+	return socket_transport_read(ssn, buf, len, timeout, timeoutfail,
+	    interrupt);
+}
 
-	memset(buf, 0, len + 1);
 
-	if (timeout > 0) {
-		tv.tv_sec = timeout;
-		tv.tv_usec = 0;
-		tvp = &tv;
-	}
-
-	FD_ZERO(&fds);
-	FD_SET(ssn->socket, &fds);
+/*
+ * Read data from the plain or TLS/SSL connection.  With a negative timeout,
+ * nothing is read unless data are available without waiting.
+ */
+ssize_t
+socket_transport_read(session *ssn, char *buf, size_t len, long timeout,
+    int timeoutfail, int *interrupt)
+{
+	int s;
+	ssize_t r;
 
-	if (ssn->sslconn) {
-		if (SSL_pending(ssn->sslconn) > 0) {
-			r = socket_secure_read(ssn, buf, len);
-			if (r <= 0)
+	for (;;) {
+		if (ssn->sslconn) {
+			if ((r = socket_secure_read(ssn, buf, len)) == -1)
 				return handle_socket_error(ssn);
 		} else {
-			if (interrupt != NULL)
-				catch_user_signals();
-			if ((s = select(ssn->socket + 1, &fds, NULL, NULL, tvp)) > 0) {
-				if (interrupt != NULL)
-					ignore_user_signals();
-				if (FD_ISSET(ssn->socket, &fds)) {
-					r = socket_secure_read(ssn, buf, len);
-					if (r <= 0)
-						return handle_socket_error(ssn);
-				}
+			r = read(ssn->socket, buf, len);
+			if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				ssn->events &= ~SOCKET_READ;
+				r = 0;
+			} else if (r == -1 && errno == EINTR) {
+				r = 0;
+			} else if (r == -1) {
+				error("reading data; %s\n", strerror(errno));
+				return handle_socket_error(ssn);
+			} else if (r == 0) {
+				return handle_socket_error(ssn);
 			}
 		}
-	} else {
+		if (r > 0)
+			break;
+		if (timeout < 0)
+			return 0;
+
 		if (interrupt != NULL)
 			catch_user_signals();
-		if ((s = select(ssn->socket + 1, &fds, NULL, NULL, tvp)) > 0) {
-			if (interrupt != NULL)
-				ignore_user_signals();
-			if (FD_ISSET(ssn->socket, &fds)) {
-				r = read(ssn->socket, buf, len);
-				if (r == -1) {
-					error("reading data; %s\n", strerror(errno));
-					return handle_socket_error(ssn);
-				} else if (r == 0) {
-					return handle_socket_error(ssn);
-				}
+		s = socket_wait(ssn, (ssn->sslconn &&
+		    SSL_want_write(ssn->sslconn) ? SOCKET_WRITE : SOCKET_READ),
+		    timeout);
+		if (interrupt != NULL)
+			ignore_user_signals();
+
+		if (s == -1) {
+			if (errno != EINTR) {
+				error("waiting to read from socket; %s\n",
+				    strerror(errno));
+				return handle_socket_error(ssn);
+			}
+			if (interrupt != NULL) {
+				*interrupt = 1;
+				return -1;
 			}
+		} else if (s == 0) {
+			if (timeoutfail) {
+				error("timeout period expired while waiting to "
+				    "read data\n");
+				return handle_socket_error(ssn);
+			}
+			return 0;
 		}
 	}
 
-	if (s == -1) {
-		if (interrupt != NULL && errno == EINTR) {
-			*interrupt = 1;
-			return -1;
-		}
-		error("waiting to read from socket; %s\n", strerror(errno));
-		return handle_socket_error(ssn);
-	} else if (s == 0 && timeoutfail) {
-		error("timeout period expired while waiting to read data\n");
-		return handle_socket_error(ssn);
-	}
+	buf[r] = '\0';
 
 	return r;
 }
@@ -417,9 +706,13 @@ socket_secure_read(session *ssn, char *buf, size_t len)
 			error("reading data through SSL; the connection has "
 			    "been closed cleanly\n");
 			return handle_secure_error(ssn);
-		case SSL_ERROR_NONE:
 		case SSL_ERROR_WANT_READ:
+			ssn->events &= ~SOCKET_READ;
+			return 0;
 		case SSL_ERROR_WANT_WRITE:
+			ssn->events &= ~SOCKET_WRITE;
+			return 0;
+		case SSL_ERROR_NONE:
 		case SSL_ERROR_WANT_CONNECT:
 		case SSL_ERROR_WANT_ACCEPT:
 		case SSL_ERROR_WANT_X509_LOOKUP:
@@ -450,55 +743,68 @@ socket_secure_read(session *ssn, char *buf, size_t len)
 
 
 /*
- * Write data to socket.
+ * Write data to socket, through the compression layer if there is one.
  */
 ssize_t
 socket_write(session *ssn, const char *buf, size_t len)
+{
+
+	if (ssn->compress)
+		return compress_write(ssn, buf, len);
+
+	return socket_transport_write(ssn, buf, len);
+}
+
+
+/*
+ * Write data to the plain or TLS/SSL connection.
+ */
+ssize_t
+socket_transport_write(session *ssn, const char *buf, size_t len)
 {
 	int s;
 	ssize_t r, t;
-	fd_set fds;
 
 	r = t = 0;
-	s = 1;
-
-	FD_ZERO(&fds);
-	FD_SET(ssn->socket, &fds);
 
 	while (len) {
-		if ((s = select(ssn->socket + 1, NULL, &fds, NULL, NULL) > 0 &&
-		    FD_ISSET(ssn->socket, &fds))) {
-			if (ssn->sslconn) {
-				r = socket_secure_write(ssn, buf, len);
-
-				if (r <= 0)
-					return handle_socket_error(ssn);
-			} else {
-				r = write(ssn->socket, buf, len);
-
-				if (r == -1) {
-					error("writing data; %s\n",
-					    strerror(errno));
-					return handle_socket_error(ssn);
-				} else if (r == 0) {
-					return handle_socket_error(ssn);
-				}
+		if (ssn->sslconn) {
+			if ((r = socket_secure_write(ssn, buf, len)) == -1)
+				return handle_socket_error(ssn);
+		} else {
+			r = write(ssn->socket, buf, len);
+			if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				ssn->events &= ~SOCKET_WRITE;
+				r = 0;
+			} else if (r == -1 && errno == EINTR) {
+				continue;
+			} else if (r == -1) {
+				error("writing data; %s\n", strerror(errno));
+				return handle_socket_error(ssn);
+			} else if (r == 0) {
+				return handle_socket_error(ssn);
 			}
+		}
 
-			if (r > 0) {
-				len -= r;
-				buf += r;
-				t += r;
-			}
+		if (r > 0) {
+			len -= r;
+			buf += r;
+			t += r;
+			continue;
 		}
-	}
 
-	if (s == -1) {
-		error("waiting to write to socket; %s\n", strerror(errno));
-		return handle_socket_error(ssn);
-	} else if (s == 0) {
-		error("timeout period expired while waiting to write data\n");
-		return handle_socket_error(ssn);
+		s = socket_wait(ssn, (ssn->sslconn &&
+		    SSL_want_read(ssn->sslconn) ? SOCKET_READ : SOCKET_WRITE),
+		    (long)(get_option_number("timeout")));
+		if (s == -1 && errno != EINTR) {
+			error("waiting to write to socket; %s\n",
+			    strerror(errno));
+			return handle_socket_error(ssn);
+		} else if (s == 0) {
+			error("timeout period expired while waiting to write "
+			    "data\n");
+			return handle_socket_error(ssn);
+		}
 	}
 
 	return t;
@@ -522,9 +828,13 @@ socket_secure_write(session *ssn, const char *buf, size_t len)
 			error("writing data through SSL; the connection has "
 			    "been closed cleanly\n");
 			return handle_secure_error(ssn);
-		case SSL_ERROR_NONE:
 		case SSL_ERROR_WANT_READ:
+			ssn->events &= ~SOCKET_READ;
+			return 0;
 		case SSL_ERROR_WANT_WRITE:
+			ssn->events &= ~SOCKET_WRITE;
+			return 0;
+		case SSL_ERROR_NONE:
 		case SSL_ERROR_WANT_CONNECT:
 		case SSL_ERROR_WANT_ACCEPT:
 		case SSL_ERROR_WANT_X509_LOOKUP:
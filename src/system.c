@@ -5,6 +5,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <termios.h>
 
 #include <lua.h>
@@ -22,6 +23,8 @@ static int ifsys_read(lua_State *lua);
 static int ifsys_write(lua_State *lua);
 static int ifsys_sleep(lua_State *lua);
 static int ifsys_daemon(lua_State *lua);
+static int ifsys_fork(lua_State *lua);
+static int ifsys_wait(lua_State *lua);
 
 /* Lua imapfilter library of system's functions. */
 static const luaL_Reg ifsyslib[] = {
@@ -33,6 +36,8 @@ static const luaL_Reg ifsyslib[] = {
 	{ "write", ifsys_write },
 	{ "sleep", ifsys_sleep },
 	{ "daemon", ifsys_daemon },
+	{ "fork", ifsys_fork },
+	{ "wait", ifsys_wait },
 	{ NULL, NULL }
 };
 
@@ -301,6 +306,61 @@ ifsys_daemon(lua_State *lua)
 }
 
 
+/*
+ * Lua implementation of the POSIX fork() function; pending output is written
+ * out first, so that it is not repeated by the child process.
+ */
+static int
+ifsys_fork(lua_State *lua)
+{
+	pid_t pid;
+
+	if (lua_gettop(lua) != 0)
+		luaL_error(lua, "wrong number of arguments");
+
+	fflush(NULL);
+
+	if ((pid = fork()) == -1) {
+		error("forking; %s\n", strerror(errno));
+		return 0;
+	}
+
+	lua_pushinteger(lua, (lua_Integer) (pid));
+
+	return 1;
+}
+
+
+/*
+ * Wait for any child process to terminate, and return its process ID and
+ * exit status; a process killed by a signal is reported with an exit status
+ * greater than 128.
+ */
+static int
+ifsys_wait(lua_State *lua)
+{
+	pid_t pid;
+	int status;
+
+	if (lua_gettop(lua) != 0)
+		luaL_error(lua, "wrong number of arguments");
+
+	while ((pid = waitpid(-1, &status, 0)) == -1 && errno == EINTR);
+	if (pid == -1)
+		return 0;
+
+	lua_pushinteger(lua, (lua_Integer) (pid));
+	if (WIFEXITED(status))
+		lua_pushinteger(lua, (lua_Integer) (WEXITSTATUS(status)));
+	else if (WIFSIGNALED(status))
+		lua_pushinteger(lua, (lua_Integer) (128 + WTERMSIG(status)));
+	else
+		lua_pushinteger(lua, (lua_Integer) (-1));
+
+	return 2;
+}
+
+
 /*
  * Open imapfilter library of system's functions.
  */
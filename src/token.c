@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "imapfilter.h"
+#include "token.h"
+
+
+const char *token_skip(const char *b, const char *e);
+
+
+/*
+ * Get the token of the server data that starts at the specified position,
+ * after any spaces, ie. an atom, a quoted string, a literal, a parenthesized
+ * list or NIL.  Returns the position after the token, or NULL if there are no
+ * more tokens in the line or list, or if the data are malformed or incomplete.
+ */
+const char *
+token_next(const char *b, const char *e, token *tk)
+{
+	const char *c;
+
+	while (b < e && *b == ' ')
+		b++;
+
+	if (b >= e || *b == ')' || *b == '\r' || *b == '\n')
+		return NULL;
+
+	if ((c = token_skip(b, e)) == NULL)
+		return NULL;
+
+	switch (*b) {
+	case '{':
+		tk->type = TOKEN_LITERAL;
+		tk->len = strtoul(b + 1, NULL, 10);
+		tk->data = c - tk->len;
+		break;
+	case '"':
+		tk->type = TOKEN_QUOTED;
+		tk->data = b + 1;
+		tk->len = c - b - 2;
+		break;
+	case '(':
+		tk->type = TOKEN_LIST;
+		tk->data = b + 1;
+		tk->len = c - b - 2;
+		break;
+	default:
+		tk->type = TOKEN_ATOM;
+		tk->data = b;
+		tk->len = c - b;
+		if (token_equal(tk, "NIL"))
+			tk->type = TOKEN_NIL;
+		break;
+	}
+
+	return c;
+}
+
+
+/*
+ * Find the end of the token that starts at the specified position, or return
+ * NULL if the token is malformed or incomplete.
+ */
+const char *
+token_skip(const char *b, const char *e)
+{
+	const char *c;
+	char *t;
+	unsigned long n;
+
+	switch (*b) {
+	case '{':
+		n = strtoul(b + 1, &t, 10);
+		c = t;
+		if (c >= e || *c != '}')
+			return NULL;
+		if (++c < e && *c == '\r')
+			c++;
+		if (c >= e || *c != '\n')
+			return NULL;
+		c++;
+		if ((size_t)(e - c) < n)
+			return NULL;
+		return c + n;
+	case '"':
+		for (c = b + 1; c < e && *c != '"'; c++)
+			if (*c == '\\')
+				c++;
+		if (c >= e)
+			return NULL;
+		return c + 1;
+	case '(':
+		for (c = b + 1; c < e && *c != ')';) {
+			if (*c == ' ')
+				c++;
+			else if ((c = token_skip(c, e)) == NULL)
+				return NULL;
+		}
+		if (c >= e)
+			return NULL;
+		return c + 1;
+	default:
+		for (c = b; c < e && *c != ' ' && *c != '(' && *c != ')' &&
+		    *c != '\r' && *c != '\n'; c++)
+			if (*c == '[')
+				while (c + 1 < e && *(c + 1) != ']')
+					c++;
+		if (c == b)
+			return NULL;
+		return c;
+	}
+}
+
+
+/*
+ * Compare, ignoring case, the contents of a token with a string.
+ */
+int
+token_equal(const token *tk, const char *s)
+{
+
+	return (tk->len == strlen(s) && !strncasecmp(tk->data, s, tk->len));
+}
@@ -0,0 +1,31 @@
+#ifndef TOKEN_H
+#define TOKEN_H
+
+
+#include <stdio.h>
+
+
+/* Types of the tokens of the server data. */
+#define TOKEN_ATOM			1
+#define TOKEN_QUOTED			2
+#define TOKEN_LITERAL			3
+#define TOKEN_LIST			4
+#define TOKEN_NIL			5
+
+
+/* Token of the server data; it points inside the input buffer and is not NULL
+ * terminated. */
+typedef struct token {
+	int type;		/* Type of the token. */
+	const char *data;	/* Contents of the token, without the quotes,
+				 * the literal prefix or the parentheses. */
+	size_t len;		/* Length of the contents of the token. */
+} token;
+
+
+/*	token.c		*/
+const char *token_next(const char *b, const char *e, token *tk);
+int token_equal(const token *tk, const char *s);
+
+
+#endif				/* TOKEN_H */
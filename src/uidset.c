@@ -0,0 +1,603 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include "imapfilter.h"
+#include "uidset.h"
+
+
+#define UIDSET_META	"imapfilter.uidset"	/* Metatable of UID sets. */
+
+
+static int ifset_new(lua_State *lua);
+static int ifset_parse(lua_State *lua);
+static int ifset_union(lua_State *lua);
+static int ifset_intersection(lua_State *lua);
+static int ifset_difference(lua_State *lua);
+static int ifset_count(lua_State *lua);
+static int ifset_contains(lua_State *lua);
+static int ifset_uids(lua_State *lua);
+static int ifset_append(lua_State *lua);
+static int ifset_ranges(lua_State *lua);
+static int ifset_tostring(lua_State *lua);
+static int ifset_gc(lua_State *lua);
+
+int uidset_compare(const void *a, const void *b);
+
+
+/* Lua imapfilter library of UID set functions. */
+static const luaL_Reg ifsetlib[] = {
+	{ "new", ifset_new },
+	{ "parse", ifset_parse },
+	{ "union", ifset_union },
+	{ "intersection", ifset_intersection },
+	{ "difference", ifset_difference },
+	{ "count", ifset_count },
+	{ "contains", ifset_contains },
+	{ "uids", ifset_uids },
+	{ "append", ifset_append },
+	{ "ranges", ifset_ranges },
+	{ "tostring", ifset_tostring },
+	{ NULL, NULL }
+};
+
+
+/*
+ * Create an empty UID set as a userdata on the top of the stack.
+ */
+uidset *
+uidset_push(lua_State *lua)
+{
+	uidset *s;
+
+#if LUA_VERSION_NUM < 504
+	s = (uidset *)(lua_newuserdata(lua, sizeof(uidset)));
+#else
+	s = (uidset *)(lua_newuserdatauv(lua, sizeof(uidset), 0));
+#endif
+	memset(s, 0, sizeof(uidset));
+	luaL_getmetatable(lua, UIDSET_META);
+	lua_setmetatable(lua, -2);
+
+	return s;
+}
+
+
+/*
+ * Add a range of UIDs to the end of a set, merging it with the last range if
+ * they are adjacent; the ranges must be added in order for the set to stay
+ * sorted, otherwise the set has to be normalized afterwards.
+ */
+void
+uidset_add(uidset *s, unsigned int first, unsigned int last)
+{
+	uidrange *r;
+
+	if (s->len > 0) {
+		r = &s->ranges[s->len - 1];
+		if (first >= r->first && (r->last == UINT_MAX ||
+		    first <= r->last + 1)) {
+			if (last > r->last) {
+				s->count += last - r->last;
+				r->last = last;
+			}
+			return;
+		}
+	}
+
+	if (s->len == s->size) {
+		s->size = (s->size ? s->size * 2 : 16);
+		s->ranges = (uidrange *)xrealloc(s->ranges, s->size *
+		    sizeof(uidrange));
+	}
+	s->ranges[s->len].first = first;
+	s->ranges[s->len].last = last;
+	s->len++;
+	s->count += last - first + 1;
+}
+
+
+/*
+ * Sort the ranges of a set and merge those that overlap or are adjacent.
+ */
+void
+uidset_normalize(uidset *s)
+{
+	size_t i, n;
+	uidrange *r;
+
+	if (s->len < 2)
+		return;
+
+	qsort(s->ranges, s->len, sizeof(uidrange), uidset_compare);
+
+	r = s->ranges;
+	n = s->len;
+	s->len = 0;
+	s->count = 0;
+	for (i = 0; i < n; i++)
+		uidset_add(s, r[i].first, r[i].last);
+}
+
+
+/*
+ * Compare two ranges by their first UID.
+ */
+int
+uidset_compare(const void *a, const void *b)
+{
+	const uidrange *ra, *rb;
+
+	ra = (const uidrange *)a;
+	rb = (const uidrange *)b;
+
+	if (ra->first < rb->first)
+		return -1;
+	if (ra->first > rb->first)
+		return 1;
+	return 0;
+}
+
+
+/*
+ * Lua implementation of the function that creates a UID set from an optional
+ * table of UIDs.
+ */
+static int
+ifset_new(lua_State *lua)
+{
+	size_t i, n;
+	unsigned int u;
+	uidset *s;
+
+	if (lua_gettop(lua) > 1)
+		luaL_error(lua, "wrong number of arguments");
+	if (lua_gettop(lua) == 1)
+		luaL_checktype(lua, 1, LUA_TTABLE);
+
+	s = uidset_push(lua);
+
+	if (lua_gettop(lua) == 1)
+		return 1;
+
+#if LUA_VERSION_NUM < 502
+	n = lua_objlen(lua, 1);
+#else
+	n = lua_rawlen(lua, 1);
+#endif
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(lua, 1, i);
+		if (lua_type(lua, -1) == LUA_TNUMBER) {
+			u = (unsigned int)(lua_tonumber(lua, -1));
+			uidset_add(s, u, u);
+		}
+		lua_pop(lua, 1);
+	}
+	uidset_normalize(s);
+
+	lua_remove(lua, 1);
+
+	return 1;
+}
+
+
+/*
+ * Lua implementation of the function that creates a UID set from an IMAP
+ * sequence set, eg. "1:5,7".
+ */
+static int
+ifset_parse(lua_State *lua)
+{
+	unsigned long a, z;
+	const char *c;
+	char *e;
+	uidset *s;
+
+	if (lua_gettop(lua) != 1)
+		luaL_error(lua, "wrong number of arguments");
+	luaL_checktype(lua, 1, LUA_TSTRING);
+
+	s = uidset_push(lua);
+
+	for (c = lua_tostring(lua, 1); *c != '\0'; c = e) {
+		a = strtoul(c, &e, 10);
+		if (e == c) {
+			e++;
+			continue;
+		}
+		z = a;
+		if (*e == ':') {
+			c = e + 1;
+			z = strtoul(c, &e, 10);
+			if (e == c)
+				z = a;
+		}
+		if (a == 0 || z == 0)
+			continue;
+		if (z < a)
+			uidset_add(s, (unsigned int)z, (unsigned int)a);
+		else
+			uidset_add(s, (unsigned int)a, (unsigned int)z);
+	}
+	uidset_normalize(s);
+
+	lua_remove(lua, 1);
+
+	return 1;
+}
+
+
+/*
+ * Lua implementation of the function that returns the union of two UID sets.
+ */
+static int
+ifset_union(lua_State *lua)
+{
+	size_t i, j;
+	uidset *a, *b, *s;
+
+	if (lua_gettop(lua) != 2)
+		luaL_error(lua, "wrong number of arguments");
+	a = (uidset *)(luaL_checkudata(lua, 1, UIDSET_META));
+	b = (uidset *)(luaL_checkudata(lua, 2, UIDSET_META));
+
+	s = uidset_push(lua);
+
+	for (i = j = 0; i < a->len || j < b->len;)
+		if (j == b->len || (i < a->len &&
+		    a->ranges[i].first <= b->ranges[j].first)) {
+			uidset_add(s, a->ranges[i].first, a->ranges[i].last);
+			i++;
+		} else {
+			uidset_add(s, b->ranges[j].first, b->ranges[j].last);
+			j++;
+		}
+
+	lua_insert(lua, 1);
+	lua_pop(lua, 2);
+
+	return 1;
+}
+
+
+/*
+ * Lua implementation of the function that returns the intersection of two UID
+ * sets.
+ */
+static int
+ifset_intersection(lua_State *lua)
+{
+	size_t i, j;
+	unsigned int first, last;
+	uidset *a, *b, *s;
+
+	if (lua_gettop(lua) != 2)
+		luaL_error(lua, "wrong number of arguments");
+	a = (uidset *)(luaL_checkudata(lua, 1, UIDSET_META));
+	b = (uidset *)(luaL_checkudata(lua, 2, UIDSET_META));
+
+	s = uidset_push(lua);
+
+	for (i = j = 0; i < a->len && j < b->len;) {
+		first = (a->ranges[i].first > b->ranges[j].first ?
+		    a->ranges[i].first : b->ranges[j].first);
+		last = (a->ranges[i].last < b->ranges[j].last ?
+		    a->ranges[i].last : b->ranges[j].last);
+		if (first <= last)
+			uidset_add(s, first, last);
+		if (a->ranges[i].last < b->ranges[j].last)
+			i++;
+		else
+			j++;
+	}
+
+	lua_insert(lua, 1);
+	lua_pop(lua, 2);
+
+	return 1;
+}
+
+
+/*
+ * Lua implementation of the function that returns the difference of two UID
+ * sets.
+ */
+static int
+ifset_difference(lua_State *lua)
+{
+	size_t i, j;
+	unsigned int first;
+	uidset *a, *b, *s;
+
+	if (lua_gettop(lua) != 2)
+		luaL_error(lua, "wrong number of arguments");
+	a = (uidset *)(luaL_checkudata(lua, 1, UIDSET_META));
+	b = (uidset *)(luaL_checkudata(lua, 2, UIDSET_META));
+
+	s = uidset_push(lua);
+
+	for (i = j = 0; i < a->len; i++) {
+		first = a->ranges[i].first;
+		while (j < b->len && b->ranges[j].last < first)
+			j++;
+		while (j < b->len && b->ranges[j].first <= a->ranges[i].last) {
+			if (b->ranges[j].first > first)
+				uidset_add(s, first, b->ranges[j].first - 1);
+			if (b->ranges[j].last >= a->ranges[i].last)
+				break;
+			first = b->ranges[j].last + 1;
+			j++;
+		}
+		if (j == b->len || b->ranges[j].first > a->ranges[i].last)
+			uidset_add(s, first, a->ranges[i].last);
+	}
+
+	lua_insert(lua, 1);
+	lua_pop(lua, 2);
+
+	return 1;
+}
+
+
+/*
+ * Lua implementation of the function that returns the number of UIDs in a
+ * set.
+ */
+static int
+ifset_count(lua_State *lua)
+{
+	uidset *s;
+
+	s = (uidset *)(luaL_checkudata(lua, 1, UIDSET_META));
+
+	lua_settop(lua, 0);
+
+	lua_pushinteger(lua, (lua_Integer)(s->count));
+
+	return 1;
+}
+
+
+/*
+ * Lua implementation of the function that checks if a UID is in a set.
+ */
+static int
+ifset_contains(lua_State *lua)
+{
+	size_t l, h, m;
+	unsigned int u;
+	uidset *s;
+
+	if (lua_gettop(lua) != 2)
+		luaL_error(lua, "wrong number of arguments");
+	s = (uidset *)(luaL_checkudata(lua, 1, UIDSET_META));
+	luaL_checktype(lua, 2, LUA_TNUMBER);
+
+	u = (unsigned int)(lua_tonumber(lua, 2));
+
+	lua_pop(lua, 2);
+
+	for (l = 0, h = s->len; l < h;) {
+		m = l + (h - l) / 2;
+		if (u < s->ranges[m].first)
+			h = m;
+		else if (u > s->ranges[m].last)
+			l = m + 1;
+		else {
+			lua_pushboolean(lua, 1);
+			return 1;
+		}
+	}
+
+	lua_pushboolean(lua, 0);
+
+	return 1;
+}
+
+
+/*
+ * Lua implementation of the function that returns the UIDs of a set in a
+ * table, in ascending order.
+ */
+static int
+ifset_uids(lua_State *lua)
+{
+	size_t i;
+	unsigned int u;
+	lua_Integer n;
+	uidset *s;
+
+	if (lua_gettop(lua) != 1)
+		luaL_error(lua, "wrong number of arguments");
+	s = (uidset *)(luaL_checkudata(lua, 1, UIDSET_META));
+
+	lua_createtable(lua, (int)(s->count), 0);
+	for (i = 0, n = 1; i < s->len; i++) {
+		u = s->ranges[i].first;
+		do {
+			lua_pushinteger(lua, (lua_Integer)(u));
+			lua_rawseti(lua, -2, n++);
+		} while (u++ != s->ranges[i].last);
+	}
+
+	lua_remove(lua, 1);
+
+	return 1;
+}
+
+
+/*
+ * Lua implementation of the function that appends the messages of a set to
+ * the end of a table, as pairs of the specified mailbox and of the UID of
+ * each message, and returns the new length of the table.
+ */
+static int
+ifset_append(lua_State *lua)
+{
+	size_t i;
+	unsigned int u;
+	lua_Integer n;
+	uidset *s;
+
+	if (lua_gettop(lua) != 3)
+		luaL_error(lua, "wrong number of arguments");
+	s = (uidset *)(luaL_checkudata(lua, 1, UIDSET_META));
+	luaL_checktype(lua, 2, LUA_TTABLE);
+
+#if LUA_VERSION_NUM < 502
+	n = lua_objlen(lua, 2);
+#else
+	n = lua_rawlen(lua, 2);
+#endif
+	for (i = 0; i < s->len; i++) {
+		u = s->ranges[i].first;
+		do {
+			lua_createtable(lua, 2, 0);
+			lua_pushvalue(lua, 3);
+			lua_rawseti(lua, -2, 1);
+			lua_pushinteger(lua, (lua_Integer)(u));
+			lua_rawseti(lua, -2, 2);
+			lua_rawseti(lua, 2, ++n);
+		} while (u++ != s->ranges[i].last);
+	}
+
+	lua_pop(lua, 3);
+
+	lua_pushinteger(lua, n);
+
+	return 1;
+}
+
+
+/*
+ * Lua implementation of the function that returns the ranges of a set as a
+ * table of IMAP sequence sets, eg. "1:5", splitting the ranges so that none
+ * spans more than the specified number of UIDs.
+ */
+static int
+ifset_ranges(lua_State *lua)
+{
+	size_t i;
+	unsigned int first, last, span;
+	lua_Integer n;
+	char b[32];
+	uidset *s;
+
+	if (lua_gettop(lua) != 2)
+		luaL_error(lua, "wrong number of arguments");
+	s = (uidset *)(luaL_checkudata(lua, 1, UIDSET_META));
+	luaL_checktype(lua, 2, LUA_TNUMBER);
+
+	if (lua_tonumber(lua, 2) >= (lua_Number)(UINT_MAX))
+		span = UINT_MAX;
+	else if (lua_tonumber(lua, 2) > 0)
+		span = (unsigned int)(lua_tonumber(lua, 2));
+	else
+		span = 0;
+
+	lua_pop(lua, 2);
+
+	lua_createtable(lua, (int)(s->len), 0);
+	for (i = 0, n = 1; i < s->len; i++) {
+		first = s->ranges[i].first;
+		do {
+			last = s->ranges[i].last;
+			if (last - first > span)
+				last = first + span;
+			if (first == last)
+				snprintf(b, sizeof(b), "%u", first);
+			else
+				snprintf(b, sizeof(b), "%u:%u", first, last);
+			lua_pushstring(lua, b);
+			lua_rawseti(lua, -2, n++);
+		} while ((first = last + 1) != 0 &&
+		    last != s->ranges[i].last);
+	}
+
+	return 1;
+}
+
+
+/*
+ * Lua implementation of the function that returns a UID set as an IMAP
+ * sequence set, eg. "1:5,7".
+ */
+static int
+ifset_tostring(lua_State *lua)
+{
+	size_t i;
+	char b[32];
+	uidset *s;
+	luaL_Buffer lb;
+
+	s = (uidset *)(luaL_checkudata(lua, 1, UIDSET_META));
+
+	lua_settop(lua, 0);
+
+	luaL_buffinit(lua, &lb);
+	for (i = 0; i < s->len; i++) {
+		if (s->ranges[i].first == s->ranges[i].last)
+			snprintf(b, sizeof(b), "%s%u", i ? "," : "",
+			    s->ranges[i].first);
+		else
+			snprintf(b, sizeof(b), "%s%u:%u", i ? "," : "",
+			    s->ranges[i].first, s->ranges[i].last);
+		luaL_addstring(&lb, b);
+	}
+	luaL_pushresult(&lb);
+
+	return 1;
+}
+
+
+/*
+ * Free the ranges of a UID set when it is garbage collected.
+ */
+static int
+ifset_gc(lua_State *lua)
+{
+	uidset *s;
+
+	s = (uidset *)(luaL_checkudata(lua, 1, UIDSET_META));
+
+	if (s->ranges != NULL) {
+		xfree(s->ranges);
+		s->ranges = NULL;
+	}
+
+	lua_pop(lua, 1);
+
+	return 0;
+}
+
+
+/*
+ * Open imapfilter library of UID set functions.
+ */
+LUALIB_API int
+luaopen_ifset(lua_State *lua)
+{
+
+	luaL_newmetatable(lua, UIDSET_META);
+	lua_pushcfunction(lua, ifset_gc);
+	lua_setfield(lua, -2, "__gc");
+	lua_pushcfunction(lua, ifset_count);
+	lua_setfield(lua, -2, "__len");
+	lua_pushcfunction(lua, ifset_tostring);
+	lua_setfield(lua, -2, "__tostring");
+	lua_pop(lua, 1);
+
+#if LUA_VERSION_NUM < 502
+	luaL_register(lua, "ifset", ifsetlib);
+#else
+	luaL_newlib(lua, ifsetlib);
+	lua_setglobal(lua, "ifset");
+#endif
+
+	return 1;
+}
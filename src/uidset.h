@@ -0,0 +1,30 @@
+#ifndef UIDSET_H
+#define UIDSET_H
+
+
+#include <lua.h>
+
+
+/* Range of consecutive UIDs. */
+typedef struct uidrange {
+	unsigned int first;	/* First UID of the range. */
+	unsigned int last;	/* Last UID of the range. */
+} uidrange;
+
+/* Set of the UIDs of the messages of a mailbox, kept as sorted and disjoint
+ * ranges. */
+typedef struct uidset {
+	uidrange *ranges;	/* Ranges of the set. */
+	size_t len;		/* Number of ranges. */
+	size_t size;		/* Maximum number of ranges. */
+	unsigned long count;	/* Number of UIDs. */
+} uidset;
+
+
+/*	uidset.c	*/
+uidset *uidset_push(lua_State *lua);
+void uidset_add(uidset *s, unsigned int first, unsigned int last);
+void uidset_normalize(uidset *s);
+
+
+#endif				/* UIDSET_H */